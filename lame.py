@@ -2,6 +2,30 @@
 
 # $Id$
 
+import array
+import collections
+import errno
+import fcntl
+import hashlib
+import itertools
+import json
+import math
+import os
+import select
+import socket
+import stat
+import struct
+import sys
+import tempfile
+import threading
+import warnings
+import wave
+
+try:
+    import queue
+except ImportError:
+    import Queue as queue
+
 from _lame import *
 
 __all__ = ['ASM_3DNOW', 'ASM_MMX', 'ASM_SSE',
@@ -18,9 +42,19 @@ __all__ = ['ASM_3DNOW', 'ASM_MMX', 'ASM_SSE',
            'PRESET_VBR_6', 'PRESET_VBR_7', 'PRESET_VBR_8', 'PRESET_VBR_9',
            'VBR_MODE_ABR', 'VBR_MODE_DEFAULT', 'VBR_MODE_MTRH', 'VBR_MODE_OFF',
            'VBR_MODE_RH',
-           'Encoder', 'EncoderError', 'module_version', 'version',
+           'Encoder', 'EncoderError', 'cpu_features', 'crc16', 'decode',
+           'loudness', 'memory_usage', 'module_version', 'mp3_frames',
+           'quality_report', 'version',
            # Local exports
-           'url']
+           'CachingEncoder', 'EncodeCache', 'EncodeClient', 'EncodeServer',
+           'EncoderPool', 'LAMED_SOCKET', 'Ladder', 'Segmenter',
+           'album_gain', 'configure', 'cut_mp3', 'edit_mp3', 'encode_file',
+           'encode_ladder', 'join_mp3',
+           'measure_loudness', 'memory_per_stream', 'new_encoder',
+           'normalize_gain', 'quality_check',
+           'encode_to_target', 'read_seek_index',
+           'search_settings', 'seek_offset',
+           'url', 'write_seek_index']
 
 # Pull from C compile time.
 __version__ = module_version
@@ -31,3 +65,2219 @@ def url():
     Deprecated (will be removed in LAME 3.100), use lame.LAME_URL instead.
     """
     return LAME_URL
+
+
+def configure(encoder, settings):
+    """
+    Apply a dictionary of settings to an encoder.
+
+    Keys are the names of the set_*() methods without their prefix
+    (e.g. 'vbr_quality') or the names of writable attributes (e.g.
+    'num_channels').  A 'preset' is applied first, as LAME lets it
+    override the other settings; the rest follow in sorted order so the
+    same dictionary always configures the same encoder.
+    """
+    keys = sorted(settings)
+    if 'preset' in settings:
+        keys.remove('preset')
+        keys.insert(0, 'preset')
+
+    for key in keys:
+        value = settings[key]
+        setter = getattr(encoder, 'set_' + key, None)
+        if setter is None:
+            setattr(encoder, key, value)
+        elif isinstance(value, tuple):
+            setter(*value)
+        else:
+            setter(value)
+
+    return encoder
+
+
+def new_encoder(settings):
+    """Return an initialized Encoder configured from a settings dictionary."""
+    encoder = Encoder()
+    configure(encoder, settings)
+    encoder.init()
+    return encoder
+
+
+def _run_parallel(func, jobs, workers):
+    """Run func(job) for all jobs on up to 'workers' threads, in order."""
+    results = [None] * len(jobs)
+    errors = []
+    lock = threading.Lock()
+    pending = list(range(len(jobs)))
+    pending.reverse()
+
+    def worker():
+        while True:
+            lock.acquire()
+            try:
+                if errors or not pending:
+                    return
+                index = pending.pop()
+            finally:
+                lock.release()
+            try:
+                results[index] = func(jobs[index])
+            except Exception as e:
+                lock.acquire()
+                errors.append(e)
+                lock.release()
+
+    threads = [threading.Thread(target=worker)
+               for i in range(max(1, min(workers, len(jobs))))]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    if errors:
+        raise errors[0]
+    return results
+
+
+def _sample_segments(pcm, frame_bytes, samplerate, count, seconds):
+    """Cut 'count' evenly spaced segments of 'seconds' length out of pcm."""
+    total = len(pcm) // frame_bytes
+    length = int(seconds * samplerate)
+    if total <= count * length:
+        return [pcm[:total * frame_bytes]]
+
+    stride = (total - length) // max(1, count - 1)
+    return [pcm[i * stride * frame_bytes:(i * stride + length) * frame_bytes]
+            for i in range(count)]
+
+
+def _tag_frame_bytes(config):
+    """Size of the Xing/LAME tag frame in front of an encode configured
+    like config (see Encoder.get_config()), as LAME's InitVbrTag() has it."""
+    out = config['out_samplerate']
+    if VBR_MODE_OFF == config['vbr']:
+        kbps = config['bitrate']
+    else:
+        kbps = out >= 32000 and 128 or out >= 16000 and 64 or 8
+    return (out >= 32000 and 2 or 1) * 72000 * kbps // out
+
+
+def _trial_encode(job):
+    """Encode a trial segment; returns (mp3_data, seconds encoded, bytes
+    of the tag frame the settings would put in front)."""
+    settings, pcm = job
+    encoder = Encoder()
+    configure(encoder, settings)
+    encoder.set_write_vbr_tag(0)
+    encoder.set_num_samples(len(pcm) // (2 * settings['num_channels']))
+    encoder.init()
+    data = encoder.encode_interleaved(pcm) + encoder.flush_buffers()
+    config = encoder.get_config()
+    tag = 0
+    if settings.get('write_vbr_tag', 1):
+        tag = _tag_frame_bytes(config)
+    seconds = (max(1, encoder.frame_num) * encoder.framesize
+               / float(config['out_samplerate']))
+    return data, seconds, tag
+
+
+def _interpolate(points, x):
+    """Piecewise linear interpolation (and extrapolation) over (x, y)."""
+    points = sorted(points)
+    if 1 == len(points):
+        return points[0][1]
+    for i in range(1, len(points)):
+        if x <= points[i][0] or i == len(points) - 1:
+            (x0, y0), (x1, y1) = points[i - 1], points[i]
+            if x1 == x0:
+                # Two candidates measured the same; no slope to follow.
+                return y0
+            return y0 + (y1 - y0) * (x - x0) / float(x1 - x0)
+
+
+def search_settings(pcm, settings, target_bytes=None, quality=None,
+                    min_quality=None, mode='vbr', candidates=None,
+                    segments=6, segment_seconds=3.0, workers=4):
+    """
+    Find the settings that meet a size or quality target.
+
+    pcm is interleaved 16 bit audio, settings a dictionary as used by
+    configure() which must contain 'num_channels' and 'in_samplerate'.
+    Short segments sampled across the input are encoded concurrently on
+    several encoders with candidate settings, instead of encoding the
+    whole input over and over.
+
+    With target_bytes the best VBR quality level (mode 'vbr') or the
+    highest ABR bitrate (mode 'abr') whose predicted output fits is
+    chosen, from a size model fitted to the trial encodes.  With
+    quality(segment_pcm, mp3_data) and min_quality the cheapest VBR level
+    whose worst segment still scores min_quality is chosen.
+
+    Returns a copy of settings with the chosen vbr/vbr_quality or
+    vbr/abr_bitrate entries.
+    """
+    if (target_bytes is None) == (quality is None):
+        raise ValueError('give exactly one of target_bytes or quality')
+    if mode not in ('vbr', 'abr') or (quality is not None and 'abr' == mode):
+        raise ValueError('mode must be vbr (or abr with target_bytes)')
+
+    frame_bytes = 2 * settings['num_channels']
+    samplerate = settings['in_samplerate']
+    total_samples = len(pcm) // frame_bytes
+    chosen = dict(settings)
+    chosen.pop('preset', None)
+
+    if 'abr' == mode:
+        chosen['vbr'] = VBR_MODE_ABR
+        key, default = 'abr_bitrate', (64, 128, 192, 256)
+    else:
+        chosen['vbr'] = VBR_MODE_DEFAULT
+        key, default = 'vbr_quality', (0, 3, 6, 9)
+        if quality is not None:
+            default = range(10)
+    if candidates is None:
+        candidates = default
+
+    pieces = _sample_segments(pcm, frame_bytes, samplerate, segments,
+                              segment_seconds)
+    jobs = []
+    for value in candidates:
+        trial = dict(chosen)
+        trial[key] = value
+        jobs.extend([(trial, piece) for piece in pieces])
+    results = _run_parallel(_trial_encode, jobs, workers)
+
+    if quality is not None:
+        # VBR levels from the cheapest (9) to the best (0).
+        for n, value in sorted(enumerate(candidates), key=lambda c: -c[1]):
+            trials = results[n * len(pieces):(n + 1) * len(pieces)]
+            scores = [quality(piece, trial[0])
+                      for piece, trial in zip(pieces, trials)]
+            if min(scores) >= min_quality:
+                chosen[key] = value
+                return chosen
+        raise EncoderError('no candidate reaches the requested quality')
+
+    # Size model: bytes per second against the candidate setting,
+    # interpolated on a log scale for VBR levels, plus the tag frame.
+    # Seconds rather than frames, as LAME resamples at low settings.
+    points = []
+    tags = []
+    for n, value in enumerate(candidates):
+        trials = results[n * len(pieces):(n + 1) * len(pieces)]
+        rate = (sum([len(trial[0]) for trial in trials])
+                / sum([trial[1] for trial in trials]))
+        if 'abr' == mode:
+            points.append((value, rate))
+        else:
+            points.append((value, math.log(rate)))
+        tags.append((value, trials[0][2]))
+
+    # Priming and flushing add about two frames to the input length.
+    framesize = samplerate <= 24000 and 576 or 1152
+    seconds = (total_samples + 2 * framesize) / float(samplerate)
+
+    def predicted(value):
+        rate = _interpolate(points, value)
+        if 'abr' != mode:
+            rate = math.exp(rate)
+        return rate * seconds + _interpolate(tags, value)
+
+    if 'abr' == mode:
+        low, high = 8, 320
+        while low < high:
+            middle = (low + high + 1) // 2
+            if predicted(middle) <= target_bytes:
+                low = middle
+            else:
+                high = middle - 1
+        chosen[key] = low
+    else:
+        fitting = [q for q in range(10) if predicted(q) <= target_bytes]
+        if fitting:
+            chosen[key] = min(fitting)
+        else:
+            chosen[key] = 9
+
+    return chosen
+
+
+def encode_to_target(pcm, settings, **kwargs):
+    """
+    Search the settings with search_settings() and encode pcm with them.
+
+    Returns a (mp3_data, settings) tuple; the Xing/LAME tag is already
+    filled in if the settings enable it.  An encode that still comes out
+    over target_bytes is done again a VBR level lower, or at an ABR
+    bitrate lowered by the excess, until it fits or nothing is left.
+    """
+    chosen = search_settings(pcm, settings, **kwargs)
+    target_bytes = kwargs.get('target_bytes')
+    while True:
+        data = _encode_tagged(pcm, chosen)
+        if target_bytes is None or len(data) <= target_bytes:
+            break
+        if VBR_MODE_ABR == chosen['vbr']:
+            bitrate = chosen['abr_bitrate']
+            if bitrate <= 8:
+                break
+            chosen['abr_bitrate'] = max(8, min(
+                bitrate - 1, bitrate * target_bytes // len(data)))
+        else:
+            if chosen['vbr_quality'] >= 9:
+                break
+            chosen['vbr_quality'] += 1
+    return data, chosen
+
+
+def _encode_tagged(pcm, settings):
+    """Encode pcm as a whole, with the Xing/LAME tag filled in."""
+    encoder = Encoder()
+    configure(encoder, settings)
+    encoder.set_num_samples(len(pcm) // (2 * settings['num_channels']))
+    encoder.init()
+    data = encoder.encode_interleaved(pcm) + encoder.flush_buffers()
+
+    try:
+        tag = encoder.get_lametag_frame()
+    except EncoderError:
+        return data
+    return tag + data[len(tag):]
+
+
+class EncodeCache(object):
+    """
+    Content addressed on-disk store of encoded MP3 data.
+
+    Entries are keyed by a digest of the input PCM, of the effective
+    encoder configuration (Encoder.get_config()) and of the LAME version,
+    so an identical job is served from the store instead of encoded again.
+    num_samples only sizes the placeholder tag frame, which is rewritten
+    once the encode is done, and lean only changes how the binding holds
+    its buffers, so both are left out of the key: such jobs share their
+    entries.
+    """
+
+    # get_config() entries that do not change the encoded output.
+    neutral = ('lean', 'num_samples')
+
+    def __init__(self, directory):
+        self.directory = directory
+        if not os.path.isdir(directory):
+            os.makedirs(directory)
+
+    def key(self, encoder, pcm_digest):
+        """Cache key for an initialized encoder and a PCM SHA-1 hexdigest."""
+        digest = hashlib.sha1()
+        digest.update(LAME_VERSION.encode('ascii'))
+        config = encoder.get_config()
+        for name in self.neutral:
+            config.pop(name, None)
+        digest.update(repr(sorted(config.items())).encode('ascii'))
+        digest.update(pcm_digest.encode('ascii'))
+        return digest.hexdigest()
+
+    def path(self, key):
+        return os.path.join(self.directory, key[:2], key[2:] + '.mp3')
+
+    def get(self, key):
+        """Return the cached MP3 data for key, or None."""
+        try:
+            f = open(self.path(key), 'rb')
+        except IOError:
+            return None
+        try:
+            return f.read()
+        finally:
+            f.close()
+
+    def put(self, key, data):
+        """Store MP3 data under key."""
+        f, name = self.temporary()
+        try:
+            f.write(data)
+        finally:
+            f.close()
+        self.commit(key, name)
+
+    def temporary(self):
+        """Return an open (file, name) pair to be passed to commit()."""
+        handle, name = tempfile.mkstemp(suffix='.tmp', dir=self.directory)
+        return os.fdopen(handle, 'w+b'), name
+
+    def commit(self, key, name):
+        """Atomically move a finished temporary file into the store."""
+        path = self.path(key)
+        if not os.path.isdir(os.path.dirname(path)):
+            try:
+                os.makedirs(os.path.dirname(path))
+            except OSError:
+                pass    # created concurrently
+        os.rename(name, path)
+
+
+def _patch_lametag(encoder, f):
+    """Write the Xing/LAME tag over the placeholder frame at the start."""
+    try:
+        tag = encoder.get_lametag_frame()
+    except EncoderError:
+        return
+    f.seek(0)
+    f.write(tag)
+    f.seek(0, 2)
+
+
+class CachingEncoder(object):
+    """
+    Wrap an initialized Encoder to fill an EncodeCache.
+
+    The input PCM is hashed incrementally while it is encoded and the
+    output is spooled next to the store; flush_buffers() files it under
+    the resulting key (see 'key').  close() discards the spooled output
+    of an encode that is abandoned before that.  Everything else is
+    passed through to the wrapped encoder.
+    """
+
+    def __init__(self, encoder, cache):
+        self.encoder = encoder
+        self.cache = cache
+        self.key = None
+        self._pcm = hashlib.sha1()
+        self._spool, self._spool_name = cache.temporary()
+
+    def __getattr__(self, name):
+        return getattr(self.encoder, name)
+
+    def encode_interleaved(self, pcm):
+        self._pcm.update(pcm)
+        data = self.encoder.encode_interleaved(pcm)
+        self._spool.write(data)
+        return data
+
+    def flush_buffers(self):
+        data = self.encoder.flush_buffers()
+        self._spool.write(data)
+        _patch_lametag(self.encoder, self._spool)
+        self._spool.close()
+        self.key = self.cache.key(self.encoder, self._pcm.hexdigest())
+        self.cache.commit(self.key, self._spool_name)
+        self._spool_name = None
+        return data
+
+    def close(self):
+        """Remove the spool file unless flush_buffers() committed it."""
+        if self._spool_name is None:
+            return
+        self._spool.close()
+        try:
+            os.remove(self._spool_name)
+        except OSError:
+            pass
+        self._spool_name = None
+
+    def __del__(self):
+        if self.__dict__.get('_spool_name') is not None:
+            self.close()
+
+
+def _open_sound(path):
+    """Open a WAVE, AIFF or Sun AU file; returns (file, needs_byteswap)."""
+    errors = []
+    for name, big_endian in (('wave', False), ('aifc', True),
+                             ('sunau', True)):
+        # aifc and sunau are deprecated and gone since Python 3.13.
+        try:
+            with warnings.catch_warnings():
+                warnings.simplefilter('ignore', DeprecationWarning)
+                module = __import__(name)
+        except ImportError:
+            continue
+        try:
+            sound = module.open(path, 'rb')
+        except (module.Error, EOFError) as e:
+            errors.append('%s: %s' % (module.__name__, e))
+            continue
+        return sound, big_endian != ('big' == sys.byteorder)
+    raise EncoderError('unknown file format (%s)' % '; '.join(errors))
+
+
+def _read_pcm(sound, swap, count):
+    """Read up to count frames as native endian 16 bit PCM."""
+    frames = sound.readframes(count)
+    if swap and frames:
+        samples = array.array('h', frames)
+        samples.byteswap()
+        if hasattr(samples, 'tobytes'):
+            frames = samples.tobytes()
+        else:
+            frames = samples.tostring()
+    return frames
+
+
+def _wave_data(path):
+    """Return (offset, length) of the sample data of a WAVE file, or None."""
+    f = open(path, 'rb')
+    try:
+        header = f.read(12)
+        if len(header) < 12 or b'RIFF' != header[:4] or b'WAVE' != header[8:]:
+            return None
+        while True:
+            chunk = f.read(8)
+            if len(chunk) < 8:
+                return None
+            name, size = struct.unpack('<4sI', chunk)
+            if b'data' == name:
+                return f.tell(), size
+            f.seek(size + (size & 1), 1)
+    finally:
+        f.close()
+
+
+def measure_loudness(path):
+    """
+    Measure a 16 bit WAVE, AIFF or Sun AU file with loudness().
+
+    The sample data of little endian WAVE files is mapped into memory and
+    analysed in place; other files are read into memory first.
+    """
+    sound, swap = _open_sound(path)
+    try:
+        nchannels, sampwidth, samplerate, nframes = sound.getparams()[:4]
+        if 2 != sampwidth:
+            raise EncoderError('only 16 bit samples are supported')
+        location = None
+        if not swap and sound.__class__.__module__ == wave.__name__:
+            location = _wave_data(path)
+        if location is None:
+            return loudness(_read_pcm(sound, swap, nframes), nchannels,
+                            samplerate)
+    finally:
+        sound.close()
+
+    f = open(path, 'rb')
+    try:
+        return loudness(f, nchannels, samplerate, location[0], location[1])
+    finally:
+        f.close()
+
+
+def normalize_gain(stats, target_db, mode='loudness', ceiling_db=-1.0):
+    """
+    Return the scale factor that brings audio measured by loudness() to
+    target_db, for the Encoder attribute 'scale'.
+
+    mode is 'loudness' (target in LUFS), 'rms' or 'peak' (dBFS).  The
+    gain is limited so the peak stays below ceiling_db (None: no limit).
+    Silence is left alone.
+    """
+    if mode not in ('loudness', 'rms', 'peak'):
+        raise ValueError('mode must be loudness, rms or peak')
+    level = stats['loudness' == mode and mode or mode + '_db']
+    if level is None or level == float('-inf'):
+        return 1.0
+    gain_db = target_db - level
+    if ceiling_db is not None and stats['peak']:
+        gain_db = min(gain_db, ceiling_db - stats['peak_db'])
+    return 10.0 ** (gain_db / 20.0)
+
+
+# Checkpoint sidecar of a resumable encode_file(): header, then the
+# (audio frames, output bytes) pair of every checkpoint.
+_CHECKPOINT = struct.Struct('<4sI20sQI')
+_CHECKPOINT_ENTRY = struct.Struct('<IQ')
+_CHECKPOINT_MAGIC = b'LCKP'
+
+
+def _read_checkpoints(path, digest, samples, out_path):
+    """Return the checkpoints of an interrupted job, or [] to start over."""
+    try:
+        f = open(path, 'rb')
+    except IOError:
+        return []
+    try:
+        data = f.read()
+    finally:
+        f.close()
+    if len(data) < _CHECKPOINT.size:
+        return []
+    magic, version, job, job_samples, count = _CHECKPOINT.unpack(
+        data[:_CHECKPOINT.size])
+    if (magic != _CHECKPOINT_MAGIC or 1 != version or job != digest
+            or job_samples != samples
+            or len(data) != _CHECKPOINT.size + count * _CHECKPOINT_ENTRY.size):
+        return []
+
+    try:
+        size = os.path.getsize(out_path)
+    except OSError:
+        return []
+    points = []
+    for n in range(count):
+        point = _CHECKPOINT_ENTRY.unpack_from(
+            data, _CHECKPOINT.size + n * _CHECKPOINT_ENTRY.size)
+        if point[1] > size or not point[0]:
+            break
+        points.append(point)
+    return points
+
+
+def _write_checkpoints(path, digest, samples, points):
+    """Atomically replace the checkpoint sidecar."""
+    data = _CHECKPOINT.pack(_CHECKPOINT_MAGIC, 1, digest, samples,
+                            len(points))
+    data += b''.join(_CHECKPOINT_ENTRY.pack(*point) for point in points)
+    handle, name = tempfile.mkstemp(suffix='.tmp',
+                                    dir=os.path.dirname(path) or '.')
+    f = os.fdopen(handle, 'wb')
+    try:
+        f.write(data)
+        f.flush()
+        os.fsync(f.fileno())
+    finally:
+        f.close()
+    os.rename(name, path)
+
+
+def _remove_checkpoints(path):
+    """Remove the sidecar of a finished job."""
+    try:
+        os.remove(path)
+    except OSError:
+        pass
+
+
+def _resume_encoder(encoder, sound, swap, frames_done):
+    """
+    Continue an encode behind its first frames_done frames and return
+    the number of frames primed.
+
+    The fresh encoder starts two frames early (or at the start), so frame
+    frames_done does not see its priming silence: with one frame, the
+    filterbank and psychoacoustic history of the resumed frame still
+    reached into it and the decode glitched for about 500 samples.  The
+    primed frames are flushed with their bit reservoir and dropped, so
+    the next one starts at the same input sample as frame frames_done of
+    the interrupted job and does not reach back into the dropped bytes.
+    """
+    spf = encoder.framesize
+    primed = min(2, frames_done)
+    sound.setpos((frames_done - primed) * spf)
+    while encoder.frame_num < primed:
+        frames = _read_pcm(sound, swap, spf // 2)
+        if not frames:
+            break
+        encoder.encode_interleaved(frames)
+    encoder.flush_nogap()
+    return primed
+
+
+def _rewrite_lametag(encoder, f, points, frames, samples):
+    """
+    Write the Xing/LAME tag of a resumed encode over the placeholder
+    frame.  The encoder only saw the audio since the last checkpoint, so
+    the tag is rebuilt for the whole file; the TOC is interpolated between
+    the checkpoints.
+    """
+    try:
+        frame = bytearray(encoder.get_lametag_frame())
+    except EncoderError:
+        return
+    f.seek(0, 2)
+    total = f.tell()
+    f.seek(len(frame))
+    crc = 0
+    chunk = f.read(1 << 20)
+    while chunk:
+        crc = crc16(chunk, crc)
+        chunk = f.read(1 << 20)
+
+    known = [(0, len(frame))] + list(points) + [(frames, total)]
+    toc = []
+    k = 0
+    for n in range(100):
+        target = n * frames // 100
+        while known[k + 1][0] < target:
+            k += 1
+        (f0, o0), (f1, o1) = known[k], known[k + 1]
+        toc.append(o0 + (o1 - o0) * (target - f0) // max(1, f1 - f0))
+
+    delay = encoder.encoder_delay
+    padding = max(0, min(4095, frames * encoder.framesize - delay - samples))
+    quality, lame = _lame_tag_template(frame)
+    _fill_xing(frame, VBR_MODE_OFF != encoder.get_config()['vbr'], frames,
+               toc, total, delay, padding, crc, quality, lame)
+    f.seek(0)
+    f.write(bytes(frame))
+    f.seek(0, 2)
+
+
+def encode_file(in_path, out_path, settings=None, cache=None,
+                normalize=None, checkpoint=None, checkpoint_seconds=60):
+    """
+    Encode a 16 bit WAVE, AIFF or Sun AU file into an MP3 file.
+
+    settings is a dictionary as used by configure(); the channel count
+    and sample rate are taken from the input file.  With an EncodeCache
+    the input PCM is hashed first and an identical earlier job is copied
+    from the cache instead of encoded.  normalize is a (mode, target_db)
+    tuple for normalize_gain(); the file is measured first and 'scale'
+    set accordingly.
+
+    checkpoint is the path of a sidecar file that makes the job
+    resumable: every checkpoint_seconds of input the encoder is flushed
+    with flush_nogap(), the output synced and its length recorded.  Run
+    with the same arguments again, an interrupted job continues at its
+    last checkpoint and still yields one seamless stream.  The sidecar is
+    removed once the file is complete.  Checkpoints need the input
+    samplerate to be kept.
+    """
+    settings = dict(settings or {})
+    if normalize is not None:
+        mode, target_db = normalize
+        settings['scale'] = normalize_gain(measure_loudness(in_path),
+                                           target_db, mode)
+
+    sound, swap = _open_sound(in_path)
+    try:
+        nchannels, sampwidth, samplerate, nframes = sound.getparams()[:4]
+        if 2 != sampwidth:
+            raise EncoderError('only 16 bit samples are supported')
+
+        settings['num_channels'] = nchannels
+        settings['in_samplerate'] = samplerate
+        encoder = Encoder()
+        configure(encoder, settings)
+        encoder.set_num_samples(nframes)
+        encoder.init()
+
+        points = []
+        if checkpoint is not None:
+            if encoder.get_config()['out_samplerate'] != samplerate:
+                raise EncoderError('checkpoints need the input samplerate')
+            job_digest = hashlib.sha1(repr(sorted(settings.items()))
+                                      .encode('ascii')).digest()
+            points = _read_checkpoints(checkpoint, job_digest, nframes,
+                                       out_path)
+
+        key = None
+        if cache is not None:
+            digest = hashlib.sha1()
+            frames = _read_pcm(sound, swap, samplerate)
+            while frames:
+                digest.update(frames)
+                frames = _read_pcm(sound, swap, samplerate)
+            key = cache.key(encoder, digest.hexdigest())
+            data = cache.get(key)
+            if data is not None:
+                out = open(out_path, 'wb')
+                try:
+                    out.write(data)
+                finally:
+                    out.close()
+                if checkpoint is not None:
+                    _remove_checkpoints(checkpoint)
+                return
+            sound.rewind()
+
+        resumed = bool(points)
+        if resumed:
+            frames_done, offset = points[-1]
+            out = open(out_path, 'r+b')
+            out.truncate(offset)
+            out.seek(offset)
+            frame_base = frames_done - _resume_encoder(encoder, sound, swap,
+                                                       frames_done)
+        else:
+            out = open(out_path, 'w+b')
+            frame_base = 0
+        try:
+            # Reads end on whole seconds of input and checkpoints are
+            # counted from its start, so a resumed job flushes at the same
+            # samples as the interrupted one did.
+            period = checkpoint_seconds * samplerate
+            frames = _read_pcm(sound, swap,
+                               samplerate - sound.tell() % samplerate)
+            while frames:
+                out.write(encoder.encode_interleaved(frames))
+                if checkpoint is not None and \
+                        sound.tell() >= (len(points) + 1) * period:
+                    out.write(encoder.flush_nogap())
+                    out.flush()
+                    os.fsync(out.fileno())
+                    points.append((frame_base + encoder.frame_num,
+                                   out.tell()))
+                    _write_checkpoints(checkpoint, job_digest, nframes,
+                                       points)
+                frames = _read_pcm(sound, swap,
+                                   samplerate - sound.tell() % samplerate)
+            out.write(encoder.flush_buffers())
+            if resumed:
+                _rewrite_lametag(encoder, out, points,
+                                 frame_base + encoder.frame_num, nframes)
+            else:
+                _patch_lametag(encoder, out)
+            if key is not None:
+                out.seek(0)
+                cache.put(key, out.read())
+        finally:
+            out.close()
+    finally:
+        sound.close()
+
+    if checkpoint is not None:
+        _remove_checkpoints(checkpoint)
+
+
+def _hls_timestamp_tag(samples, samplerate):
+    """ID3 PRIV tag carrying the MPEG-2 TS timestamp HLS wants on packed audio."""
+    pts = (samples * 90000 // samplerate) & 0x1ffffffff
+    owner = b'com.apple.streaming.transportStreamTimestamp\0'
+    body = owner + struct.pack('>Q', pts)
+
+    def syncsafe(n):
+        return struct.pack('>4B', (n >> 21) & 0x7f, (n >> 14) & 0x7f,
+                           (n >> 7) & 0x7f, n & 0x7f)
+
+    frame = b'PRIV' + syncsafe(len(body)) + b'\0\0' + body
+    return b'ID3\4\0\0' + syncsafe(len(frame)) + frame
+
+
+class Segmenter(object):
+    """
+    Cut the output of one continuous encode into segments, e.g. for HLS.
+
+    The encoder must be initialized with write_vbr_tag disabled.  Segment
+    boundaries are placed every 'seconds' of input, rounded to whole MP3
+    frames; at each one the bitstream is flushed with flush_nogap() and
+    restarted with init_bitstream(), so the encoder keeps its state and
+    the segments play back without gaps.
+
+    encode() and finish() return the segments completed by the call as
+    dictionaries with 'index', 'data', 'frames', 'start' and 'duration'
+    (seconds, on the output timeline).  With a directory the segments
+    are also written to files named after 'pattern' and listed in an
+    m3u8 playlist, which is rewritten after every segment.
+    """
+
+    def __init__(self, encoder, seconds=6.0, directory=None,
+                 pattern='segment%05d.mp3', playlist='playlist.m3u8',
+                 timestamps=True):
+        if encoder.get_config()['write_vbr_tag']:
+            raise ValueError('segmenting needs write_vbr_tag disabled')
+
+        self.encoder = encoder
+        self.directory = directory
+        self.pattern = pattern
+        self.playlist = playlist
+        self.timestamps = timestamps
+        self.segments = []
+
+        self._samplerate = encoder.get_config()['out_samplerate'] \
+            or encoder.in_samplerate
+        self._frame_bytes = 2 * encoder.num_channels
+        # Frames are counted at the output rate, the cut is made in input
+        # samples.
+        framesize = encoder.framesize
+        frames = max(1, int(round(seconds * self._samplerate
+                                  / float(framesize))))
+        self.segment_samples = (frames * framesize * encoder.in_samplerate
+                                // self._samplerate)
+        self._fed = 0           # samples fed into the current segment
+        self._frames = 0        # frames output in earlier segments
+        self._pending = []
+
+    def encode(self, pcm):
+        """Encode interleaved 16 bit audio; returns completed segments."""
+        done = []
+        offset = 0
+        while offset < len(pcm):
+            room = (self.segment_samples - self._fed) * self._frame_bytes
+            chunk = pcm[offset:offset + room]
+            offset += len(chunk)
+            self._pending.append(self.encoder.encode_interleaved(chunk))
+            self._fed += len(chunk) // self._frame_bytes
+            if self._fed == self.segment_samples:
+                self._pending.append(self.encoder.flush_nogap())
+                done.append(self._close_segment())
+                self.encoder.init_bitstream()
+                self._fed = 0
+        return done
+
+    def finish(self):
+        """Flush the encoder and return the last segment(s)."""
+        self._pending.append(self.encoder.flush_buffers())
+        done = [self._close_segment()]
+        self._write_playlist(True)
+        return done
+
+    def _close_segment(self):
+        frames = self.encoder.frame_num
+        data = b''.join(self._pending)
+        self._pending = []
+        start = self._frames * self.encoder.framesize
+        if self.timestamps:
+            data = _hls_timestamp_tag(start, self._samplerate) + data
+
+        segment = {'index': len(self.segments),
+                   'data': data,
+                   'frames': frames,
+                   'start': start / float(self._samplerate),
+                   'duration': frames * self.encoder.framesize
+                               / float(self._samplerate)}
+        self._frames += frames
+        self.segments.append(segment)
+
+        if self.directory is not None:
+            f = open(os.path.join(self.directory,
+                                  self.pattern % segment['index']), 'wb')
+            try:
+                f.write(data)
+            finally:
+                f.close()
+            self._write_playlist(False)
+        return segment
+
+    def _write_playlist(self, ended):
+        if self.directory is None:
+            return
+
+        lines = ['#EXTM3U',
+                 '#EXT-X-VERSION:3',
+                 '#EXT-X-TARGETDURATION:%d' % max(
+                     [int(math.ceil(s['duration'])) for s in self.segments]
+                     or [0]),
+                 '#EXT-X-MEDIA-SEQUENCE:0']
+        for segment in self.segments:
+            lines.append('#EXTINF:%.6f,' % segment['duration'])
+            lines.append(self.pattern % segment['index'])
+        if ended:
+            lines.append('#EXT-X-ENDLIST')
+
+        path = os.path.join(self.directory, self.playlist)
+        f = open(path + '.tmp', 'w')
+        try:
+            f.write('\n'.join(lines) + '\n')
+        finally:
+            f.close()
+        os.rename(path + '.tmp', path)
+
+
+class Ladder(object):
+    """
+    Encode one PCM stream with several encoders at once (a bitrate ladder).
+
+    rungs is a list of (encoder, sink) pairs of initialized encoders and
+    file-like objects or file descriptors.  Each rung runs on its own
+    thread; encoding releases the GIL, so the rungs use separate cores.
+    The audio is read and converted once and the same buffer is handed
+    to every rung.  feed() blocks when a rung falls more than 'depth'
+    chunks behind, so a slow rung throttles the input instead of piling
+    up memory.
+    """
+
+    def __init__(self, rungs, depth=4):
+        self.rungs = rungs
+        self._errors = []
+        self._queues = []
+        self._threads = []
+        for encoder, sink in rungs:
+            q = queue.Queue(depth)
+            thread = threading.Thread(target=self._run,
+                                      args=(encoder, sink, q))
+            thread.daemon = True
+            thread.start()
+            self._queues.append(q)
+            self._threads.append(thread)
+
+    def _run(self, encoder, sink, q):
+        try:
+            while True:
+                pcm = q.get()
+                if pcm is None:
+                    break
+                if isinstance(sink, int):
+                    encoder.encode_to_fd(pcm, sink)
+                else:
+                    sink.write(encoder.encode_interleaved(pcm))
+            if isinstance(sink, int):
+                encoder.flush_to_fd(sink)
+            else:
+                sink.write(encoder.flush_buffers())
+        except Exception as e:
+            self._errors.append(e)
+            # Keep draining so feed() does not block on a dead rung.
+            while pcm is not None:
+                pcm = q.get()
+
+    def _check(self):
+        if self._errors:
+            raise self._errors[0]
+
+    def feed(self, pcm):
+        """Queue interleaved 16 bit audio for every rung."""
+        self._check()
+        for q in self._queues:
+            q.put(pcm)
+
+    def finish(self):
+        """Flush every rung and wait for all of them to finish."""
+        for q in self._queues:
+            q.put(None)
+        for thread in self._threads:
+            thread.join()
+        self._check()
+
+
+def encode_ladder(in_path, outputs, settings=None, depth=4):
+    """
+    Encode a 16 bit WAVE, AIFF or Sun AU file into several MP3 files in
+    one pass.  outputs is a list of (settings, out_path) pairs, each
+    combined with the common settings; the input is read only once.
+    """
+    sound, swap = _open_sound(in_path)
+    files = []
+    try:
+        nchannels, sampwidth, samplerate, nframes = sound.getparams()[:4]
+        if 2 != sampwidth:
+            raise EncoderError('only 16 bit samples are supported')
+
+        rungs = []
+        for rung_settings, out_path in outputs:
+            combined = dict(settings or {})
+            combined.update(rung_settings)
+            combined['num_channels'] = nchannels
+            combined['in_samplerate'] = samplerate
+            encoder = Encoder()
+            configure(encoder, combined)
+            encoder.set_num_samples(nframes)
+            encoder.init()
+            files.append(open(out_path, 'w+b'))
+            rungs.append((encoder, files[-1]))
+
+        ladder = Ladder(rungs, depth)
+        try:
+            frames = _read_pcm(sound, swap, samplerate)
+            while frames:
+                ladder.feed(frames)
+                frames = _read_pcm(sound, swap, samplerate)
+        finally:
+            ladder.finish()
+
+        for encoder, f in rungs:
+            _patch_lametag(encoder, f)
+    finally:
+        for f in files:
+            f.close()
+        sound.close()
+
+
+def album_gain(tracks):
+    """
+    Aggregate the ReplayGain analysis of the tracks of an album.
+
+    tracks are flushed encoders that ran with set_find_replay_gain(1)
+    (and set_decode_on_the_fly(1) for the peaks), or (gain_db, peak,
+    samples) tuples.  Returns a dictionary with 'album_gain' (dB),
+    'album_peak' (relative to full scale) and the per track 'tracks' as
+    (gain_db, peak) tuples.
+
+    LAME only reports the gain of each track, not the loudness histogram
+    behind it, so the album gain is the duration weighted power average
+    of the track loudness rather than the 95th percentile over the whole
+    album that a separate analysis pass would give.
+    """
+    values = []
+    for track in tracks:
+        if isinstance(track, tuple):
+            values.append(track)
+        else:
+            values.append((track.radio_gain / 10.0,
+                           track.peak_sample / 32768.0,
+                           track.samples_encoded))
+
+    total = sum([samples for gain, peak, samples in values])
+    if not total:
+        raise ValueError('no audio in the tracks')
+
+    power = sum([samples * 10.0 ** (-gain / 10.0)
+                 for gain, peak, samples in values]) / total
+    return {'album_gain': -10.0 * math.log10(power),
+            'album_peak': max([peak for gain, peak, samples in values]),
+            'tracks': [(gain, peak) for gain, peak, samples in values]}
+
+
+def quality_check(pcm, settings, segment_seconds=1.0, threads=0):
+    """
+    Encode pcm with the settings and measure the result against it.
+
+    The MP3 data is decoded in-process and compared per segment of
+    segment_seconds by quality_report() on up to 'threads' threads (0 for
+    one per CPU).  Returns (mp3_data, report); see quality_report() for
+    the report.  Settings that resample cannot be measured this way.
+    """
+    encoder = new_encoder(settings)
+    data = encoder.encode_interleaved(pcm) + encoder.flush_buffers()
+    try:
+        tag = encoder.get_lametag_frame()
+    except EncoderError:
+        pass
+    else:
+        # A zero-filled tag frame would decode as 1152 extra samples.
+        data = tag + data[len(tag):]
+    config = encoder.get_config()
+    segment = max(1, int(segment_seconds * config['in_samplerate']))
+    # The decoder adds 529 samples of its own to the encoder delay.
+    report = quality_report(pcm, data, config['num_channels'], segment,
+                            encoder.encoder_delay + 529, threads)
+    return data, report
+
+
+def memory_per_stream(settings, streams=1000, seconds=0.5):
+    """
+    Measure what concurrent encoders with the settings cost in memory.
+
+    Creates 'streams' encoders, encodes 'seconds' of silence with each in
+    chunks of 20 ms and keeps them all alive while measuring.  Returns a
+    dictionary of bytes per stream: 'rss' (growth of the resident set
+    size, None without /proc), 'buffers' and 'lame' (the accounting of
+    memory_usage()).  Compare settings with and without 'lean' to size
+    a host.
+    """
+    before = memory_usage()
+    encoders = []
+    chunk = None
+    for i in range(streams):
+        encoder = new_encoder(settings)
+        if chunk is None:
+            config = encoder.get_config()
+            chunk = b'\0' * (2 * config['num_channels'] *
+                             max(1, config['in_samplerate'] // 50))
+        for j in range(max(1, int(seconds * 50))):
+            encoder.encode_interleaved(chunk)
+        encoders.append(encoder)
+    after = memory_usage()
+
+    result = {}
+    for key in ('rss', 'buffers', 'lame'):
+        if after[key] is None or before[key] is None:
+            result[key] = None
+        else:
+            result[key] = float(after[key] - before[key]) / streams
+    return result
+
+
+class EncoderPool(object):
+    """
+    Keep initialized encoders ready for short clips, keyed by settings.
+
+    acquire() hands out an encoder configured from a settings dictionary
+    without running the setters and lame_init_params() on the caller's
+    path; release() takes it back after flush_buffers(), discard() drops
+    one that failed.  A background thread keeps 'size' encoders per
+    configuration ready; init() releases the GIL, so that runs beside
+    the encode calls of other threads.  Only the 'keys' configurations
+    used last are kept ready, so clients that vary their settings do not
+    pile up idle encoders.
+
+    With 'exact' (the default) every encoder serves a single clip and is
+    replaced by a freshly built one, so the output is identical to that
+    of new_encoder().  Without it released encoders are reset() and used
+    again, which also saves the setup work, but LAME keeps psychoacoustic
+    state across reset() and the first frames of a clip then depend on
+    the previous one.
+    """
+
+    def __init__(self, size=4, exact=True, keys=16):
+        self.size = size
+        self.exact = exact
+        self.keys = keys
+        self._cond = threading.Condition()
+        # key -> idle encoders, the one used last at the end
+        self._ready = collections.OrderedDict()
+        self._settings = {}     # key -> settings, for the refill thread
+        self._lent = {}         # id(encoder) -> key
+        self._closed = False
+        self._thread = None
+
+    @staticmethod
+    def key(settings):
+        return repr(sorted(settings.items()))
+
+    def acquire(self, settings):
+        """Return an initialized encoder for the settings dictionary."""
+        key = self.key(settings)
+        with self._cond:
+            ready = self._ready.get(key)
+            encoder = ready.pop() if ready else None
+        if encoder is None:
+            # Built here the first time, so bad settings raise to the
+            # caller instead of in the refill thread.
+            encoder = new_encoder(settings)
+        with self._cond:
+            if self._closed:
+                raise ValueError('pool is closed')
+            self._use(key, settings)
+            self._lent[id(encoder)] = key
+            self._start()
+            self._cond.notify()
+        return encoder
+
+    def release(self, encoder):
+        """Return an encoder from acquire() once its clip is flushed."""
+        with self._cond:
+            key = self._lent.pop(id(encoder), None)
+            if key is None or self.exact or self._closed:
+                return
+            if len(self._ready.get(key, ())) >= self.size:
+                return
+        try:
+            encoder.reset()
+        except EncoderError:
+            return
+        with self._cond:
+            ready = self._ready.get(key)
+            if ready is not None and not self._closed:
+                ready.append(encoder)
+
+    def discard(self, encoder):
+        """Forget an encoder from acquire() that is not released."""
+        with self._cond:
+            self._lent.pop(id(encoder), None)
+
+    def warm(self, settings, count=None):
+        """Build encoders until 'count' (default size) are ready."""
+        key = self.key(settings)
+        if count is None:
+            count = self.size
+        while True:
+            with self._cond:
+                ready = self._use(key, settings)
+                if len(ready) >= count or self._closed:
+                    break
+            encoder = new_encoder(settings)
+            with self._cond:
+                ready.append(encoder)
+
+    def encode(self, settings, pcm):
+        """Encode and flush a whole clip with a pooled encoder; returns
+        the MP3 data with the Xing/LAME tag filled in."""
+        encoder = self.acquire(settings)
+        data = None
+        try:
+            mp3 = encoder.encode_interleaved(pcm) + encoder.flush_buffers()
+            try:
+                tag = encoder.get_lametag_frame()
+            except EncoderError:
+                tag = b''
+            data = tag + mp3[len(tag):]
+        finally:
+            # Not reused after errors: the encoder is in an unknown state.
+            if data is None:
+                self.discard(encoder)
+            else:
+                self.release(encoder)
+        return data
+
+    def close(self):
+        """Stop the refill thread and drop the idle encoders."""
+        with self._cond:
+            self._closed = True
+            self._ready.clear()
+            self._cond.notify()
+        if self._thread is not None:
+            self._thread.join()
+
+    def _use(self, key, settings):
+        # Called with the lock held: move key to the end, drop the keys
+        # used longest ago beyond 'keys'.
+        ready = self._ready.pop(key, [])
+        self._ready[key] = ready
+        self._settings.setdefault(key, dict(settings))
+        while len(self._ready) > max(1, self.keys):
+            old = next(iter(self._ready))
+            del self._ready[old]
+            self._settings.pop(old, None)
+        return ready
+
+    def _start(self):
+        # Called with the lock held.
+        if self._thread is None:
+            self._thread = threading.Thread(target=self._refill)
+            self._thread.daemon = True
+            self._thread.start()
+
+    def _short(self):
+        for key, ready in self._ready.items():
+            if len(ready) < self.size and key in self._settings:
+                return key
+        return None
+
+    def _refill(self):
+        while True:
+            with self._cond:
+                while not self._closed and self._short() is None:
+                    self._cond.wait()
+                if self._closed:
+                    return
+                key = self._short()
+                settings = self._settings[key]
+            try:
+                encoder = new_encoder(settings)
+            except Exception:
+                with self._cond:
+                    self._settings.pop(key, None)
+                continue
+            with self._cond:
+                if self._closed:
+                    return
+                ready = self._ready.get(key)
+                if ready is not None:
+                    ready.append(encoder)
+
+
+# Encode daemon protocol: frames of a type byte and a big endian length.
+# Client: 'S' settings (a JSON object for configure()), 'D' 16 bit
+# interleaved PCM in native byte order, 'Z' end of the clip.  Server: 'D'
+# MP3 data, 'E' an error message (the connection is closed behind it),
+# 'Z' end of the clip with the Xing/LAME tag frame (empty without one) to
+# write over the placeholder the clip starts with.  A connection may
+# carry several clips in a row.
+_LAMED_FRAME = struct.Struct('>cI')
+_LAMED_MAX_FRAME = 1 << 24
+# The socket lives in a directory only its user can write to, so nobody
+# else can serve in the daemon's place: $XDG_RUNTIME_DIR, or one made in
+# the temporary directory.
+_LAMED_DIR = os.path.join(tempfile.gettempdir(), 'lamed-%d' % os.getuid())
+LAMED_SOCKET = os.path.join(os.environ.get('XDG_RUNTIME_DIR') or _LAMED_DIR,
+                            'lamed.sock')
+
+
+def _lamed_frame(kind, payload=b''):
+    return _LAMED_FRAME.pack(kind, len(payload)) + payload
+
+
+def _lamed_dir(path):
+    """Create the directory of a socket in _LAMED_DIR, or make sure it is
+    the private one it would have been created as."""
+    directory = os.path.dirname(path)
+    if directory != _LAMED_DIR:
+        return
+    try:
+        os.mkdir(directory, 0o700)
+    except OSError as e:
+        if errno.EEXIST != e.errno:
+            raise
+    info = os.lstat(directory)
+    if (not stat.S_ISDIR(info.st_mode) or info.st_uid != os.getuid()
+            or info.st_mode & 0o077):
+        raise EncoderError('%s is not a private directory' % directory)
+
+
+class _LamedClient(object):
+    """State of one connection to an EncodeServer."""
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.fd = sock.fileno()
+        self.input = bytearray()
+        self.output = bytearray()
+        self.jobs = collections.deque()
+        self.queued = 0         # bytes of PCM waiting for a worker
+        self.busy = False       # a worker has a job of this client
+        self.encoder = None     # only touched by the worker with the job
+        self.clip = False       # between 'S' and 'Z'
+        self.closing = False    # close once the output is written
+        self.failed = False     # an error was sent, results are dropped
+        self.closed = False
+        self.events = 0
+
+
+class EncodeServer(object):
+    """
+    Encode daemon serving PCM-in/MP3-out clips on a Unix domain socket.
+
+    One thread runs an epoll loop over all sockets; 'workers' threads
+    (default: one per online CPU) run the encoders, which come warm from
+    an EncoderPool.  A client is not read from while more than 'buffer'
+    bytes of its PCM wait for a worker or of its MP3 data wait to be
+    sent, so fast writers and slow readers are held back by the socket
+    instead of buffered.  See EncodeClient for the other side.
+    """
+
+    def __init__(self, path=LAMED_SOCKET, workers=0, pool=None,
+                 buffer=1 << 20, mode=0o600):
+        self.path = path
+        self.buffer = buffer
+        self.pool = pool if pool is not None else EncoderPool()
+        self._clients = {}
+        self._running = False
+
+        _lamed_dir(path)
+        if os.path.exists(path):
+            probe = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            try:
+                probe.connect(path)
+            except socket.error:
+                os.unlink(path)     # left behind by a dead daemon
+            else:
+                raise EncoderError('%s is already served' % path)
+            finally:
+                probe.close()
+        self._listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        # Created with its mode, not chmod()ed open to connects after.
+        umask = os.umask(0o777 & ~mode)
+        try:
+            self._listener.bind(path)
+        finally:
+            os.umask(umask)
+        self._listener.listen(128)
+        self._listener.setblocking(0)
+
+        # Workers wake the loop through a pipe.
+        self._wake_r, self._wake_w = os.pipe()
+        for fd in (self._wake_r, self._wake_w):
+            fcntl.fcntl(fd, fcntl.F_SETFL,
+                        fcntl.fcntl(fd, fcntl.F_GETFL) | os.O_NONBLOCK)
+        self._epoll = select.epoll()
+        self._epoll.register(self._listener.fileno(), select.EPOLLIN)
+        self._epoll.register(self._wake_r, select.EPOLLIN)
+
+        if 0 >= workers:
+            workers = max(1, os.sysconf('SC_NPROCESSORS_ONLN'))
+        self._jobs = queue.Queue()
+        self._done = queue.Queue()
+        self._threads = []
+        for n in range(workers):
+            thread = threading.Thread(target=self._work)
+            thread.daemon = True
+            thread.start()
+            self._threads.append(thread)
+
+    def serve_forever(self):
+        """Serve clients until shutdown() is called."""
+        listener = self._listener.fileno()
+        self._running = True
+        while self._running:
+            try:
+                events = self._epoll.poll(1.0)
+            except (IOError, OSError) as e:
+                if errno.EINTR == e.errno:
+                    continue
+                raise
+            for fd, event in events:
+                if fd == listener:
+                    self._accept()
+                elif fd == self._wake_r:
+                    self._finish_jobs()
+                else:
+                    client = self._clients.get(fd)
+                    if client is None:
+                        continue
+                    if event & (select.EPOLLHUP | select.EPOLLERR):
+                        self._drop(client)      # nobody left to answer
+                        continue
+                    if event & select.EPOLLIN:
+                        self._read(client)
+                    if event & select.EPOLLOUT and not client.closed:
+                        self._write(client)
+
+    def shutdown(self):
+        """Make serve_forever() return; safe from signal handlers."""
+        self._running = False
+
+    def close(self):
+        """Stop the workers, drop all clients and remove the socket."""
+        for thread in self._threads:
+            self._jobs.put(None)
+        for thread in self._threads:
+            thread.join()
+        for client in list(self._clients.values()):
+            self._drop(client)
+        self._epoll.close()
+        self._listener.close()
+        os.close(self._wake_r)
+        os.close(self._wake_w)
+        try:
+            os.unlink(self.path)
+        except OSError:
+            pass
+        self.pool.close()
+
+    def _accept(self):
+        while True:
+            try:
+                sock = self._listener.accept()[0]
+            except socket.error as e:
+                if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    return
+                raise
+            sock.setblocking(0)
+            client = _LamedClient(sock)
+            self._clients[client.fd] = client
+            self._epoll.register(client.fd, 0)
+            self._update(client)
+
+    def _read(self, client):
+        try:
+            data = client.sock.recv(65536)
+        except socket.error as e:
+            if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK):
+                return
+            self._drop(client)
+            return
+        if not data:
+            # A clip cut short is abandoned; finished ones are still sent.
+            if client.clip or not (client.busy or client.jobs
+                                   or client.output):
+                self._drop(client)
+                return
+            client.closing = True
+        client.input += data
+        self._parse(client)
+        self._update(client)
+
+    def _parse(self, client):
+        while not client.closing and len(client.input) >= _LAMED_FRAME.size:
+            kind, length = _LAMED_FRAME.unpack_from(bytes(client.input[:5]))
+            if length > _LAMED_MAX_FRAME:
+                self._fail(client, 'frame too large')
+                return
+            end = _LAMED_FRAME.size + length
+            if len(client.input) < end:
+                return
+            payload = bytes(client.input[_LAMED_FRAME.size:end])
+            del client.input[:end]
+
+            if b'S' == kind and not client.clip:
+                try:
+                    settings = json.loads(payload.decode('utf-8'))
+                    if not isinstance(settings, dict):
+                        raise ValueError('settings must be an object')
+                except ValueError as e:
+                    self._fail(client, 'bad settings: %s' % e)
+                    return
+                client.clip = True
+                self._queue(client, 'open', dict(
+                    (str(key), isinstance(value, list) and tuple(value)
+                     or value) for key, value in settings.items()))
+            elif b'D' == kind and client.clip:
+                client.queued += len(payload)
+                self._queue(client, 'pcm', payload)
+            elif b'Z' == kind and client.clip:
+                client.clip = False
+                self._queue(client, 'end', None)
+            else:
+                self._fail(client, 'unexpected frame %r' % kind)
+                return
+
+    def _queue(self, client, kind, payload):
+        client.jobs.append((kind, payload))
+        self._submit(client)
+
+    def _submit(self, client):
+        # One job per client at a time keeps its output in order.
+        if client.busy or not client.jobs:
+            return
+        kind, payload = client.jobs.popleft()
+        if 'pcm' == kind:
+            client.queued -= len(payload)
+        client.busy = True
+        self._jobs.put((client, kind, payload))
+
+    def _work(self):
+        while True:
+            job = self._jobs.get()
+            if job is None:
+                return
+            client, kind, payload = job
+            result = error = None
+            try:
+                if 'open' == kind:
+                    client.encoder = self.pool.acquire(payload)
+                elif 'pcm' == kind:
+                    result = client.encoder.encode_interleaved(payload)
+                else:
+                    data = client.encoder.flush_buffers()
+                    try:
+                        tag = client.encoder.get_lametag_frame()
+                    except EncoderError:
+                        tag = b''
+                    result = (data, tag)
+                    self.pool.release(client.encoder)
+                    client.encoder = None
+            except Exception as e:
+                # the encoder is in an unknown state and not released
+                error = str(e) or e.__class__.__name__
+                if client.encoder is not None:
+                    self.pool.discard(client.encoder)
+                client.encoder = None
+            self._done.put((client, kind, result, error))
+            try:
+                os.write(self._wake_w, b'.')
+            except OSError:
+                pass            # the pipe is full, a wakeup is pending
+
+    def _finish_jobs(self):
+        try:
+            while os.read(self._wake_r, 4096):
+                pass
+        except OSError:
+            pass
+        while True:
+            try:
+                client, kind, result, error = self._done.get_nowait()
+            except queue.Empty:
+                return
+            client.busy = False
+            if client.closed:
+                self._abandon(client)
+                continue
+            if client.failed:
+                pass
+            elif error is not None:
+                self._fail(client, error)
+            else:
+                tag = b''
+                if 'end' == kind:
+                    result, tag = result
+                if result:
+                    client.output += _lamed_frame(b'D', result)
+                if 'end' == kind:
+                    client.output += _lamed_frame(b'Z', tag)
+                self._submit(client)
+            self._write(client)
+
+    def _write(self, client):
+        while client.output:
+            try:
+                sent = client.sock.send(bytes(client.output[:65536]))
+            except socket.error as e:
+                if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    break
+                self._drop(client)
+                return
+            del client.output[:sent]
+        if client.closing and not (client.output or client.busy
+                                   or client.jobs):
+            self._drop(client)
+            return
+        self._update(client)
+
+    def _fail(self, client, message):
+        client.jobs.clear()
+        client.queued = 0
+        client.clip = False
+        client.closing = True
+        client.failed = True
+        client.output += _lamed_frame(b'E', message.encode('utf-8'))
+        self._update(client)
+
+    def _update(self, client):
+        if client.closed:
+            return
+        events = 0
+        if (not client.closing and client.queued < self.buffer
+                and len(client.output) < self.buffer):
+            events |= select.EPOLLIN
+        if client.output:
+            events |= select.EPOLLOUT
+        if events != client.events:
+            self._epoll.modify(client.fd, events)
+            client.events = events
+
+    def _drop(self, client):
+        if client.closed:
+            return
+        client.closed = True
+        del self._clients[client.fd]
+        self._epoll.unregister(client.fd)
+        client.sock.close()
+        if not client.busy:
+            self._abandon(client)
+
+    def _abandon(self, client):
+        # The encoder of a clip cut short is not flushed, so not reused.
+        # Only called while no worker has a job of the client.
+        if client.encoder is not None:
+            self.pool.discard(client.encoder)
+            client.encoder = None
+
+
+class EncodeClient(object):
+    """
+    Client of an EncodeServer, e.g. the lamed daemon.
+
+    encode() sends a whole clip and returns the MP3 data; encode_stream()
+    sends an iterable of PCM chunks and yields MP3 data as it arrives.
+    Sending and receiving are interleaved, so the daemon holding back a
+    fast sender cannot deadlock the exchange.  settings is a dictionary
+    for configure() with JSON compatible values.
+    """
+
+    def __init__(self, path=LAMED_SOCKET, timeout=60.0):
+        self.path = path
+        self.timeout = timeout
+
+    def encode(self, settings, pcm):
+        """Encode and flush a whole clip; returns the MP3 data with the
+        Xing/LAME tag filled in."""
+        data = []
+        tag = b''
+        for kind, payload in self._clip(settings, [pcm]):
+            if b'Z' == kind:
+                tag = payload
+            else:
+                data.append(payload)
+        data = b''.join(data)
+        return tag + data[len(tag):]
+
+    def encode_stream(self, settings, chunks):
+        """
+        Encode a clip given as PCM chunks; yields MP3 data.
+
+        With the Xing/LAME tag on (write_vbr_tag, the default) the stream
+        starts with LAME's zero-filled placeholder for it, which decodes
+        as a frame of silence; use encode() or turn the tag off.
+        """
+        for kind, payload in self._clip(settings, chunks):
+            if b'D' == kind:
+                yield payload
+
+    def _clip(self, settings, chunks):
+        """Run one clip; yields ('D', MP3 data) and ('Z', tag frame)."""
+        frames = itertools.chain(
+            [(b'S', json.dumps(settings).encode('utf-8'))],
+            ((b'D', chunk) for chunk in chunks if chunk),
+            [(b'Z', b'')])
+        _lamed_dir(self.path)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            sock.connect(self.path)
+            sock.setblocking(0)
+            pending = bytearray()
+            received = bytearray()
+            more = True
+            while True:
+                if more and not pending:
+                    try:
+                        kind, payload = next(frames)
+                        pending += _lamed_frame(kind, payload)
+                    except StopIteration:
+                        more = False
+                readable, writable = select.select(
+                    [sock], pending and [sock] or [], [], self.timeout)[:2]
+                if not (readable or writable):
+                    raise EncoderError('lamed timed out')
+                if writable:
+                    try:
+                        del pending[:sock.send(bytes(pending[:65536]))]
+                    except socket.error as e:
+                        if e.args[0] in (errno.EPIPE, errno.ECONNRESET):
+                            # the daemon gave up; its error is still to read
+                            del pending[:]
+                            more = False
+                        elif e.args[0] not in (errno.EAGAIN,
+                                               errno.EWOULDBLOCK):
+                            raise
+                if not readable:
+                    continue
+                try:
+                    data = sock.recv(65536)
+                except socket.error as e:
+                    if e.args[0] in (errno.EAGAIN, errno.EWOULDBLOCK):
+                        continue
+                    raise
+                if not data:
+                    raise EncoderError('lamed closed the connection')
+                received += data
+                while len(received) >= _LAMED_FRAME.size:
+                    kind, length = _LAMED_FRAME.unpack_from(
+                        bytes(received[:_LAMED_FRAME.size]))
+                    end = _LAMED_FRAME.size + length
+                    if len(received) < end:
+                        break
+                    payload = bytes(received[_LAMED_FRAME.size:end])
+                    del received[:end]
+                    if b'E' == kind:
+                        raise EncoderError(payload.decode('utf-8'))
+                    yield kind, payload
+                    if b'Z' == kind:
+                        return
+        finally:
+            sock.close()
+
+
+# Seek index sidecar: header, then the offsets as LEB128 varint deltas.
+_SEEK_INDEX = struct.Struct('<4sIIIIII')
+_SEEK_INDEX_MAGIC = b'LSIX'
+
+
+def write_seek_index(index, f):
+    """Write a seek index from Encoder.get_seek_index() to a file object."""
+    offsets = index['offsets']
+    out = bytearray(_SEEK_INDEX.pack(_SEEK_INDEX_MAGIC, 1,
+                                     index['interval_ms'],
+                                     index['samplerate'],
+                                     index['samples_per_frame'],
+                                     index['encoder_delay'],
+                                     len(offsets)))
+    previous = 0
+    for offset in offsets:
+        delta = offset - previous
+        previous = offset
+        while delta >= 0x80:
+            out.append(delta & 0x7f | 0x80)
+            delta >>= 7
+        out.append(delta)
+    f.write(bytes(out))
+
+
+def read_seek_index(f):
+    """Read a seek index written by write_seek_index() from a file object."""
+    data = bytearray(f.read())
+    if len(data) < _SEEK_INDEX.size:
+        raise ValueError('not a seek index')
+    (magic, version, interval_ms, samplerate, samples_per_frame,
+     encoder_delay, count) = _SEEK_INDEX.unpack(bytes(data[:_SEEK_INDEX.size]))
+    if magic != _SEEK_INDEX_MAGIC or 1 != version:
+        raise ValueError('not a seek index')
+
+    offsets = array.array('L')
+    offset = value = shift = 0
+    for byte in data[_SEEK_INDEX.size:]:
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            offset += value
+            offsets.append(offset)
+            value = shift = 0
+    if len(offsets) != count:
+        raise ValueError('truncated seek index')
+
+    return {'offsets': offsets, 'interval_ms': interval_ms,
+            'samplerate': samplerate, 'samples_per_frame': samples_per_frame,
+            'encoder_delay': encoder_delay}
+
+
+def seek_offset(index, ms):
+    """Return the stream offset to start decoding at for time ms."""
+    offsets = index['offsets']
+    if not offsets:
+        raise ValueError('empty seek index')
+    if index['interval_ms']:
+        n = int(ms // index['interval_ms'])
+    else:
+        sample = int(ms * index['samplerate'] // 1000) + index['encoder_delay']
+        n = sample // index['samples_per_frame']
+    return offsets[max(0, min(n, len(offsets) - 1))]
+
+
+# Frame level editing: frames inside the kept parts are copied, only the
+# frames around cuts and joins are decoded and encoded again.
+_MPEG_BITRATES = ((0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224,
+                   256, 320),
+                  (0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144,
+                   160))
+_DECODER_DELAY = 529
+_EDIT_WINDOW = 16       # frames encoded past a cut to find a rejoin point
+
+
+def _reservoir_frame(header, samplerate, tail):
+    """Return a frame that decodes to silence and leaves tail in the bit
+    reservoir; header is the one of the frame behind it."""
+    header = bytearray(header[:4])
+    lsf = not header[1] & 0x08
+    header[1] |= 0x01       # no CRC
+    header[2] &= 0xfd       # no padding
+    room = _xing_offset(header) + len(tail)
+    bitrates = _MPEG_BITRATES[lsf]
+    for index in range(max(1, header[2] >> 4), 15):
+        size = (lsf and 72000 or 144000) * bitrates[index] // samplerate
+        if size >= room:
+            break
+    header[2] = index << 4 | header[2] & 0x0f
+    frame = bytearray(size)
+    frame[:4] = header
+    frame[size - len(tail):] = tail
+    return bytes(frame)
+
+
+class _Mp3Source(object):
+    """MP3 data with its frame table and gapless timing."""
+
+    def __init__(self, data):
+        info = mp3_frames(data)
+        if not info['offsets']:
+            raise EncoderError('no MP3 frames found')
+        self.data = data
+        self.info = info
+        self.spf = info['samples_per_frame']
+        self.frames = len(info['offsets'])
+        if 0 <= info['delay']:
+            self.delay, padding = info['delay'], info['padding']
+        else:
+            self.delay, padding = 0, _DECODER_DELAY
+        # decoded sample n is source sample n - total
+        self.total = self.delay + _DECODER_DELAY
+        self.length = max(0, self.frames * self.spf - self.delay - padding)
+
+    def frames_data(self, f, count):
+        """Return count frames from frame f on."""
+        offsets = self.info['offsets']
+        end = f + count
+        stop = offsets[end] if end < self.frames else self.info['end']
+        return self.data[offsets[f]:stop]
+
+    def main_tail(self, f, count):
+        """Return the last count bytes of main data in front of frame f."""
+        info = self.info
+        pieces = []
+        while count and f:
+            f -= 1
+            end = info['offsets'][f] + info['frame_bytes'][f]
+            n = min(count, info['frame_bytes'][f] - info['header_bytes'])
+            pieces.append(self.data[end - n:end])
+            count -= n
+        pieces.reverse()
+        return b''.join(pieces)
+
+    def pcm(self, start, end):
+        """Return the samples [start, end), silence outside the stream."""
+        info, spf = self.info, self.spf
+        width = 2 * info['channels']
+        first = max(start + self.total, 0)
+        last = min(end + self.total, self.frames * spf)
+        if first >= last:
+            return b'\0' * (width * (end - start))
+
+        # The frame in front of the first one is decoded too, for the
+        # overlap.  The decoder cannot start at a frame that reaches back
+        # into the bit reservoir, so a silent frame carrying the reservoir
+        # goes in front of it then.
+        fa, fb = first // spf, -(-last // spf)
+        f0 = max(0, fa - 1)
+        data = self.frames_data(f0, fb + 1 - f0)
+        need = info['main_data_begin'][f0]
+        if need:
+            data = _reservoir_frame(data, info['samplerate'],
+                                    self.main_tail(f0, need)) + data
+            f0 -= 1
+
+        samples = decode(data)[0]
+        begin = (first - f0 * spf) * width
+        samples = (b'\0' * ((first - start - self.total) * width)
+                   + samples[begin:begin + (last - first) * width])
+        return samples + b'\0' * (width * (end - start) - len(samples))
+
+
+def _xing_offset(frame):
+    """Return the offset of the Xing header in a tag frame."""
+    lsf = not frame[1] & 0x08
+    mono = 3 == frame[3] >> 6
+    side = (mono and 9 or 17) if lsf else (mono and 17 or 32)
+    return 4 + (not frame[1] & 0x01 and 2) + side
+
+
+def _lame_tag_template(frame):
+    """Return (quality, LAME tag) of a Xing/Info frame; None if missing."""
+    frame = bytearray(frame)
+    pos = _xing_offset(frame)
+    flags = struct.unpack('>I', bytes(frame[pos + 4:pos + 8]))[0]
+    pos += 8 + (flags & 1 and 4) + (flags & 2 and 4) + (flags & 4 and 100)
+    quality = None
+    if flags & 8:
+        quality = bytes(frame[pos:pos + 4])
+        pos += 4
+    lame = bytes(frame[pos:pos + 36])
+    if len(lame) < 36 or lame[:4] not in (b'LAME', b'L3.9'):
+        lame = None
+    return quality, lame
+
+
+def _fill_xing(frame, vbr, frames, toc, total, delay, padding, music_crc,
+               quality=None, lame=None):
+    """
+    Fill a Xing/Info frame (a bytearray, header set) and its LAME tag.
+
+    toc holds the stream offsets of the audio frames at 0 to 99 percent
+    of them, total is the stream size including the tag frame.  The
+    ReplayGain fields are cleared; they described different audio.
+    """
+    pos = _xing_offset(frame)
+    frame[pos:pos + 16] = struct.pack('>4sIII', vbr and b'Xing' or b'Info',
+                                      15, frames, total)
+    frame[pos + 16:pos + 116] = bytearray(min(255, 256 * offset // total)
+                                          for offset in toc)
+    frame[pos + 116:pos + 120] = quality or b'\0' * 4
+
+    if lame is None:
+        lame = ('LAME' + LAME_VERSION_SHORT)[:9].encode('ascii')
+        lame += b'\0' * (36 - len(lame))
+    lame = bytearray(lame)
+    lame[11:19] = b'\0' * 8
+    lame[21:24] = bytearray((delay >> 4, (delay & 15) << 4 | padding >> 8,
+                             padding & 255))
+    lame[28:34] = struct.pack('>IH', total, music_crc)
+    frame[pos + 120:pos + 156] = lame
+    frame[pos + 154:pos + 156] = struct.pack('>H',
+                                             crc16(bytes(frame[:pos + 154])))
+
+
+class _Mp3Edit(object):
+    """The plan and the output of edit_mp3()."""
+
+    def __init__(self, parts, settings):
+        sources = {}
+        segments = []
+        for data, start, end in parts:
+            source = sources.get(id(data))
+            if source is None:
+                source = sources[id(data)] = _Mp3Source(data)
+            end = source.length if end is None else min(end, source.length)
+            start = max(0, start)
+            if start < end:
+                segments.append([source, start, end])
+        if not segments:
+            raise ValueError('nothing to keep')
+
+        self.first = first = segments[0][0]
+        self.spf = spf = first.spf
+        info = first.info
+        for source in sources.values():
+            if (source.spf != spf
+                    or source.info['samplerate'] != info['samplerate']
+                    or source.info['channels'] != info['channels']):
+                raise ValueError('all parts need the same samplerate and '
+                                 'number of channels')
+
+        # Keep the first sample where it was in its frame, then shorten
+        # every part but the last so the next one keeps its frame grid too.
+        self.delay = (segments[0][1] + first.delay) % spf
+        self.total = self.delay + _DECODER_DELAY
+        length = 0
+        for n, segment in enumerate(segments):
+            source, start, end = segment
+            if n:
+                trim = (length - start - source.total + self.total) % spf
+                previous = segments[n - 1]
+                if trim >= previous[2] - previous[1]:
+                    raise ValueError('part %d is too short to join' % (n - 1))
+                previous[2] -= trim
+                length -= trim
+            segment.append(length)
+            length += end - start
+        self.segments = segments
+        self.frames = -(-(self.total + length) // spf)
+        self.padding = self.frames * spf - self.delay - length
+
+        # A frame is copied if it and its neighbours lie inside one part.
+        # The ends of the sources count as inside.
+        grid = []
+        for n, (source, start, end, offset) in enumerate(segments):
+            low = offset if n or start else None
+            high = offset + end - start
+            if n == len(segments) - 1 and end == source.length:
+                high = None
+            grid.append((source, low, high,
+                         (start - offset + source.total - self.total) // spf))
+        self.copies = []
+        for i in range(self.frames):
+            begin = (i - 1) * spf - self.total
+            end = (i + 2) * spf - self.total
+            copy = None
+            for source, low, high, shift in grid:
+                if ((low is None or low <= begin)
+                        and (high is None or end <= high)
+                        and 0 <= i + shift < source.frames):
+                    copy = source, i + shift
+                    break
+            self.copies.append(copy)
+
+        self.settings = {'in_samplerate': info['samplerate'],
+                         'out_samplerate': info['samplerate'],
+                         'num_channels': info['channels'],
+                         'mode': (MPEG_MODE_STEREO, MPEG_MODE_JOINT_STEREO,
+                                  MPEG_MODE_STEREO,
+                                  MPEG_MODE_MONO)[info['mode']],
+                         'write_vbr_tag': 0}
+        if 1 == len(set(info['bitrate'])):
+            self.settings['bitrate'] = info['bitrate'][0]
+        else:
+            self.settings['vbr'] = VBR_MODE_DEFAULT
+        self.settings.update(settings or {})
+
+    def pcm(self, start, end):
+        """Return the output samples [start, end), extended by the audio
+        around the first and the last part."""
+        pieces = []
+        last = len(self.segments) - 1
+        for n, (source, a, b, offset) in enumerate(self.segments):
+            low = start if 0 == n else max(start, offset)
+            high = end if last == n else min(end, offset + b - a)
+            if low < high:
+                pieces.append(source.pcm(a + low - offset, a + high - offset))
+        return b''.join(pieces)
+
+    def encode(self, i, limit):
+        """
+        Encode output frames i to limit (inclusive) again.
+
+        The encoder starts two frames early on the audio in front, so frame
+        i does not open with its priming silence.  Those frames are flushed
+        with their bit reservoir and dropped, like in _resume_encoder().
+        """
+        spf = self.spf
+        step = spf // 2 * 2 * self.first.info['channels']
+        encoder = new_encoder(self.settings)
+        start = (i - 2) * spf + encoder.encoder_delay - self.delay
+        pcm = self.pcm(start, start + (limit - i + 4) * spf)
+        pos = 0
+        while encoder.frame_num < 2 and pos < len(pcm):
+            encoder.encode_interleaved(pcm[pos:pos + step])
+            pos += step
+        encoder.flush_nogap()
+        data = encoder.encode_interleaved(pcm[pos:]) + encoder.flush_buffers()
+        return data, mp3_frames(data)
+
+    def window(self, i):
+        """Encode the frames from i on again up to a frame that can be
+        copied behind them, and return the index of that frame."""
+        first = i + 1
+        while first < self.frames and self.copies[first] is None:
+            first += 1
+        limit = min(self.frames, first + _EDIT_WINDOW)
+        while True:
+            data, info = self.encode(i, limit)
+            for j in range(first, limit + 1):
+                need = 0
+                if j < self.frames:
+                    if self.copies[j] is None:
+                        continue
+                    source, f = self.copies[j]
+                    need = source.info['main_data_begin'][f]
+                    # the rejoined frame reads its reservoir from the end
+                    # of the encoded ones
+                    if (need and (j - i >= len(info['offsets'])
+                                  or info['main_data_begin'][j - i] < need)):
+                        continue
+                break
+            else:
+                limit = min(self.frames, limit + 4 * _EDIT_WINDOW)
+                continue
+            break
+
+        count = j - i
+        if count > len(info['offsets']):
+            raise EncoderError('too few frames encoded at a cut')
+        end = len(data)
+        if count < len(info['offsets']):
+            end = info['offsets'][count]
+        chunk = bytearray(data[:end])
+        if need:
+            tail = source.main_tail(f, need)
+            g = count
+            while need:
+                g -= 1
+                end = info['offsets'][g] + info['frame_bytes'][g]
+                n = min(need, info['frame_bytes'][g] - info['header_bytes'])
+                chunk[end - n:end] = tail[need - n:need]
+                need -= n
+        self.chunks.append(bytes(chunk))
+        self.sizes.extend(info['frame_bytes'][:count])
+        return j
+
+    def run(self):
+        """Return the edited MP3 data."""
+        self.chunks = []
+        self.sizes = []
+        i = 0
+        copy = self.copies[0]
+        if copy is None or copy[0].info['main_data_begin'][copy[1]]:
+            i = self.window(0)
+        while i < self.frames:
+            source, f = self.copies[i]
+            count = 1
+            while (i + count < self.frames
+                   and self.copies[i + count] == (source, f + count)):
+                count += 1
+            self.chunks.append(source.frames_data(f, count))
+            self.sizes.extend(source.info['frame_bytes'][f:f + count])
+            i += count
+            if i < self.frames:
+                i = self.window(i)
+
+        audio = b''.join(self.chunks)
+        return (self.first.data[:self.first.info['start']]
+                + self.tag_frame(audio) + audio)
+
+    def tag_frame(self, audio):
+        """Return a Xing/Info frame with a LAME tag for the audio frames."""
+        header = bytearray(audio[:4])
+        lsf = not header[1] & 0x08
+        samplerate = self.first.info['samplerate']
+        bitrates = _MPEG_BITRATES[lsf]
+        header[1] |= 0x01       # no CRC
+        need = _xing_offset(header) + 156
+
+        def size(index):
+            return (lsf and 72000 or 144000) * bitrates[index] // samplerate
+
+        index = header[2] >> 4
+        if size(index) < need:
+            index = [n for n in range(1, 15) if size(n) >= need][0]
+        header[2] = index << 4 | header[2] & 0x0c
+        frame = bytearray(size(index))
+        frame[:4] = header
+
+        positions = []
+        offset = len(frame)
+        for n in self.sizes:
+            positions.append(offset)
+            offset += n
+        quality = lame = None
+        tag = self.first.info['tag']
+        if tag is not None:
+            quality, lame = _lame_tag_template(
+                self.first.data[tag[0]:tag[0] + tag[1]])
+        count = len(positions)
+        _fill_xing(frame, max(self.sizes) - min(self.sizes) > 1, count,
+                   [positions[n * count // 100] for n in range(100)],
+                   offset, self.delay, self.padding, crc16(audio), quality,
+                   lame)
+        return bytes(frame)
+
+
+def edit_mp3(parts, settings=None):
+    """
+    Cut and join MP3 data without encoding all of it again.
+
+    parts is a list of (data, start, end) tuples: samples start to end
+    (None: to the end) of MP3 data, counted without encoder delay and
+    padding.  Frames inside a part are copied.  Only the frames around a
+    cut or join are decoded and encoded again, with an encoder configured
+    like the first source (CBR at its bitrate, VBR otherwise) and then by
+    the settings dictionary; the frame behind them is chosen so its bit
+    reservoir can be carried over.  A new Xing/LAME tag holds the encoder
+    delay and padding of the result, so gapless players start and stop at
+    the exact sample.  Every part but the last may lose up to one frame of
+    samples at its end so the next part keeps its frame grid.  An ID3v2
+    tag of the first source is kept.
+    """
+    return _Mp3Edit(parts, settings).run()
+
+
+def cut_mp3(data, start_ms=0, end_ms=None, settings=None):
+    """Return MP3 data from start_ms to end_ms (None: the end) of data."""
+    samplerate = mp3_frames(data)['samplerate']
+    if not samplerate:
+        raise EncoderError('no MP3 frames found')
+    end = None
+    if end_ms is not None:
+        end = int(end_ms * samplerate // 1000)
+    return edit_mp3([(data, int(start_ms * samplerate // 1000), end)],
+                    settings)
+
+
+def join_mp3(parts, settings=None):
+    """Join MP3 data of the same samplerate and number of channels."""
+    return edit_mp3([(data, 0, None) for data in parts], settings)
@@ -30,12 +30,89 @@
 #include <Python.h>
 #include <lame/lame.h>
 
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GLIBC__) && \
+    (2 < __GLIBC__ || (2 == __GLIBC__ && 33 <= __GLIBC_MINOR__))
+#include <malloc.h>
+#define HAVE_MALLINFO2 1
+#endif
+
+/* Static tracepoints (USDT, provider "pylame") for perf and bpftrace,
+ * built with PYLAME_USDT; an unused probe costs a nop.  The first
+ * argument of every probe is the address of the Encoder.  Arguments that
+ * take work to compute are guarded with PYLAME_ENABLED(), which reads the
+ * semaphore a tracer increments while it is attached. */
+#ifdef PYLAME_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define PYLAME_PROBE1(name, a)          DTRACE_PROBE1(pylame, name, a)
+#define PYLAME_PROBE2(name, a, b)       DTRACE_PROBE2(pylame, name, a, b)
+#define PYLAME_PROBE3(name, a, b, c)    DTRACE_PROBE3(pylame, name, a, b, c)
+#define PYLAME_PROBE4(name, a, b, c, d) DTRACE_PROBE4(pylame, name, a, b, c, d)
+#define PYLAME_ENABLED(name) __builtin_expect(pylame_##name##_semaphore, 0)
+/* With semaphores on, every probe needs one. */
+#define PYLAME_SEMAPHORE(name) \
+    unsigned short pylame_##name##_semaphore \
+        __attribute__((unused)) __attribute__((section(".probes")))
+PYLAME_SEMAPHORE(init__start);
+PYLAME_SEMAPHORE(init__done);
+PYLAME_SEMAPHORE(encode__start);
+PYLAME_SEMAPHORE(encode__done);
+PYLAME_SEMAPHORE(flush__start);
+PYLAME_SEMAPHORE(flush__done);
+PYLAME_SEMAPHORE(buffer__grow);
+PYLAME_SEMAPHORE(tag__write);
+#else
+/* Statements, for the bodies of the PYLAME_ENABLED() guards. */
+#define PYLAME_PROBE1(name, a)          do { } while (0)
+#define PYLAME_PROBE2(name, a, b)       do { } while (0)
+#define PYLAME_PROBE3(name, a, b, c)    do { } while (0)
+#define PYLAME_PROBE4(name, a, b, c, d) do { } while (0)
+#define PYLAME_ENABLED(name) 0
+#endif
+
+/* Buffers named by the buffer__grow probe. */
+#define PROBE_MP3_BUF   0
+#define PROBE_FD_BUF    1
+
 #if PY_VERSION_HEX < 0x02050000 && !defined(PY_SSIZE_T_MIN)
 typedef int Py_ssize_t;
 #define PY_SSIZE_T_MAX INT_MAX
 #define PY_SSIZE_T_MIN INT_MIN
 #endif
 
+/* Python 3 builds need PyType_GetModuleByDef() (3.11); the binary data
+ * the Python 2 API calls strings are bytes there. */
+#if PY_MAJOR_VERSION >= 3
+#if PY_VERSION_HEX < 0x030B0000
+#error "Python 3.11 or newer is required"
+#endif
+#define PyString_FromStringAndSize  PyBytes_FromStringAndSize
+#define PyString_AS_STRING          PyBytes_AS_STRING
+#define PyString_GET_SIZE           PyBytes_GET_SIZE
+#define _PyString_Resize            _PyBytes_Resize
+#define PyInt_Check                 PyLong_Check
+#define PyInt_AS_LONG               PyLong_AsLong
+#define PyInt_AsLong                PyLong_AsLong
+#define PyInt_FromLong              PyLong_FromLong
+#define PyInt_FromSsize_t           PyLong_FromSsize_t
+#endif
+
 
 static void
 quiet_lib_printf(const char *format, va_list ap)
@@ -44,33 +121,388 @@ quiet_lib_printf(const char *format, va_list ap)
 }
 
 
+/* Bytes in use on the C heap, or -1 where that cannot be asked for.
+ * Allocations of other threads in the meantime blur the differences
+ * taken from this, so they are estimates. */
+static Py_ssize_t
+heap_in_use(void)
+{
+#ifdef HAVE_MALLINFO2
+    struct mallinfo2 info = mallinfo2();
+
+    return (Py_ssize_t)(info.uordblks + info.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+
 /* Declarations for objects of type lame.encoder */
 
+typedef struct {
+    unsigned char *data;
+    size_t size;                /* a power of two */
+    size_t head;                /* only moved by the producer */
+    size_t tail;                /* only moved by the consumer */
+} live_ring;
+
+/* Frame scanner: follows the MP3 output of an encoder frame by frame,
+ * for the analysis arrays (see start_analysis()) and the seek index
+ * (see start_seek_index()). */
+
+#define SCAN_MAX_FRAME          2881    /* layer III, 320 kbps, 32 kHz */
+#define SCAN_RESERVOIR          (511 + SCAN_MAX_FRAME)
+#define SCAN_NUM_SCALEFACTORS   39      /* 13 bands in 3 windows at most */
+#define ANALYSIS_FRAME_BYTES    (7 + 4 * (11 + SCAN_NUM_SCALEFACTORS))
+
+typedef struct {
+    unsigned char buf[2 * SCAN_MAX_FRAME];  /* output not yet a frame */
+    size_t len;
+    unsigned char main_data[SCAN_RESERVOIR];
+    size_t main_len;
+    unsigned PY_LONG_LONG offset;           /* stream offset of buf[0] */
+    unsigned PY_LONG_LONG frames;           /* audio frames seen */
+    unsigned PY_LONG_LONG sync_errors;      /* bytes skipped to resync */
+    int tag_pending;                        /* next frame is the tag frame */
+} frame_scanner;
+
+/* Per frame arrays; the granule arrays hold 2 granules of 2 channels per
+ * frame, scalefactors SCAN_NUM_SCALEFACTORS per granule and channel. */
+typedef struct {
+    Py_ssize_t capacity;        /* in frames */
+    Py_ssize_t frames;
+    Py_ssize_t dropped;         /* frames past capacity */
+    unsigned short *bitrate;
+    unsigned short *frame_bytes;
+    unsigned short *main_data_begin;
+    unsigned char *mode_extension;
+    unsigned short *part2_3_length;
+    unsigned short *big_values;
+    unsigned short *scalefac_compress;
+    unsigned char *global_gain;
+    unsigned char *block_type;
+    unsigned char *mixed_block;
+    unsigned char *preflag;
+    unsigned char *scalefac_scale;
+    unsigned char *scalefactors;
+} frame_analysis;
+
+/* Stream offsets of the frames holding every interval_ms of audio (or of
+ * every frame).  Grown without the GIL, so it uses malloc(). */
+typedef struct {
+    unsigned long *offsets;
+    Py_ssize_t len;
+    Py_ssize_t size;
+    int interval_ms;            /* 0: every frame */
+    int delay;                  /* encoder delay in samples */
+    int samplerate;
+    int samples_per_frame;
+    unsigned PY_LONG_LONG samples;  /* decoded samples before this frame */
+    int failed;                 /* out of memory */
+} seek_index;
+
+/* Silence trimming in front of LAME, see set_silence_trim().  Silence
+ * is a run of sample frames whose peak does not exceed threshold.  The
+ * first keep frames of a run go to LAME right away, the rest is held
+ * back until the run turns out to be short (then it goes to LAME too)
+ * or long (then only its last keep frames do, from the ring).  Grown
+ * without the GIL, so it uses malloc(). */
+typedef struct {
+    double threshold_db;
+    int threshold;              /* peak amplitude still taken as silence */
+    int min_ms;
+    int keep_ms;
+    int compress;               /* also cut long silences inside the audio */
+    unsigned long min_run;      /* sample frames */
+    unsigned long keep;
+    int channels;
+    int leading;                /* no sound yet in this stream */
+    int silent;                 /* in a run of silence */
+    int long_run;               /* the run is being cut, see ring */
+    unsigned PY_LONG_LONG pos;  /* sample frames seen */
+    unsigned PY_LONG_LONG run_start;
+    unsigned PY_LONG_LONG run_len;
+    unsigned char *hold;        /* the run after its first keep frames */
+    size_t hold_len;            /* bytes */
+    size_t hold_size;
+    unsigned char *ring;        /* the last keep frames of a long run */
+    size_t ring_pos;            /* bytes */
+    size_t ring_len;
+    unsigned PY_LONG_LONG *regions; /* start, end pairs of cut frames */
+    size_t regions_len;         /* pairs */
+    size_t regions_size;
+    unsigned PY_LONG_LONG removed;
+    int failed;                 /* out of memory */
+} silence_trim;
+
 typedef struct {
     PyObject_HEAD
     /* XXXX Add your own stuff here */
     lame_global_flags *gfp;
     unsigned char *mp3_buf;
-    int num_samples;
+    int mp3_buf_size;
+    int initialized;
+    int lean;                   /* keep no output buffers between calls */
+    Py_ssize_t buffer_bytes;    /* held in the buffers of the binding */
+    Py_ssize_t lame_bytes;      /* heap growth over lame_init*(), or -1 */
+    unsigned PY_LONG_LONG samples_encoded;  /* per channel, for gapless info */
+    unsigned char carry[4];     /* start of an incomplete sample frame */
+    int carry_len;
+    unsigned char *fd_buf;      /* output held back by encode_to_fd() */
+    size_t fd_buf_len;
+    size_t fd_buf_size;
+    int fd_coalesce;
+    int low_latency;
+    /* live mode, see start_live() */
+    int live_running;
+    int live_stop;
+    int live_error;
+    int live_chunk;             /* bytes of PCM per encode call */
+    int live_frame_bytes;       /* taken from LAME before the thread runs */
+    int live_samplerate;
+    int live_latency_ms;
+    pthread_t live_thread;
+    sem_t live_wake;            /* input available */
+    sem_t live_space;           /* output consumed */
+    live_ring live_in;
+    live_ring live_out;
+    unsigned char *live_pcm;
+    unsigned char *live_mp3;
+    int live_mp3_size;
+    size_t live_mp3_off;        /* output not yet moved to live_out */
+    size_t live_mp3_len;
+    unsigned PY_LONG_LONG live_overruns;
+    unsigned PY_LONG_LONG live_overrun_events;
+    unsigned char live_carry[4];    /* like carry, on the push() side */
+    int live_carry_len;
+    frame_scanner *scan;        /* follows the output, see scan_feed() */
+    frame_analysis *analysis;
+    seek_index *seek;
+    silence_trim *trim;
+    silence_trim *trim_retired; /* turned off while holding audio */
 } Encoder;
 
+#if PY_MAJOR_VERSION >= 3
+/* Python 3: the exception and the Encoder type live in the module state,
+ * so every (sub)interpreter gets its own; see lame_exec(). */
+typedef struct {
+    PyObject     *EncoderError;
+    PyTypeObject *EncoderType;
+} lame_state;
+
+static struct PyModuleDef lame_module;
+
+#define MODULE_STATE(module) ((lame_state *)PyModule_GetState(module))
+#define MODULE_ERROR(module) (MODULE_STATE(module)->EncoderError)
+#define ENCODER_ERROR(self) \
+    MODULE_ERROR(PyType_GetModuleByDef(Py_TYPE(self), &lame_module))
+#else
 static PyObject *EncoderError;
 
+#define MODULE_ERROR(module) EncoderError
+#define ENCODER_ERROR(self) EncoderError
+#endif
+
+/* Process wide memory accounting, see memory_usage().  Atomic, as
+ * interpreters with a GIL of their own share it. */
+static Py_ssize_t mem_encoders;
+static Py_ssize_t mem_buffer_bytes;
+static Py_ssize_t mem_lame_bytes;
+
+#define MEM_ADD(counter, delta) \
+    __atomic_add_fetch(&(counter), (delta), __ATOMIC_RELAXED)
+#define MEM_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/* Worst case MP3 output for num_bytes of 16 bit PCM (see lame.h). */
+#define MP3_BUF_SIZE(num_bytes) ((int)(1.25 * ((num_bytes) / 2) + 7200))
+
+/* Methods that use the LAME state must not run beside the live thread.
+ * The _OR variant is for the attribute getters and setters. */
+#define ENCODER_CHECK_IDLE_OR(self, failure) \
+    if ( (self)->live_running ) { \
+        PyErr_SetString(ENCODER_ERROR(self), \
+            "encoder is in live mode, use push()/pull() or stop_live()"); \
+        return failure; \
+    }
+#define ENCODER_CHECK_IDLE(self) ENCODER_CHECK_IDLE_OR(self, NULL)
+
+/* Note a change in the size of the buffers an encoder holds. */
+static void
+encoder_account(Encoder *self, Py_ssize_t delta)
+{
+    self->buffer_bytes += delta;
+    MEM_ADD(mem_buffer_bytes, delta);
+}
+
+/* Argument conversion for the single argument (METH_O) methods.  These
+ * spare the hot setters and encode calls the argument tuple and the
+ * format string parsing of PyArg_ParseTuple(). */
+
+static int
+parse_int_arg(PyObject *arg, int *value)
+{
+    long v;
+
+    v = PyInt_AsLong(arg);
+    if (-1 == v && PyErr_Occurred())
+        return -1;
+
+    if (INT_MAX < v || INT_MIN > v) {
+        PyErr_SetString(PyExc_OverflowError, "integer argument out of range");
+        return -1;
+    }
+
+    *value = (int)v;
+    return 0;
+}
+
+static int
+parse_ulong_arg(PyObject *arg, unsigned long *value)
+{
+    unsigned long v;
+
+    v = PyLong_AsUnsignedLong(arg);
+    if ((unsigned long)-1 == v && PyErr_Occurred())
+        return -1;
+
+    *value = v;
+    return 0;
+}
+
+static int
+parse_float_arg(PyObject *arg, float *value)
+{
+    double v;
+
+    v = PyFloat_AsDouble(arg);
+    if (-1.0 == v && PyErr_Occurred())
+        return -1;
+
+    *value = (float)v;
+    return 0;
+}
+
+#if PY_VERSION_HEX >= 0x03070000
+/* Python 3.7 and newer call the hot methods through METH_FASTCALL |
+ * METH_KEYWORDS: no argument tuple, and the arguments may be given by
+ * keyword too.  Puts the 'count' required arguments named in keywords
+ * into out (borrowed references). */
+static int
+parse_fastcall(const char *name, const char *const *keywords, int count,
+               PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames,
+               PyObject **out)
+{
+    Py_ssize_t i, nkw = NULL == kwnames ? 0 : PyTuple_GET_SIZE(kwnames);
+    int k;
+
+    if (nargs > count) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s() takes %d positional argument%s (%zd given)",
+                     name, count, 1 == count ? "" : "s", nargs);
+        return -1;
+    }
+    for (k = 0; k < count; k++)
+        out[k] = k < nargs ? args[k] : NULL;
+
+    for (i = 0; i < nkw; i++) {
+        PyObject *key = PyTuple_GET_ITEM(kwnames, i);
+
+        for (k = 0; k < count; k++)
+            if (0 == PyUnicode_CompareWithASCIIString(key, keywords[k]))
+                break;
+        if (k == count) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() got an unexpected keyword argument '%U'",
+                         name, key);
+            return -1;
+        }
+        if (NULL != out[k]) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() got multiple values for argument '%s'",
+                         name, keywords[k]);
+            return -1;
+        }
+        out[k] = args[nargs + i];
+    }
+
+    for (k = 0; k < count; k++)
+        if (NULL == out[k]) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() missing required argument '%s'",
+                         name, keywords[k]);
+            return -1;
+        }
+    return 0;
+}
+
+/* A METH_FASTCALL | METH_KEYWORDS front for a METH_O method, which
+ * Python 2 builds register as it is (see METH_O_FAST). */
+#define FASTCALL_O(func, name, keyword)                                 \
+static PyObject *                                                       \
+func##_fastcall(Encoder *self, PyObject *const *args, Py_ssize_t nargs, \
+                PyObject *kwnames)                                      \
+{                                                                       \
+    static const char *const keywords[] = { keyword };                  \
+    PyObject *arg;                                                      \
+                                                                        \
+    if (1 == nargs && NULL == kwnames)                                  \
+        return func(self, args[0]);                                     \
+    if (0 > parse_fastcall(name, keywords, 1, args, nargs, kwnames,     \
+                           &arg))                                       \
+        return NULL;                                                    \
+    return func(self, arg);                                             \
+}
+#define METH_O_FAST(func) \
+    (PyCFunction)(void (*)(void))func##_fastcall, METH_FASTCALL | METH_KEYWORDS
+#else
+#define FASTCALL_O(func, name, keyword)
+#define METH_O_FAST(func) (PyCFunction)func, METH_O
+#endif
+
+
+/* array.array(typecode, data) */
+static PyObject *
+new_array(const char *typecode, const void *data, Py_ssize_t size)
+{
+    PyObject *module, *bytes, *result;
+
+    module = PyImport_ImportModule( "array" );
+    if ( NULL == module )
+        return NULL;
+
+    bytes = PyString_FromStringAndSize( (const char *)data, size );
+    if ( NULL == bytes ) {
+        Py_DECREF( module );
+        return NULL;
+    }
+
+    result = PyObject_CallMethod( module, "array", "sO", typecode, bytes );
+    Py_DECREF( bytes );
+    Py_DECREF( module );
+    return result;
+}
+
+
 /* BEGIN lame.encoder methods. */
 
 static PyObject *
 mp3enc_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     Encoder *self;
+    Py_ssize_t heap;
 
     self = (Encoder *)type->tp_alloc(type, 0);
     if (NULL != self) {
+        heap = heap_in_use();
         self->gfp = lame_init();
         if (NULL == self->gfp) {
             PyErr_SetString(PyExc_MemoryError, "Can't initialize LAME.");
             Py_DECREF(self);
             return NULL;
         }
+        self->lame_bytes = 0 > heap ? -1 : heap_in_use() - heap;
+        MEM_ADD(mem_lame_bytes, 0 > self->lame_bytes ? 0 : self->lame_bytes);
+        MEM_ADD(mem_encoders, 1);
 
         /* Silence the chatty lame */
         lame_set_errorf(self->gfp, quiet_lib_printf);
@@ -82,12 +514,29 @@ mp3enc_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 }
 
 
+static void live_join(Encoder *self);
+static void live_release(Encoder *self);
+static void analysis_free(Encoder *self);
+static void seek_index_free(Encoder *self);
+static void scanner_free(Encoder *self);
+static void trim_free(Encoder *self);
+static void trim_destroy(silence_trim *t);
+
 static void
 mp3enc_dealloc(Encoder* self)
 {
+    PyTypeObject *tp;
+
+    if (self->live_running) {
+        live_join(self);
+        live_release(self);
+    }
+
     if (NULL != self->gfp) {
         lame_close(self->gfp);
         self->gfp = NULL;
+        MEM_ADD(mem_lame_bytes, -(0 > self->lame_bytes ? 0 : self->lame_bytes));
+        MEM_ADD(mem_encoders, -1);
     }
 
     if (NULL != self->mp3_buf) {
@@ -95,7 +544,24 @@ mp3enc_dealloc(Encoder* self)
         self->mp3_buf = NULL;
     }
 
-    self->ob_type->tp_free((PyObject *)self);
+    if (NULL != self->fd_buf) {
+        PyMem_Free(self->fd_buf);
+        self->fd_buf = NULL;
+    }
+
+    analysis_free(self);
+    seek_index_free(self);
+    scanner_free(self);
+    trim_free(self);
+    if ( NULL != self->trim_retired )
+        trim_destroy(self->trim_retired);
+    encoder_account(self, -self->buffer_bytes);
+
+    tp = Py_TYPE(self);
+    tp->tp_free((PyObject *)self);
+#if PY_MAJOR_VERSION >= 3
+    Py_DECREF(tp);     /* instances of heap types own a reference */
+#endif
 }
 
 
@@ -105,1506 +571,4640 @@ static char mp3enc_init__doc__[] =
 "C function: lame_init_params()\n"
 ;
 
+static int encoder_grow_buf(Encoder *self, int num_bytes);
+static int trim_held_bytes(Encoder *self);
+static int trim_prepare(Encoder *self);
+static void scanner_restart(Encoder *self);
+
 static PyObject *
 mp3enc_init(Encoder *self, PyObject *args)
 {
-    int nsamples;
+    Py_ssize_t heap;
+    int rc;
 
-    /* Allocate an internal buffer for the MP3 output. */
-    nsamples = lame_get_num_samples(self->gfp);
-    self->mp3_buf = PyMem_Malloc(1.25 * nsamples + 7200);
+    ENCODER_CHECK_IDLE(self)
 
-    if (NULL == self->mp3_buf) {
-        return PyErr_NoMemory();
+    /* Allocate an internal buffer for the MP3 output; it grows with the
+     * encode calls.  Lean encoders do without. */
+    if ( !self->lean && 0 > encoder_grow_buf(self, 0) )
+        return NULL;
+
+    /* Without the GIL, so that e.g. an EncoderPool thread can set up
+     * encoders beside the encoding ones.  Frees of other threads in the
+     * meantime may even make the heap shrink; count that as nothing. */
+    PYLAME_PROBE1(init__start, self);
+    Py_BEGIN_ALLOW_THREADS
+    heap = heap_in_use();
+    rc = lame_init_params(self->gfp);
+    if ( 0 <= heap )
+        heap = heap_in_use() - heap;
+    Py_END_ALLOW_THREADS
+    if ( 0 <= self->lame_bytes && 0 < heap ) {
+        self->lame_bytes += heap;
+        MEM_ADD(mem_lame_bytes, heap);
     }
+    PYLAME_PROBE3(init__done, self, rc, self->lame_bytes);
 
-    if (0 > lame_init_params(self->gfp)) {
+    if (0 > rc) {
         PyErr_SetString(PyExc_RuntimeError, "Can't initialize LAME parameters.");
         return NULL;
     }
+    self->initialized = 1;
+
+    if ( NULL != self->scan )
+        scanner_restart(self);
+    if ( NULL != self->trim && 0 > trim_prepare(self) )
+        return NULL;
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 
-static char mp3enc_encode_interleaved__doc__[] =
-"Encode interleaved audio data (2 channels, 16 bit per sample).\n"
-"Parameter: audiodata\n"
-"C function: lame_encode_buffer_interleaved()\n"
-;
+/* Raise the Python exception matching a negative return code of the
+ * lame_encode_*() functions.  Always returns NULL. */
 static PyObject *
-mp3enc_encode_interleaved(Encoder *self, PyObject *args)
+encoder_set_error(Encoder *self, int rc)
 {
-    int16_t* pcm;
-    int      num_samples;
-    int      mp3_data_size;
-    int      num_channels;
-
-    if ( !PyArg_ParseTuple( args, "s#", &pcm, &num_samples ) )
-        return NULL;
-
-    num_channels = lame_get_num_channels(self->gfp);
-
-    if ( self->num_samples < num_samples ) {
-	unsigned char *new_buf;
+    switch ( rc ) {
+        case -1:
+            PyErr_SetString(ENCODER_ERROR(self),
+                "mp3buf too small (this shouldn't happen, please report)");
+            return NULL;
+        case -2:
+            return PyErr_NoMemory();
+        case -3:
+            PyErr_SetString(ENCODER_ERROR(self),
+                "init_parameters() not called (a bug in your program)");
+            return NULL;
+        case -4:
+            PyErr_SetString(ENCODER_ERROR(self), "psycho acoustic problems");
+            return NULL;
+        default:
+            PyErr_Format(ENCODER_ERROR(self), "unknown error %d, please report", rc);
+            return NULL;
+    }
+}
 
-	new_buf = PyMem_Realloc(self->mp3_buf, 1.25*num_samples + 7200);
-	if (NULL == new_buf)
-	    return PyErr_NoMemory();
 
-	self->mp3_buf = new_buf;
-	self->num_samples = num_samples;
-    }
+/* Grow mp3_buf so it can take the output for num_bytes of audio data. */
+static int
+encoder_grow_buf(Encoder *self, int num_bytes)
+{
+    unsigned char *new_buf;
+    int size;
 
-    Py_BEGIN_ALLOW_THREADS
-    mp3_data_size = lame_encode_buffer_interleaved(
-                        self->gfp,
-                        pcm,
-                        num_samples / (num_channels * 2), /* 16bit! */
-                        self->mp3_buf,
-                        self->num_samples);
-    Py_END_ALLOW_THREADS
+    size = MP3_BUF_SIZE(num_bytes + trim_held_bytes(self));
+    if ( self->mp3_buf_size >= size )
+        return 0;
 
-    if ( 0 > mp3_data_size ) {
-        switch ( mp3_data_size ) {
-            case -1:
-                PyErr_SetString(EncoderError,
-                    "mp3buf too small (this shouldn't happen, please report)");
-                return NULL;
-            case -2:
-                return PyErr_NoMemory();
-            case -3:
-                PyErr_SetString(EncoderError,
-                    "init_parameters() not called (a bug in your program)");
-                return NULL;
-            case -4:
-                PyErr_SetString(EncoderError, "psycho acoustic problems");
-                return NULL;
-            default:
-                PyErr_Format(EncoderError, "unknown error %d, please report",
-                             mp3_data_size);
-                return NULL;
-        }
+    new_buf = PyMem_Realloc(self->mp3_buf, size);
+    if (NULL == new_buf) {
+        PyErr_NoMemory();
+        return -1;
     }
 
-    return Py_BuildValue("s#", self->mp3_buf, mp3_data_size);
+    PYLAME_PROBE4(buffer__grow, self, PROBE_MP3_BUF, self->mp3_buf_size, size);
+    encoder_account(self, size - self->mp3_buf_size);
+    self->mp3_buf = new_buf;
+    self->mp3_buf_size = size;
+    return 0;
 }
 
 
-static char mp3enc_flush_buffers__doc__[] =
-"Encode remaining samples and flush the MP3 buffer.\n"
-"No parameters.\n"
-"C function: lame_encode_flush()\n"
-;
-
-static PyObject *
-mp3enc_flush_buffers(Encoder *self, PyObject *args)
+/* Give up the output buffers of a lean encoder after a call. */
+static void
+encoder_lean_release(Encoder *self)
 {
-    int mp3_buf_fill_size;
-
-    Py_BEGIN_ALLOW_THREADS
-    mp3_buf_fill_size = lame_encode_flush(self->gfp, self->mp3_buf,
-                                          self->num_samples);
-    Py_END_ALLOW_THREADS
+    if ( !self->lean )
+        return;
 
-    if ( 0 > mp3_buf_fill_size ) {
-        switch ( mp3_buf_fill_size ) {
-            case -1:
-                PyErr_SetString(EncoderError,
-                    "mp3buf too small (this shouldn't happen, please report)" );
-                return NULL;
-            case -2:
-                PyErr_NoMemory();
-                return NULL;
-            case -3:
-                PyErr_SetString(EncoderError,
-                    "init_parameters() not called (a bug in your program)");
-                return NULL;
-            case -4:
-                PyErr_SetString(EncoderError, "psycho acoustic problems");
-                return NULL;
-            default:
-                PyErr_Format(EncoderError, "unknown error %d, please report",
-                             mp3_buf_fill_size);
-                return NULL;
-        }
+    if ( NULL != self->mp3_buf ) {
+        PyMem_Free(self->mp3_buf);
+        self->mp3_buf = NULL;
+        encoder_account(self, -self->mp3_buf_size);
+        self->mp3_buf_size = 0;
+    }
+    if ( NULL != self->fd_buf && 0 == self->fd_buf_len ) {
+        PyMem_Free(self->fd_buf);
+        self->fd_buf = NULL;
+        encoder_account(self, -(Py_ssize_t)self->fd_buf_size);
+        self->fd_buf_size = 0;
     }
-
-    return Py_BuildValue( "s#", self->mp3_buf, mp3_buf_fill_size );
 }
 
 
-
-static char mp3enc_set_num_samples__doc__[] =
-"Set the number of samples.\n"
-"Default: 2^32-1\n"
-"Parameter: int\n"
-"C function: lame_set_num_samples()\n"
-;
-
-static PyObject *
-mp3enc_set_num_samples(Encoder *self, PyObject *args)
+/* Get the audio data argument of the encode methods. */
+static int
+encoder_get_pcm(PyObject *arg, Py_buffer *view)
 {
-    unsigned long num_samples;
-
-    if ( !PyArg_ParseTuple( args, "k", &num_samples ) )
-        return NULL;
+    if ( 0 > PyObject_GetBuffer( arg, view, PyBUF_SIMPLE ) )
+        return -1;
 
-    if ( 0 > lame_set_num_samples( self->gfp, num_samples ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set number of samples" );
-        return NULL;
+    if ( INT_MAX / 2 < view->len ) {
+        PyBuffer_Release( view );
+        PyErr_SetString( PyExc_OverflowError, "audio data too large" );
+        return -1;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    return 0;
 }
 
-static char mp3enc_set_out_samplerate__doc__[] =
-"Set output samplerate (in Hz).\n"
-"Default: 0 (let LAME choose one)\n"
-"Parameter: int\n"
-"C function: lame_set_out_samplerate()\n"
-;
 
-static PyObject *
-mp3enc_set_out_samplerate(Encoder *self, PyObject *args)
+/* lame_encode_buffer_interleaved() reads every other sample even for
+ * mono, so mono goes through lame_encode_buffer(). */
+static int
+encoder_lame_encode(Encoder *self, short *pcm, int samples, int frame_bytes,
+                    unsigned char *out, int out_size)
 {
-    int out_samplerate;
+    if ( 2 == frame_bytes )
+        return lame_encode_buffer( self->gfp, pcm, pcm, samples,
+                                   out, out_size );
+    return lame_encode_buffer_interleaved( self->gfp, pcm, samples,
+                                           out, out_size );
+}
 
-    if ( !PyArg_ParseTuple( args, "i", &out_samplerate ) )
-        return NULL;
 
-    if ( 0 > lame_set_out_samplerate( self->gfp, out_samplerate ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set output samplerate" );
-        return NULL;
+/* Pass whole sample frames to LAME, through an aligned copy if pcm is
+ * not aligned for 16 bit access.  Counts them in samples_encoded. */
+static int
+encoder_encode_frames(Encoder *self, const unsigned char *pcm, int samples,
+                      int frame_bytes, unsigned char *out, int out_size)
+{
+    short bounce[2048];
+    int   done = 0, n, rc;
+
+    if ( 0 == (Py_uintptr_t)pcm % sizeof(short) ) {
+        rc = encoder_lame_encode( self, (short *)pcm, samples, frame_bytes,
+                                  out, out_size );
+        if ( 0 <= rc )
+            self->samples_encoded += samples;
+        return rc;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    while ( 0 < samples ) {
+        n = (int)sizeof(bounce) / frame_bytes;
+        if ( n > samples )
+            n = samples;
+        memcpy( bounce, pcm, n * frame_bytes );
+        rc = encoder_lame_encode( self, bounce, n, frame_bytes,
+                                  out + done, out_size - done );
+        if ( 0 > rc )
+            return rc;
+        self->samples_encoded += n;
+        done += rc;
+        pcm += n * frame_bytes;
+        samples -= n;
+    }
+    return done;
 }
 
 
-static char mp3enc_set_analysis__doc__[] =
-"Collect data for an MP3 frame analyzer.\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_analysis\n"
-;
+/* BEGIN silence trimming */
 
-static PyObject *
-mp3enc_set_analysis(Encoder *self, PyObject *args)
+/* Whether the sample frame at p has a sample above threshold. */
+static int
+trim_frame_loud(const unsigned char *p, int channels, int threshold)
 {
-    int analysis;
+    int16_t x;
+    int     c;
 
-    if ( !PyArg_ParseTuple( args, "i", &analysis ) )
-        return NULL;
+    for (c = 0; c < channels; c++) {
+        memcpy(&x, p + 2 * c, 2);
+        if ( (x < 0 ? -(int)x : x) > threshold )
+            return 1;
+    }
+    return 0;
+}
 
-    if ( 0 > lame_set_analysis( self->gfp, analysis ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set analysis mode" );
-        return NULL;
+/* Index of the first of frames sample frames at p that is loud (has a
+ * sample above threshold), or with !loud of the first one that is
+ * quiet; frames if there is none.  Mono and stereo go through SSE2,
+ * 8 samples at a time. */
+static size_t
+trim_scan(const unsigned char *p, size_t frames, int channels, int threshold,
+          int loud)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    if ( 2 >= channels ) {
+        const __m128i thr = _mm_set1_epi16((short)threshold);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i low = _mm_set1_epi32(0xffff);
+        size_t n = frames * channels, k;
+        int bits;
+
+        for (k = 0; k + 8 <= n; k += 8) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(p + 2 * k));
+            /* |x|, with -32768 saturated to 32767 */
+            __m128i a = _mm_max_epi16(x, _mm_subs_epi16(zero, x));
+            __m128i m = _mm_cmpgt_epi16(a, thr);
+
+            if ( 1 == channels ) {
+                /* two mask bits per sample */
+                bits = _mm_movemask_epi8(m);
+                if ( !loud )
+                    bits = ~bits & 0xffff;
+                if ( bits )
+                    return k + __builtin_ctz(bits) / 2;
+            } else {
+                /* fold each left/right pair into the low half of its
+                 * 32 bit lane: two mask bits per frame, 4 bits apart */
+                m = _mm_and_si128(_mm_or_si128(m, _mm_srli_epi32(m, 16)), low);
+                bits = _mm_movemask_epi8(m);
+                if ( !loud )
+                    bits = ~bits & 0x3333;
+                if ( bits )
+                    return k / 2 + __builtin_ctz(bits) / 4;
+            }
+        }
+        i = k / channels;
     }
+#endif
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    for (; i < frames; i++)
+        if ( trim_frame_loud(p + 2 * channels * i, channels, threshold)
+             == loud )
+            return i;
+    return frames;
 }
 
+/* Keep the last keep frames of data in the ring. */
+static void
+trim_ring_push(silence_trim *t, const unsigned char *data, size_t len)
+{
+    size_t size = t->keep * 2 * t->channels, n;
 
-static char mp3enc_set_write_vbr_tag__doc__[] =
-"Write a Xing VBR header frame.\n"
-"Default: 1\n"
-"Paramter: int\n"
-"C function: lame_set_bWriteVbrTag()\n"
-;
+    if ( 0 == size )
+        return;
+    if ( len >= size ) {
+        memcpy(t->ring, data + len - size, size);
+        t->ring_pos = 0;
+        t->ring_len = size;
+        return;
+    }
+    while ( 0 < len ) {
+        n = size - t->ring_pos;
+        if ( n > len )
+            n = len;
+        memcpy(t->ring + t->ring_pos, data, n);
+        t->ring_pos = (t->ring_pos + n) % size;
+        t->ring_len = t->ring_len + n > size ? size : t->ring_len + n;
+        data += n;
+        len -= n;
+    }
+}
 
-static PyObject *
-mp3enc_set_write_vbr_tag(Encoder *self, PyObject *args)
+/* Take n frames of the current run after its first keep frames. */
+static int
+trim_hold(silence_trim *t, const unsigned char *data, size_t n)
 {
-    int write_vbr_tag;
-
-    if ( !PyArg_ParseTuple( args, "i", &write_vbr_tag ) )
-        return NULL;
+    size_t len = n * 2 * t->channels;
+
+    if ( !t->long_run && ( t->leading || t->compress )
+         && t->run_len + n >= t->min_run ) {
+        /* Long enough to cut: from here on only the end counts. */
+        trim_ring_push(t, t->hold, t->hold_len);
+        t->hold_len = 0;
+        t->long_run = 1;
+    }
 
-    if ( 0 > lame_set_bWriteVbrTag( self->gfp, write_vbr_tag ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set write_vbr_tag" );
-        return NULL;
+    if ( t->long_run ) {
+        trim_ring_push(t, data, len);
+        return 0;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    if ( t->hold_size < t->hold_len + len ) {
+        size_t size = 2 * (t->hold_len + len);
+        unsigned char *hold = realloc(t->hold, size);
+
+        if ( NULL == hold ) {
+            t->failed = 1;
+            return -1;
+        }
+        t->hold = hold;
+        t->hold_size = size;
+    }
+    memcpy(t->hold + t->hold_len, data, len);
+    t->hold_len += len;
+    return 0;
 }
 
+/* Note frames [start, end) as cut. */
+static void
+trim_region(silence_trim *t, unsigned PY_LONG_LONG start,
+            unsigned PY_LONG_LONG end)
+{
+    if ( start >= end )
+        return;
+    t->removed += end - start;
+    if ( t->regions_len == t->regions_size ) {
+        size_t size = 2 * t->regions_size + 16;
+        unsigned PY_LONG_LONG *regions;
+
+        regions = realloc(t->regions, size * 2 * sizeof(*regions));
+        if ( NULL == regions ) {
+            t->failed = 1;
+            return;
+        }
+        t->regions = regions;
+        t->regions_size = size;
+    }
+    t->regions[2 * t->regions_len] = start;
+    t->regions[2 * t->regions_len + 1] = end;
+    t->regions_len++;
+}
 
-static char mp3enc_set_quality__doc__[] =
-"Choose quality.\n"
-"Range: 0 (best) - 9 (worst)\n"
-"Parameter: int\n"
-"C function: lame_set_quality()\n"
-;
-
-static PyObject *
-mp3enc_set_quality(Encoder *self, PyObject *args)
+/* End the current run of silence.  The held frames of a short run (or
+ * the last keep frames of a long one) go to LAME, unless the stream
+ * ends here (at_end), which drops a run that is long enough to cut. */
+static int
+trim_end_run(Encoder *self, int at_end, unsigned char *out, int out_size)
 {
-    int quality;
-
-    if ( !PyArg_ParseTuple( args, "i", &quality ) )
-        return NULL;
-
-    if ( 0 > lame_set_quality( self->gfp, quality ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set quality" );
-        return NULL;
+    silence_trim *t = self->trim;
+    int frame_bytes = 2 * t->channels, rc = 0, n;
+    unsigned long head = t->leading ? 0 : t->keep;
+    unsigned PY_LONG_LONG end = t->run_start + t->run_len;
+
+    if ( at_end && ( t->long_run || t->run_len >= t->min_run ) ) {
+        trim_region(t, t->run_start + head, end);
+    } else if ( t->long_run ) {
+        trim_region(t, t->run_start + head, end - t->ring_len / frame_bytes);
+        /* Oldest first: a full ring starts at ring_pos. */
+        if ( t->ring_len == t->keep * frame_bytes && 0 < t->ring_pos ) {
+            n = (int)((t->ring_len - t->ring_pos) / frame_bytes);
+            rc = encoder_encode_frames(self, t->ring + t->ring_pos, n,
+                                       frame_bytes, out, out_size);
+            if ( 0 > rc )
+                return rc;
+            n = encoder_encode_frames(self, t->ring,
+                                      (int)(t->ring_pos / frame_bytes),
+                                      frame_bytes, out + rc, out_size - rc);
+            rc = 0 > n ? n : rc + n;
+        } else if ( 0 < t->ring_len ) {
+            rc = encoder_encode_frames(self, t->ring,
+                                       (int)(t->ring_len / frame_bytes),
+                                       frame_bytes, out, out_size);
+        }
+    } else if ( 0 < t->hold_len ) {
+        rc = encoder_encode_frames(self, t->hold,
+                                   (int)(t->hold_len / frame_bytes),
+                                   frame_bytes, out, out_size);
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    t->hold_len = 0;
+    t->ring_pos = t->ring_len = 0;
+    t->long_run = 0;
+    t->silent = 0;
+    t->leading = 0;
+    return rc;
 }
 
+/* Start over for a new stream: it begins in leading silence. */
+static void
+trim_restart(silence_trim *t)
+{
+    t->hold_len = 0;
+    t->ring_pos = t->ring_len = 0;
+    t->long_run = 0;
+    t->leading = 1;
+    t->silent = 1;
+    t->run_start = t->pos;
+    t->run_len = 0;
+}
 
-static char mp3enc_set_free_format__doc__[] =
-"Use free format.\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_free_format()\n"
-;
-
-static PyObject *
-mp3enc_set_free_format(Encoder *self, PyObject *args)
+/* Reconfigured mid-stream: the prepared trimmer t takes over the sample
+ * positions and the cuts so far from old, and a leading silence still
+ * in progress with the frames it holds.  Other held frames stay with
+ * old, for trim_drain(). */
+static void
+trim_take_over(silence_trim *t, silence_trim *old)
 {
-    int free_format;
+    t->pos = old->pos;
+    t->regions = old->regions;
+    t->regions_len = old->regions_len;
+    t->regions_size = old->regions_size;
+    t->removed = old->removed;
+    t->failed = old->failed;
+    old->regions = NULL;
+    old->regions_len = old->regions_size = 0;
+
+    if ( !old->leading ) {
+        t->leading = 0;
+        t->silent = 0;
+        return;
+    }
 
-    if ( !PyArg_ParseTuple( args, "i", &free_format ) )
-        return NULL;
+    t->run_start = old->run_start;
+    t->run_len = old->run_len;
+    if ( old->long_run ) {
+        /* Oldest first, into a ring of the new size. */
+        t->long_run = 1;
+        trim_ring_push(t, old->ring + old->ring_pos,
+                       old->ring_len - old->ring_pos);
+        trim_ring_push(t, old->ring, old->ring_pos);
+        old->ring_pos = old->ring_len = 0;
+    } else {
+        t->hold = old->hold;
+        t->hold_len = old->hold_len;
+        t->hold_size = old->hold_size;
+        old->hold = NULL;
+        old->hold_len = old->hold_size = 0;
+    }
+}
 
-    if ( 0 > lame_set_free_format( self->gfp, free_format ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set to free format" );
-        return NULL;
+/* Pass samples whole sample frames through the trimmer to LAME. */
+static int
+trim_frames(Encoder *self, const unsigned char *pcm, int samples,
+            int frame_bytes, unsigned char *out, int out_size)
+{
+    silence_trim *t = self->trim;
+    const unsigned char *piece = pcm;   /* frames that go straight to LAME */
+    int    piece_len = 0, done = 0, rc, i = 0;
+    size_t n, head;
+
+#define TRIM_EMIT_PIECE() \
+    if ( 0 < piece_len ) { \
+        rc = encoder_encode_frames(self, piece, piece_len, frame_bytes, \
+                                   out + done, out_size - done); \
+        if ( 0 > rc ) \
+            return rc; \
+        done += rc; \
+        piece_len = 0; \
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
-}
+    while ( i < samples ) {
+        if ( !t->silent ) {
+            n = trim_scan(pcm + i * frame_bytes, samples - i, t->channels,
+                          t->threshold, 0);
+            piece_len += n;
+            i += n;
+            t->pos += n;
+            if ( i == samples )
+                break;
+            t->silent = 1;
+            t->run_start = t->pos;
+            t->run_len = 0;
+        }
 
+        n = trim_scan(pcm + i * frame_bytes, samples - i, t->channels,
+                      t->threshold, 1);
 
-static char mp3enc_set_bitrate__doc__[] =
-"Set bitrate.\n"
-"Default: 128\n"
-"Paramter: int\n"
-"C function: lame_set_brate()\n"
-;
+        /* The first keep frames of a run are kept in any case. */
+        head = t->leading ? 0 : t->keep;
+        if ( t->run_len < head ) {
+            size_t k = head - t->run_len < n ? head - t->run_len : n;
 
-static PyObject *
-mp3enc_set_bitrate(Encoder *self, PyObject *args)
-{
-    int brate;
+            piece_len += k;
+            i += k;
+            t->pos += k;
+            t->run_len += k;
+            n -= k;
+        }
 
-    if ( !PyArg_ParseTuple( args, "i", &brate ) )
-        return NULL;
+        if ( 0 < n ) {
+            TRIM_EMIT_PIECE()
+            if ( 0 > trim_hold(t, pcm + i * frame_bytes, n) )
+                return -2;      /* LAME's code for out of memory */
+            i += n;
+            t->pos += n;
+            t->run_len += n;
+            piece = pcm + i * frame_bytes;
+        }
 
-    if ( 0 > lame_set_brate( self->gfp, brate ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set bitrate" );
-        return NULL;
+        if ( i < samples ) {
+            /* Sound again.  A run that ends within its first keep frames
+             * is already in the piece. */
+            if ( t->long_run || 0 < t->hold_len ) {
+                TRIM_EMIT_PIECE()
+                rc = trim_end_run(self, 0, out + done, out_size - done);
+                if ( 0 > rc )
+                    return rc;
+                done += rc;
+                piece = pcm + i * frame_bytes;
+            } else {
+                t->silent = 0;
+                t->leading = 0;
+            }
+        }
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    TRIM_EMIT_PIECE()
+#undef TRIM_EMIT_PIECE
+    return done;
 }
 
-
-static char mp3enc_set_compression_ratio__doc__[] =
-"Set compression ratio.\n"
-"Default: 11.0\n"
-"Paramter: float\n"
-"C function: lame_set_compression_ratio()\n"
-;
-
-static PyObject *
-mp3enc_set_compression_ratio(Encoder *self, PyObject *args)
+/* Bytes of audio held back by the trimmer, to size output buffers. */
+static int
+trim_held_bytes(Encoder *self)
 {
-    float compression_ratio;
+    int held = 0;
+
+    if ( NULL != self->trim )
+        held += (int)(self->trim->hold_len + self->trim->ring_len);
+    if ( NULL != self->trim_retired )
+        held += (int)(self->trim_retired->hold_len
+                      + self->trim_retired->ring_len);
+    return held;
+}
 
-    if ( !PyArg_ParseTuple( args, "f", &compression_ratio ) )
-        return NULL;
+static void
+trim_destroy(silence_trim *t)
+{
+    free(t->hold);
+    free(t->ring);
+    free(t->regions);
+    PyMem_Free(t);
+}
 
-    if ( 0 > lame_set_compression_ratio( self->gfp, compression_ratio ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set compression ratio" );
-        return NULL;
+static void
+trim_free(Encoder *self)
+{
+    if ( NULL != self->trim ) {
+        trim_destroy(self->trim);
+        self->trim = NULL;
     }
-
-    Py_INCREF(Py_None);
-    return Py_None;
 }
 
+/* Take the trimmer out of the way, e.g. to turn trimming off.  Audio it
+ * still holds goes to LAME with the next encode or flush call (see
+ * trim_drain()), as the output buffer is only at hand there. */
+static void
+trim_retire(Encoder *self)
+{
+    silence_trim *t = self->trim;
 
-static char mp3enc_set_preset__doc__[] =
-"Set a built-in preset.  Paramter: int (bitrate) or any of the\n"
-"lame.PRESET_* contstants.\n"
-"C function: lame_set_preset()\n"
-;
+    if ( NULL == t )
+        return;
+    self->trim = NULL;
+    if ( 0 == t->hold_len + t->ring_len ) {
+        trim_destroy(t);
+        return;
+    }
+    /* Only a trimmer that saw audio since the last drain holds any. */
+    if ( NULL != self->trim_retired )
+        trim_destroy(self->trim_retired);
+    self->trim_retired = t;
+}
 
-static PyObject *
-mp3enc_set_preset(Encoder *self, PyObject *args)
+/* End the run of the retired trimmer, so its held frames go to LAME, and
+ * drop its buffers.  Runs without the GIL; the struct itself is freed
+ * by the next trim_retire() or the deallocation. */
+static int
+trim_drain(Encoder *self, unsigned char *out, int out_size)
 {
-    int preset;
+    silence_trim *t = self->trim_retired, *current = self->trim;
+    int rc;
 
-    if ( !PyArg_ParseTuple( args, "i", &preset ) )
-        return NULL;
+    self->trim = t;
+    rc = trim_end_run(self, 0, out, out_size);
+    self->trim = current;
 
-    if ( 0 > lame_set_preset( self->gfp, preset ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set preset" );
-        return NULL;
+    /* A cut at the end of its run belongs to the trimmer that took over. */
+    if ( NULL != current ) {
+        size_t i;
+
+        for (i = 0; i < t->regions_len; i++)
+            trim_region(current, t->regions[2 * i], t->regions[2 * i + 1]);
+        t->regions_len = 0;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    free(t->hold);
+    free(t->ring);
+    t->hold = t->ring = NULL;
+    t->hold_size = 0;
+    return rc;
 }
 
+#define trim_draining(self) \
+    (NULL != (self)->trim_retired \
+     && 0 < (self)->trim_retired->hold_len + (self)->trim_retired->ring_len)
 
-static char mp3enc_set_asm_optimizations__doc__[] =
-"Disable specific asm optimizations (if compiled in).\n"
-"Paramters: lame.ASM_MMX, lame.ASM_3DNOW, lame.ASM_SSE;\n"
-"           int (0 = disable)\n"
-"C function: lame_set_asm_optimizations()\n"
-;
-
-static PyObject *
-mp3enc_set_asm_optimizations(Encoder *self, PyObject *args)
+/* Size the trimmer for the stream format once it is known. */
+static int
+trim_prepare(Encoder *self)
 {
-    int val1, val2;
-
-    if ( !PyArg_ParseTuple( args, "ii", &val1, &val2 ) )
-        return NULL;
-
-    if ( 0 > lame_set_asm_optimizations( self->gfp, val1, val2 ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set asm optimizations" );
-        return NULL;
+    silence_trim *t = self->trim;
+    int samplerate = lame_get_in_samplerate(self->gfp);
+
+    t->channels = lame_get_num_channels(self->gfp);
+    t->min_run = (unsigned long)((PY_LONG_LONG)samplerate * t->min_ms / 1000);
+    t->keep = (unsigned long)((PY_LONG_LONG)samplerate * t->keep_ms / 1000);
+    free(t->ring);
+    t->ring = NULL;
+    if ( 0 < t->keep ) {
+        t->ring = malloc(t->keep * 2 * t->channels);
+        if ( NULL == t->ring ) {
+            trim_free(self);
+            PyErr_NoMemory();
+            return -1;
+        }
     }
-
-    Py_INCREF(Py_None);
-    return Py_None;
+    trim_restart(t);
+    return 0;
 }
 
+/* END silence trimming */
 
-static char mp3enc_set_error_protection__doc__[] =
-"Add error protection (uses 2 bytes from each frame for CRC).\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_error_protection()\n"
-;
+/* Whole sample frames on their way to LAME. */
+#define encoder_encode_trimmed(self, pcm, samples, frame_bytes, out, size) \
+    (NULL == (self)->trim \
+     ? encoder_encode_frames(self, pcm, samples, frame_bytes, out, size) \
+     : trim_frames(self, pcm, samples, frame_bytes, out, size))
 
-static PyObject *
-mp3enc_set_error_protection(Encoder *self, PyObject *args)
+
+/* Encode num_bytes of interleaved 16 bit audio into mp3_buf (or into
+ * the given buffer).  Bytes short of a whole sample frame are kept in
+ * carry and go in front of the next call.  Must be called without the
+ * GIL, after encoder_grow_buf(). */
+static int
+encoder_encode_pcm(Encoder *self, const int16_t *pcm, int num_bytes,
+                   unsigned char *out, int out_size)
 {
-    int error_protection;
+    const unsigned char *data = (const unsigned char *)pcm;
+    int frame_bytes, samples, need, rc, done = 0;
 
-    if ( !PyArg_ParseTuple( args, "i", &error_protection ) )
-        return NULL;
+    frame_bytes = 2 * lame_get_num_channels(self->gfp);  /* 16bit! */
 
-    if ( 0 > lame_set_error_protection( self->gfp, error_protection ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set error protection" );
-        return NULL;
+    /* Audio held by a trimmer that was turned off comes first. */
+    if ( trim_draining(self) ) {
+        done = trim_drain(self, out, out_size);
+        if ( 0 > done )
+            return done;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
-}
+    /* Complete the sample frame left over from the last call first. */
+    if ( 0 < self->carry_len ) {
+        need = frame_bytes - self->carry_len;
+        if ( need > num_bytes )
+            need = num_bytes;
+        memcpy( self->carry + self->carry_len, data, need );
+        self->carry_len += need;
+        data += need;
+        num_bytes -= need;
+        if ( self->carry_len < frame_bytes )
+            return done;
+
+        rc = encoder_encode_trimmed( self, self->carry, 1, frame_bytes,
+                                     out + done, out_size - done );
+        if ( 0 > rc )
+            return rc;
+        self->carry_len = 0;
+        done += rc;
+    }
 
+    samples = num_bytes / frame_bytes;
+    rc = encoder_encode_trimmed( self, data, samples, frame_bytes,
+                                 out + done, out_size - done );
+    if ( 0 > rc )
+        return rc;
 
-static char mp3enc_set_extension__doc__[] =
-"Set extension bit (meaningless).\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_extension()\n"
-;
+    self->carry_len = num_bytes - samples * frame_bytes;
+    memcpy( self->carry, data + samples * frame_bytes, self->carry_len );
 
-static PyObject *
-mp3enc_set_extension(Encoder *self, PyObject *args)
+    return done + rc;
+}
+
+static int
+encoder_encode_to(Encoder *self, const int16_t *pcm, int num_bytes,
+                  unsigned char *out, int out_size)
 {
-    int extension;
+    int rc;
 
-    if ( !PyArg_ParseTuple( args, "i", &extension ) )
-        return NULL;
+    PYLAME_PROBE3(encode__start, self, num_bytes, self->samples_encoded);
+    rc = encoder_encode_pcm(self, pcm, num_bytes, out, out_size);
+    PYLAME_PROBE3(encode__done, self, self->samples_encoded, rc);
+    return rc;
+}
 
-    if ( 0 > lame_set_extension( self->gfp, extension ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set extension bit" );
-        return NULL;
-    }
+/* Flush LAME (lame_encode_flush(), or lame_encode_flush_nogap() with
+ * nogap) into out.  Must be called without the GIL. */
+static int
+encoder_flush_to(Encoder *self, int nogap, unsigned char *out, int out_size)
+{
+    int rc, done = 0;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    PYLAME_PROBE3(flush__start, self, nogap, self->samples_encoded);
+    if ( trim_draining(self) ) {
+        done = trim_drain(self, out, out_size);
+        if ( 0 > done )
+            return done;
+    }
+    if ( NULL != self->trim && self->trim->silent ) {
+        rc = trim_end_run(self, 1, out + done, out_size - done);
+        if ( 0 > rc )
+            return rc;
+        done += rc;
+    }
+    if ( NULL != self->trim )
+        trim_restart(self->trim);
+    if ( nogap ) {
+        rc = lame_encode_flush_nogap(self->gfp, out + done, out_size - done);
+    } else {
+        self->carry_len = 0;            /* not a whole sample, dropped */
+        rc = lame_encode_flush(self->gfp, out + done, out_size - done);
+    }
+    if ( 0 <= rc )
+        rc += done;
+    PYLAME_PROBE3(flush__done, self, nogap, rc);
+    return rc;
 }
 
+/* BEGIN frame scanner */
 
-static char mp3enc_set_strict_iso__doc__[] =
-"Enforce strict ISO compliance.\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_strict_ISO()\n"
-;
+typedef struct {
+    int lsf;                    /* MPEG 2 or 2.5: one granule, short side info */
+    int crc;
+    int bitrate;                /* kbps */
+    int samplerate;
+    int mode;
+    int mode_ext;
+    int channels;
+    int size;                   /* bytes, including the header */
+    int side_info;              /* bytes of side info */
+} mpeg_header;
+
+static const int mpeg_bitrates[2][16] = {
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },
+    { 0,  8, 16, 24, 32, 40, 48, 56,  64,  80,  96, 112, 128, 144, 160, 0 }
+};
 
-static PyObject *
-mp3enc_set_strict_iso(Encoder *self, PyObject *args)
+static const int mpeg_samplerates[4][3] = {
+    { 11025, 12000,  8000 },    /* MPEG 2.5 */
+    {     0,     0,     0 },
+    { 22050, 24000, 16000 },    /* MPEG 2 */
+    { 44100, 48000, 32000 }     /* MPEG 1 */
+};
+
+/* Parse the 4 byte header of a layer III frame; free format is not
+ * supported.  Returns 0 or -1. */
+static int
+parse_mpeg_header(const unsigned char *p, mpeg_header *h)
 {
-    int strict_iso;
+    int version, bitrate_index, samplerate_index;
 
-    if ( !PyArg_ParseTuple( args, "i", &strict_iso ) )
-        return NULL;
+    if ( 0xff != p[0] || 0xe0 != (p[1] & 0xe0) || 0x02 != (p[1] & 0x06) )
+        return -1;
 
-    if ( 0 > lame_set_strict_ISO( self->gfp, strict_iso ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set strict ISO compliance" );
-        return NULL;
-    }
+    version = (p[1] >> 3) & 3;
+    bitrate_index = p[2] >> 4;
+    samplerate_index = (p[2] >> 2) & 3;
+    if ( 1 == version || 0 == bitrate_index || 15 == bitrate_index
+         || 3 == samplerate_index )
+        return -1;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    h->lsf = 3 != version;
+    h->crc = !(p[1] & 1);
+    h->bitrate = mpeg_bitrates[h->lsf][bitrate_index];
+    h->samplerate = mpeg_samplerates[version][samplerate_index];
+    h->mode = p[3] >> 6;
+    h->mode_ext = (p[3] >> 4) & 3;
+    h->channels = 3 == h->mode ? 1 : 2;
+    h->size = (h->lsf ? 72000 : 144000) * h->bitrate / h->samplerate
+              + ((p[2] >> 1) & 1);
+    if ( h->lsf )
+        h->side_info = 1 == h->channels ? 9 : 17;
+    else
+        h->side_info = 1 == h->channels ? 17 : 32;
+    return 0;
 }
 
 
-static char mp3enc_set_disable_reservoir__doc__[] =
-"Disable the bit reservoir (purpose: for testing only).\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_disable_reservoir()\n"
-;
+typedef struct {
+    const unsigned char *data;
+    size_t pos;                 /* in bits */
+    size_t end;                 /* in bits */
+} bit_reader;
+
+/* Read n <= 16 bits; reads past the end give zeros. */
+static unsigned int
+get_bits(bit_reader *br, int n)
+{
+    unsigned int v = 0;
 
-static PyObject *
-mp3enc_set_disable_reservoir(Encoder *self, PyObject *args)
+    while ( 0 < n-- ) {
+        v <<= 1;
+        if ( br->pos < br->end )
+            v |= (br->data[br->pos >> 3] >> (7 - (br->pos & 7))) & 1;
+        br->pos++;
+    }
+    return v;
+}
+
+
+/* Is this the Xing/Info frame LAME puts in front of the audio? */
+static int
+scan_is_tag_frame(const unsigned char *frame, const mpeg_header *h)
 {
-    int disable_reservoir;
+    const unsigned char *p = frame + 4 + (h->crc ? 2 : 0) + h->side_info;
 
-    if ( !PyArg_ParseTuple( args, "i", &disable_reservoir ) )
-        return NULL;
+    if ( p + 4 > frame + h->size )
+        return 0;
+    return 0 == memcmp(p, "Xing", 4) || 0 == memcmp(p, "Info", 4);
+}
 
-    if ( 0 > lame_set_disable_reservoir( self->gfp, disable_reservoir ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set disable_reservoir" );
-        return NULL;
+
+static const unsigned char slen_table[2][16] = {
+    { 0, 0, 0, 0, 3, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4 },
+    { 0, 1, 2, 3, 0, 1, 2, 3, 1, 2, 3, 1, 2, 3, 2, 3 }
+};
+
+/* Read the MPEG 1 scalefactors of one granule and channel into sf (see
+ * frame_analysis for the layout); prev holds those of granule 0. */
+static void
+scan_scalefactors(bit_reader *br, int scalefac_compress, int block_type,
+                  int mixed, int gr, const int *scfsi, unsigned char *sf,
+                  const unsigned char *prev)
+{
+    static const int bands[5] = { 0, 6, 11, 16, 21 };
+    int slen1 = slen_table[0][scalefac_compress];
+    int slen2 = slen_table[1][scalefac_compress];
+    int sfb, win, i, k = 0;
+
+    memset(sf, 0, SCAN_NUM_SCALEFACTORS);
+
+    if ( 2 == block_type ) {
+        if ( mixed ) {
+            for (sfb = 0; sfb < 8; sfb++)
+                sf[k++] = get_bits(br, slen1);
+            sfb = 3;
+        } else
+            sfb = 0;
+        for (; sfb < 12; sfb++)
+            for (win = 0; win < 3; win++)
+                sf[k++] = get_bits(br, 6 > sfb ? slen1 : slen2);
+        return;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    for (i = 0; i < 4; i++)
+        for (sfb = bands[i]; sfb < bands[i + 1]; sfb++)
+            if ( 1 == gr && scfsi[i] )
+                sf[sfb] = prev[sfb];
+            else
+                sf[sfb] = get_bits(br, 2 > i ? slen1 : slen2);
 }
 
 
-static char mp3enc_set_exp_quantization__doc__[] =
-"Select a different 'best quantization' function (experimental!).\n"
-"Default: 0\n"
-"Parameter: int\n"
-"C function: lame_set_experimentalX()\n"
-;
-
-static PyObject *
-mp3enc_set_exp_quantization(Encoder *self, PyObject *args)
+/* Record the side info and scalefactors of an audio frame. */
+static void
+scan_analyze(frame_analysis *a, frame_scanner *sc, const unsigned char *frame,
+             const mpeg_header *h)
 {
-    int quantization;
+    bit_reader side, bits;
+    int scfsi[2][4] = { { 0 } };
+    int main_data_begin, main_bytes, granules, gr, ch, i;
+    size_t start, pos;
+    Py_ssize_t f = a->frames;
+
+    side.data = frame + 4 + (h->crc ? 2 : 0);
+    side.pos = 0;
+    side.end = 8 * h->side_info;
+
+    if ( h->lsf ) {
+        main_data_begin = get_bits(&side, 8);
+        get_bits(&side, 1 == h->channels ? 1 : 2);
+    } else {
+        main_data_begin = get_bits(&side, 9);
+        get_bits(&side, 1 == h->channels ? 5 : 3);
+        for (ch = 0; ch < h->channels; ch++)
+            for (i = 0; i < 4; i++)
+                scfsi[ch][i] = get_bits(&side, 1);
+    }
 
-    if ( !PyArg_ParseTuple( args, "i", &quantization ) )
-        return NULL;
+    /* Keep the main data of this frame behind the last 511 bytes. */
+    main_bytes = h->size - 4 - (h->crc ? 2 : 0) - h->side_info;
+    if ( sc->main_len + main_bytes > SCAN_RESERVOIR ) {
+        size_t drop = sc->main_len + main_bytes - SCAN_RESERVOIR;
 
-    if ( 0 > lame_set_experimentalX( self->gfp, quantization ) ) {
-        PyErr_SetString( (PyObject *)self, "can't choose quantization function" );
-        return NULL;
+        memmove(sc->main_data, sc->main_data + drop, sc->main_len - drop);
+        sc->main_len -= drop;
+    }
+    memcpy(sc->main_data + sc->main_len,
+           frame + h->size - main_bytes, main_bytes);
+    start = sc->main_len >= (size_t)main_data_begin ?
+            sc->main_len - main_data_begin : 0;
+    sc->main_len += main_bytes;
+
+    if ( f >= a->capacity ) {
+        a->dropped++;
+        return;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    a->bitrate[f] = h->bitrate;
+    a->frame_bytes[f] = h->size;
+    a->main_data_begin[f] = main_data_begin;
+    a->mode_extension[f] = 1 == h->mode ? h->mode_ext : 0;
+
+    bits.data = sc->main_data;
+    bits.end = 8 * sc->main_len;
+    pos = 8 * start;
+
+    granules = h->lsf ? 1 : 2;
+    for (gr = 0; gr < 2; gr++) {
+        for (ch = 0; ch < 2; ch++) {
+            Py_ssize_t g = (f * 2 + gr) * 2 + ch;
+            int part2_3_length, scalefac_compress, block_type = 0, mixed = 0;
+            unsigned char *sf = a->scalefactors + g * SCAN_NUM_SCALEFACTORS;
+
+            a->part2_3_length[g] = 0;
+            a->big_values[g] = 0;
+            a->global_gain[g] = 0;
+            a->scalefac_compress[g] = 0;
+            a->block_type[g] = 0;
+            a->mixed_block[g] = 0;
+            a->preflag[g] = 0;
+            a->scalefac_scale[g] = 0;
+            memset(sf, 0, SCAN_NUM_SCALEFACTORS);
+            if ( gr >= granules || ch >= h->channels )
+                continue;
+
+            part2_3_length = get_bits(&side, 12);
+            a->part2_3_length[g] = part2_3_length;
+            a->big_values[g] = get_bits(&side, 9);
+            a->global_gain[g] = get_bits(&side, 8);
+            scalefac_compress = get_bits(&side, h->lsf ? 9 : 4);
+            a->scalefac_compress[g] = scalefac_compress;
+            if ( get_bits(&side, 1) ) {     /* window switching */
+                block_type = get_bits(&side, 2);
+                mixed = get_bits(&side, 1);
+                get_bits(&side, 10 + 9);    /* table_select, subblock_gain */
+            } else
+                get_bits(&side, 15 + 4 + 3);    /* table_select, regions */
+            a->block_type[g] = block_type;
+            a->mixed_block[g] = mixed;
+            if ( !h->lsf )
+                a->preflag[g] = get_bits(&side, 1);
+            a->scalefac_scale[g] = get_bits(&side, 1);
+            get_bits(&side, 1);             /* count1table_select */
+
+            /* MPEG 2 scalefactors are not decoded. */
+            if ( !h->lsf ) {
+                bits.pos = pos;
+                scan_scalefactors(&bits, scalefac_compress, block_type,
+                                  mixed, gr, scfsi[ch], sf,
+                                  gr ? sf - 2 * SCAN_NUM_SCALEFACTORS : NULL);
+            }
+            pos += part2_3_length;
+        }
+    }
+    a->frames++;
 }
 
 
-static char mp3enc_set_exp_y__doc__[] =
-"Experimental option.\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_experimentalY()\n"
-;
-
-static PyObject *
-mp3enc_set_exp_y(Encoder *self, PyObject *args)
+/* Runs without the GIL, as the encoder is busy in this thread the
+ * accounting (see encoder_account()) is safe. */
+static void
+index_append(Encoder *self, unsigned PY_LONG_LONG offset)
 {
-    int y;
+    seek_index *ix = self->seek;
 
-    if ( !PyArg_ParseTuple( args, "i", &y ) )
-        return NULL;
+    if ( ix->len == ix->size ) {
+        Py_ssize_t size = ix->size ? 2 * ix->size : 4096;
+        unsigned long *grown;
 
-    if ( 0 > lame_set_experimentalY( self->gfp, y ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set exp_y" );
-        return NULL;
+        grown = realloc(ix->offsets, size * sizeof(unsigned long));
+        if ( NULL == grown ) {
+            ix->failed = 1;
+            return;
+        }
+        encoder_account(self, (size - ix->size) * sizeof(unsigned long));
+        ix->offsets = grown;
+        ix->size = size;
     }
-
-    Py_INCREF(Py_None);
-    return Py_None;
+    ix->offsets[ix->len++] = (unsigned long)offset;
 }
 
+/* Add the index entries that fall into the audio frame at offset. */
+static void
+scan_index(Encoder *self, unsigned PY_LONG_LONG offset, const mpeg_header *h)
+{
+    seek_index *ix = self->seek;
+    unsigned PY_LONG_LONG end;
 
-static char mp3enc_set_exp_z__doc__[] =
-"Experimantal option.\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_experimentalZ()\n"
-;
+    if ( 0 == ix->samplerate ) {
+        ix->samplerate = h->samplerate;
+        ix->samples_per_frame = h->lsf ? 576 : 1152;
+    }
+    end = ix->samples + ix->samples_per_frame;
+
+    if ( 0 == ix->interval_ms ) {
+        if ( !ix->failed )
+            index_append(self, offset);
+    } else {
+        /* entry n is the frame decoding sample delay + n * interval */
+        while ( !ix->failed
+                && ix->delay + (unsigned PY_LONG_LONG)ix->len * ix->interval_ms
+                               * ix->samplerate / 1000 < end )
+            index_append(self, offset);
+    }
 
-static PyObject *
-mp3enc_set_exp_z(Encoder *self, PyObject *args)
-{
-    int z;
+    ix->samples = end;
+}
 
-    if ( !PyArg_ParseTuple( args, "i", &z ) )
-        return NULL;
 
-    if ( 0 > lame_set_experimentalZ( self->gfp, z ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set exp_z" );
-        return NULL;
+/* Follow len bytes of encoder output.  Runs without the GIL. */
+static void
+scan_feed(Encoder *self, const unsigned char *data, size_t len)
+{
+    frame_scanner *sc = self->scan;
+    mpeg_header h;
+    size_t pos, n;
+
+    while ( 0 < len ) {
+        n = sizeof(sc->buf) - sc->len;
+        if ( n > len )
+            n = len;
+        memcpy(sc->buf + sc->len, data, n);
+        sc->len += n;
+        data += n;
+        len -= n;
+
+        pos = 0;
+        while ( pos + 4 <= sc->len ) {
+            if ( 0 > parse_mpeg_header(sc->buf + pos, &h) ) {
+                pos++;
+                sc->sync_errors++;
+                continue;
+            }
+            if ( pos + h.size > sc->len )
+                break;
+            if ( sc->tag_pending ) {
+                /* its offset counts, but it holds no audio */
+                sc->tag_pending = 0;
+                pos += h.size;
+                continue;
+            }
+            if ( NULL != self->analysis )
+                scan_analyze(self->analysis, sc, sc->buf + pos, &h);
+            if ( NULL != self->seek )
+                scan_index(self, sc->offset + pos, &h);
+            sc->frames++;
+            pos += h.size;
+        }
+        memmove(sc->buf, sc->buf + pos, sc->len - pos);
+        sc->len -= pos;
+        sc->offset += pos;
     }
+}
 
-    Py_INCREF(Py_None);
-    return Py_None;
+/* Follow a new bitstream.  With bWriteVbrTag set LAME starts it with
+ * the tag frame, zero-filled until get_lametag_frame() is written over
+ * it, so the scanner can't tell it by its Xing/Info id. */
+static void
+scanner_restart(Encoder *self)
+{
+    memset(self->scan, 0, sizeof(frame_scanner));
+    self->scan->tag_pending = 0 != lame_get_bWriteVbrTag(self->gfp);
 }
 
+/* END frame scanner */
 
-static char mp3enc_set_exp_nspsytune__doc__[] =
-"Use Naoki's psycho acoustic model instead of GPSYCHO (experimental!).\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_exp_nspsytune()\n"
-;
 
+#define encoder_encode(self, pcm, num_bytes) \
+    encoder_encode_to(self, pcm, num_bytes, (self)->mp3_buf, (self)->mp3_buf_size)
+
+#define ENCODE_PCM      0
+#define ENCODE_FLUSH    1
+#define ENCODE_NOGAP    2
+
+/* Encode (ENCODE_PCM) or flush and return the output as a string.  Lean
+ * encoders write straight into the string instead of into mp3_buf. */
 static PyObject *
-mp3enc_set_exp_nspsytune(Encoder *self, PyObject *args)
+encoder_output_string(Encoder *self, int op, const int16_t *pcm,
+                      int num_bytes)
 {
-    int nspsytune;
+    PyObject      *result = NULL;
+    unsigned char *out;
+    int            out_size, rc;
+
+    if ( self->lean ) {
+        out_size = MP3_BUF_SIZE(num_bytes + trim_held_bytes(self));
+        result = PyString_FromStringAndSize( NULL, out_size );
+        if ( NULL == result )
+            return NULL;
+        out = (unsigned char *)PyString_AS_STRING( result );
+    } else {
+        if ( 0 > encoder_grow_buf( self, num_bytes ) )
+            return NULL;
+        out = self->mp3_buf;
+        out_size = self->mp3_buf_size;
+    }
 
-    if ( !PyArg_ParseTuple( args, "i", &nspsytune ) )
-        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    switch ( op ) {
+        case ENCODE_PCM:
+            rc = encoder_encode_to( self, pcm, num_bytes, out, out_size );
+            break;
+        case ENCODE_FLUSH:
+            rc = encoder_flush_to( self, 0, out, out_size );
+            break;
+        default:
+            rc = encoder_flush_to( self, 1, out, out_size );
+            break;
+    }
+    if ( 0 < rc && NULL != self->scan )
+        scan_feed( self, out, rc );
+    Py_END_ALLOW_THREADS
 
-    if ( 0 > lame_set_exp_nspsytune( self->gfp, nspsytune ) ) {
-        PyErr_SetString( (PyObject *)self, "can't use nspsytune" );
-        return NULL;
+    if ( 0 > rc ) {
+        Py_XDECREF( result );
+        return encoder_set_error( self, rc );
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    if ( NULL == result )
+        return PyString_FromStringAndSize( (char *)out, rc );
+
+    if ( 0 > _PyString_Resize( &result, rc ) )
+        return NULL;
+    return result;
 }
 
 
-static char mp3enc_set_vbr__doc__[] =
-"Set VBR mode.\n"
-"Default: lame.VBR_OFF (disabled)\n"
-"Parameter: lame.VBR_OFF, lame.VBR_OLD, lame.VBR_ABR, lame.VBR_NEW,\n"
-"           lame.VBR_DEFAULT\n"
-"C function: lame_set_VBR()\n"
+static char mp3enc_encode_interleaved__doc__[] =
+"Encode interleaved audio data (16 bit per sample; mono is one channel).\n"
+"The data may end or start in the middle of a sample: the bytes of an\n"
+"incomplete sample are kept and completed by the next call (and dropped\n"
+"by flush_buffers()), see pending_bytes.\n"
+"Parameter: audiodata\n"
+"C function: lame_encode_buffer_interleaved()\n"
 ;
-
 static PyObject *
-mp3enc_set_vbr(Encoder *self, PyObject *args)
+mp3enc_encode_interleaved(Encoder *self, PyObject *arg)
 {
-    int vbr;
+    Py_buffer view;
+    PyObject *result;
 
-    if ( !PyArg_ParseTuple( args, "i", &vbr ) )
-        return NULL;
+    ENCODER_CHECK_IDLE(self)
 
-    if ( 0 > lame_set_VBR( self->gfp, vbr ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set VBR mode" );
+    if ( 0 > encoder_get_pcm( arg, &view ) )
         return NULL;
-    }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    result = encoder_output_string( self, ENCODE_PCM, view.buf,
+                                    (int)view.len );
+
+    PyBuffer_Release( &view );
+    return result;
 }
 
 
-static char mp3enc_set_vbr_quality__doc__[] =
-"Set VBR quality level.\n"
-"Default: 4\n"
-"Parameter: 0 (highest) - 9 (lowest)\n"
-"C function: lame_set_VBR_q()\n"
+static char mp3enc_encode_chunks__doc__[] =
+"Encode a sequence of buffers of interleaved audio data (16 bit per\n"
+"sample) in one call, with the GIL released once for the whole batch.\n"
+"Returns (mp3data, lengths): the output of all chunks as one string and\n"
+"an array of the bytes of output that followed each chunk.\n"
+"Parameter: sequence of audiodata\n"
+"C function: lame_encode_buffer_interleaved()\n"
 ;
 
 static PyObject *
-mp3enc_set_vbr_quality(Encoder *self, PyObject *args)
+mp3enc_encode_chunks(Encoder *self, PyObject *arg)
 {
-    int vbr_quality;
+    PyObject   *seq, *result = NULL, *lengths;
+    Py_buffer  *views = NULL;
+    long       *sizes = NULL;
+    Py_ssize_t  n, got = 0, i;
+    size_t      total = 0, used = 0, capacity;
+    int         rc = 0, grow_failed = 0;
 
-    if ( !PyArg_ParseTuple( args, "i", &vbr_quality ) )
-        return NULL;
+    ENCODER_CHECK_IDLE(self)
 
-    if ( 0 > lame_set_VBR_q( self->gfp, vbr_quality ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set VBR quality level" );
+    seq = PySequence_Fast( arg, "encode_chunks() takes a sequence of buffers" );
+    if ( NULL == seq )
         return NULL;
-    }
 
-    Py_INCREF(Py_None);
-    return Py_None;
-}
+    n = PySequence_Fast_GET_SIZE( seq );
+    views = PyMem_Malloc( (n + 1) * sizeof(Py_buffer) );
+    sizes = PyMem_Malloc( (n + 1) * sizeof(long) );
+    if ( NULL == views || NULL == sizes ) {
+        PyErr_NoMemory();
+        goto out;
+    }
 
+    for (got = 0; got < n; got++) {
+        if ( 0 > encoder_get_pcm( PySequence_Fast_GET_ITEM( seq, got ),
+                                  &views[got] ) )
+            goto out;
+        total += views[got].len;
+        if ( INT_MAX / 2 < total ) {
+            got++;
+            PyErr_SetString( PyExc_OverflowError, "audio data too large" );
+            goto out;
+        }
+    }
 
-static char mp3enc_set_abr_bitrate__doc__[] =
-"Set ABR bitrate.\n"
-"Default: 128\n"
-"Parameter: int\n"
-"C function: lame_set_VBR_mean_bitrate_kbps()\n"
-;
+    /* Room for the whole batch at once; LAME's bound per call only has to
+     * be met for the call at hand. */
+    capacity = MP3_BUF_SIZE( (int)total + trim_held_bytes(self) );
+    result = PyString_FromStringAndSize( NULL, capacity );
+    if ( NULL == result )
+        goto out;
 
-static PyObject *
-mp3enc_set_abr_bitrate(Encoder *self, PyObject *args)
-{
-    int abr_bitrate;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < n; i++) {
+        int            need = MP3_BUF_SIZE( (int)views[i].len
+                                            + trim_held_bytes(self) );
+        unsigned char *out;
+
+        if ( capacity - used < (size_t)need ) {
+            capacity = used + need + capacity / 2;
+            Py_BLOCK_THREADS
+            grow_failed = 0 > _PyString_Resize( &result, capacity );
+            Py_UNBLOCK_THREADS
+            if ( grow_failed )
+                break;
+        }
 
-    if ( !PyArg_ParseTuple( args, "i", &abr_bitrate ) )
-        return NULL;
+        out = (unsigned char *)PyString_AS_STRING( result ) + used;
+        rc = encoder_encode_to( self, views[i].buf, (int)views[i].len,
+                                out, need );
+        if ( 0 > rc )
+            break;
+        if ( 0 < rc && NULL != self->scan )
+            scan_feed( self, out, rc );
+        used += rc;
+        sizes[i] = rc;
+    }
+    Py_END_ALLOW_THREADS
 
-    if ( 0 > lame_set_VBR_mean_bitrate_kbps( self->gfp, abr_bitrate ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set ABR bitrate" );
-        return NULL;
+    if ( grow_failed )
+        goto out;
+    if ( 0 > rc ) {
+        Py_CLEAR( result );
+        encoder_set_error( self, rc );
+        goto out;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    if ( 0 > _PyString_Resize( &result, used ) )
+        goto out;
+
+    lengths = new_array( "l", sizes, n * sizeof(long) );
+    if ( NULL == lengths ) {
+        Py_CLEAR( result );
+        goto out;
+    }
+    result = Py_BuildValue( "NN", result, lengths );
+
+  out:
+    for (i = 0; i < got; i++)
+        PyBuffer_Release( &views[i] );
+    PyMem_Free( views );
+    PyMem_Free( sizes );
+    Py_DECREF( seq );
+    return result;
 }
 
 
-static char mp3enc_set_vbr_min_bitrate__doc__[] =
-"Set minimal bitrate for ABR/VBR.\n"
-"Default: lowest possible bitrate\n"
-"Parameter: int\n"
-"C function: lame_set_VBR_min_bitrate_kbps()\n"
+static char mp3enc_flush_buffers__doc__[] =
+"Encode remaining samples and flush the MP3 buffer.\n"
+"No parameters.\n"
+"C function: lame_encode_flush()\n"
 ;
 
 static PyObject *
-mp3enc_set_vbr_min_bitrate(Encoder *self, PyObject *args)
+mp3enc_flush_buffers(Encoder *self, PyObject *args)
 {
-    int vbr_min_bitrate;
-
-    if ( !PyArg_ParseTuple( args, "i", &vbr_min_bitrate ) )
-        return NULL;
-
-    if ( 0 > lame_set_VBR_min_bitrate_kbps( self->gfp, vbr_min_bitrate ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set minimum bitrate" );
-        return NULL;
-    }
+    ENCODER_CHECK_IDLE(self)
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    return encoder_output_string( self, ENCODE_FLUSH, NULL, 0 );
 }
 
 
-static char mp3enc_set_vbr_max_bitrate__doc__[] =
-"Set maximal bitrate for ABR/VBR.\n"
-"Default: highest possible bitrate\n"
-"Parameter: int\n"
-"C function: lame_set_VBR_max_bitrate_kbps()\n"
+static char mp3enc_flush_nogap__doc__[] =
+"Flush the MP3 buffer without padding, so the next frames continue the\n"
+"stream seamlessly (for gapless segments).  Audio still buffered inside\n"
+"LAME stays there and goes into the next output.  The frame following\n"
+"the flush does not use the bit reservoir.\n"
+"No parameters.\n"
+"C function: lame_encode_flush_nogap()\n"
 ;
 
 static PyObject *
-mp3enc_set_vbr_max_bitrate(Encoder *self, PyObject *args)
+mp3enc_flush_nogap(Encoder *self, PyObject *args)
 {
-    int vbr_max_bitrate;
-
-    if ( !PyArg_ParseTuple( args, "i", &vbr_max_bitrate ) )
-        return NULL;
-
-    if ( 0 > lame_set_VBR_max_bitrate_kbps( self->gfp, vbr_max_bitrate ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set maximal bitrate" );
-        return NULL;
-    }
+    ENCODER_CHECK_IDLE(self)
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    return encoder_output_string( self, ENCODE_NOGAP, NULL, 0 );
 }
 
 
-static char mp3enc_set_vbr_min_enforce__doc__[] =
-"Enforce minimum bitrate for ABR/VBR, normally it will be violated for\n"
-"analog silence.\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_VBR_hard_min()\n"
+static char mp3enc_init_bitstream__doc__[] =
+"Start a new bitstream after flush_nogap(), without reinitializing the\n"
+"encoder: frame counters and histograms are reset.\n"
+"No parameters.\n"
+"C function: lame_init_bitstream()\n"
 ;
 
 static PyObject *
-mp3enc_set_vbr_min_enforce(Encoder *self, PyObject *args)
+mp3enc_init_bitstream(Encoder *self, PyObject *args)
 {
-    int vbr_min_enforce;
-
-    if ( !PyArg_ParseTuple( args, "i", &vbr_min_enforce ) )
-        return NULL;
+    ENCODER_CHECK_IDLE(self)
 
-    if ( 0 > lame_set_VBR_hard_min( self->gfp, vbr_min_enforce ) ) {
-        PyErr_SetString( (PyObject *)self, "can't enforce minimal bitrate" );
+    if ( 0 > lame_init_bitstream( self->gfp ) ) {
+        PyErr_SetString( ENCODER_ERROR(self), "can't initialize the bitstream" );
         return NULL;
     }
 
+    if ( NULL != self->scan )
+        scanner_restart(self);
+
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 
-static char mp3enc_set_lowpass_frequency__doc__[] =
-"Lowpass frequency in Hz (-1: disabled).\n"
-"Default: 0 (LAME chooses)\n"
-"Parameter: int\n"
-"C function: lame_set_lowpassfreq()\n"
+static char mp3enc_reset__doc__[] =
+"Prepare a flushed encoder for the next stream: start a new bitstream and\n"
+"clear the state of the binding (sample count, carried sample bytes, output\n"
+"not yet written to a file descriptor, frame scanner, analysis and seek\n"
+"index, which stay enabled).  The output is a valid stream, but not\n"
+"bit-identical to that of a fresh encoder: LAME has no call to reset its\n"
+"psychoacoustic history and filter banks, which carry over from the\n"
+"previous stream.\n"
+"No parameters.\n"
+"C function: lame_init_bitstream()\n"
 ;
 
 static PyObject *
-mp3enc_set_lowpass_frequency(Encoder *self, PyObject *args)
+mp3enc_reset(Encoder *self, PyObject *args)
 {
-    int lowpass_frequency;
+    ENCODER_CHECK_IDLE(self)
 
-    if ( !PyArg_ParseTuple( args, "i", &lowpass_frequency ) )
+    if ( !self->initialized ) {
+        PyErr_SetString( ENCODER_ERROR(self), "encoder is not initialized" );
         return NULL;
+    }
 
-    if ( 0 > lame_set_lowpassfreq( self->gfp, lowpass_frequency ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set lowpass frequency" );
+    if ( 0 > lame_init_bitstream( self->gfp ) ) {
+        PyErr_SetString( ENCODER_ERROR(self), "can't initialize the bitstream" );
         return NULL;
     }
 
+    self->samples_encoded = 0;
+    self->carry_len = 0;
+    self->fd_buf_len = 0;
+    if ( NULL != self->scan )
+        scanner_restart(self);
+    if ( NULL != self->analysis ) {
+        self->analysis->frames = 0;
+        self->analysis->dropped = 0;
+    }
+    if ( NULL != self->seek ) {
+        self->seek->len = 0;
+        self->seek->samples = 0;
+        self->seek->failed = 0;
+    }
+    if ( NULL != self->trim ) {
+        self->trim->pos = 0;
+        self->trim->regions_len = 0;
+        self->trim->removed = 0;
+        self->trim->failed = 0;
+        trim_restart(self->trim);
+    }
+    if ( NULL != self->trim_retired ) {
+        trim_destroy(self->trim_retired);
+        self->trim_retired = NULL;
+    }
+
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 
-static char mp3enc_set_lowpass_width__doc__[] =
-"Width of transition band in Hz.\n"
-"Default: one polyphase filter band\n"
-"Parameter: int\n"
-"C function: lame_set_lowpasswidth()\n"
-;
+/* Write the pending output in fd_buf followed by len bytes of buf to fd,
+ * in as few writev() calls as possible, starting *written bytes in.
+ * Short writes are continued and a non-blocking descriptor is waited for
+ * with poll().  Must be called without the GIL.  Returns 0, or -1 with
+ * errno set (EINTR after a signal or a short write, so the caller can
+ * run the signal handlers and call again); *written tells how many bytes
+ * made it out either way. */
+static int
+encoder_writev_fd(Encoder *self, int fd, const unsigned char *buf, size_t len,
+                  size_t *written)
+{
+    struct iovec  iov[2];
+    struct pollfd pfd;
+    size_t        total;
+    ssize_t       n;
+    int           iovcnt;
+
+    total = self->fd_buf_len + len;
+
+    while ( *written < total ) {
+        iovcnt = 0;
+        if ( *written < self->fd_buf_len ) {
+            iov[iovcnt].iov_base = self->fd_buf + *written;
+            iov[iovcnt].iov_len = self->fd_buf_len - *written;
+            iovcnt++;
+            iov[iovcnt].iov_base = (void *)buf;
+            iov[iovcnt].iov_len = len;
+        } else {
+            iov[iovcnt].iov_base =
+                (void *)(buf + (*written - self->fd_buf_len));
+            iov[iovcnt].iov_len = total - *written;
+        }
+        if ( 0 < iov[iovcnt].iov_len )
+            iovcnt++;
+
+        n = writev( fd, iov, iovcnt );
+        if ( 0 > n ) {
+            if ( EAGAIN == errno || EWOULDBLOCK == errno ) {
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                if ( 0 > poll( &pfd, 1, -1 ) )
+                    return -1;
+                continue;
+            }
+            return -1;
+        }
+        *written += n;
+        /* A signal cuts a blocking write short rather than failing it
+         * once some data is out, so report that as EINTR as well. */
+        if ( *written < total ) {
+            errno = EINTR;
+            return -1;
+        }
+    }
 
-static PyObject *
-mp3enc_set_lowpass_width(Encoder *self, PyObject *args)
+    return 0;
+}
+
+
+/* Send (or for small amounts, batch up) len bytes of output to fd.
+ * Called with the GIL held; releases it around the system calls.
+ * Returns the number of bytes written or -1 with an exception set. */
+static Py_ssize_t
+encoder_output_fd(Encoder *self, int fd, const unsigned char *buf, size_t len,
+                  int force)
 {
-    int lowpass_width;
+    size_t written;
+    int    rc, saved_errno;
+
+    /* Coalesce the output of small encode calls into one write, unless
+     * frames have to go out as soon as they are complete. */
+    if ( !force && !self->low_latency && !self->lean
+         && self->fd_buf_len + len < (size_t)self->fd_coalesce ) {
+        if ( self->fd_buf_size < self->fd_buf_len + len ) {
+            unsigned char *new_buf;
+
+            new_buf = PyMem_Realloc( self->fd_buf, self->fd_coalesce );
+            if ( NULL == new_buf ) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            PYLAME_PROBE4( buffer__grow, self, PROBE_FD_BUF,
+                           self->fd_buf_size, self->fd_coalesce );
+            encoder_account( self, self->fd_coalesce
+                                   - (Py_ssize_t)self->fd_buf_size );
+            self->fd_buf = new_buf;
+            self->fd_buf_size = self->fd_coalesce;
+        }
+        memcpy( self->fd_buf + self->fd_buf_len, buf, len );
+        self->fd_buf_len += len;
+        return 0;
+    }
 
-    if ( !PyArg_ParseTuple( args, "i", &lowpass_width ) )
-        return NULL;
+    written = 0;
+    for ( ;; ) {
+        Py_BEGIN_ALLOW_THREADS
+        rc = encoder_writev_fd( self, fd, buf, len, &written );
+        saved_errno = errno;
+        Py_END_ALLOW_THREADS
+
+        /* A blocked write is interrupted by e.g. Ctrl-C: run the signal
+         * handlers and only go on when none of them raised. */
+        if ( 0 <= rc || EINTR != saved_errno || 0 > PyErr_CheckSignals() )
+            break;
+    }
 
-    if ( 0 > lame_set_lowpasswidth( self->gfp, lowpass_width ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set width of lowpass" );
-        return NULL;
+    if ( 0 > rc ) {
+        size_t pending, unsent;
+
+        /* Keep what did not make it out for the next call. */
+        pending = self->fd_buf_len > written ? self->fd_buf_len - written : 0;
+        unsent = self->fd_buf_len + len - written - pending;
+        if ( 0 < pending )
+            memmove( self->fd_buf, self->fd_buf + written, pending );
+        if ( self->fd_buf_size < pending + unsent ) {
+            unsigned char *new_buf;
+
+            new_buf = PyMem_Realloc( self->fd_buf, pending + unsent );
+            if ( NULL == new_buf ) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            PYLAME_PROBE4( buffer__grow, self, PROBE_FD_BUF,
+                           self->fd_buf_size, pending + unsent );
+            encoder_account( self, (Py_ssize_t)(pending + unsent)
+                                   - (Py_ssize_t)self->fd_buf_size );
+            self->fd_buf = new_buf;
+            self->fd_buf_size = pending + unsent;
+        }
+        memcpy( self->fd_buf + pending, buf + len - unsent, unsent );
+        self->fd_buf_len = pending + unsent;
+
+        if ( !PyErr_Occurred() ) {
+            errno = saved_errno;
+            PyErr_SetFromErrno( PyExc_OSError );
+        }
+        return -1;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    self->fd_buf_len = 0;
+    return (Py_ssize_t)written;
 }
 
 
-static char mp3enc_set_highpass_frequency__doc__[] =
-"Highpass frequency in Hz (-1: disabled).\n"
-"Default: 0 (LAME chooses)\n"
-"Parameter: int\n"
-"C function: lame_set_highpassfreq()\n"
+static char mp3enc_encode_to_fd__doc__[] =
+"Encode interleaved audio data (16 bit per sample) and write the MP3\n"
+"data straight to a file descriptor, without creating a string.\n"
+"Output smaller than fd_coalesce bytes is held back and written together\n"
+"with the next call, so use one descriptor per encoder.  Returns the\n"
+"number of bytes written.\n"
+"Parameters: audiodata, int (file descriptor)\n"
+"C functions: lame_encode_buffer_interleaved(), writev()\n"
 ;
 
 static PyObject *
-mp3enc_set_highpass_frequency(Encoder *self, PyObject *args)
+encoder_encode_to_fd(Encoder *self, PyObject *object, int fd)
 {
-    int highpass_frequency;
+    Py_buffer   view;
+    int         mp3_data_size;
+    Py_ssize_t  written;
 
-    if ( !PyArg_ParseTuple( args, "i", &highpass_frequency ) )
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > encoder_get_pcm( object, &view ) )
         return NULL;
 
-    if ( 0 > lame_set_highpassfreq( self->gfp, highpass_frequency ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set highpass frequency" );
+    if ( 0 > encoder_grow_buf( self, (int)view.len ) ) {
+        PyBuffer_Release( &view );
         return NULL;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
-}
+    Py_BEGIN_ALLOW_THREADS
+    mp3_data_size = encoder_encode( self, view.buf, (int)view.len );
+    if ( 0 < mp3_data_size && NULL != self->scan )
+        scan_feed( self, self->mp3_buf, mp3_data_size );
+    Py_END_ALLOW_THREADS
 
+    PyBuffer_Release( &view );
 
-static char mp3enc_set_highpass_width__doc__[] =
-"Set width of highpass in Hz.\n"
-"Default: one polyphase filter band\n"
-"Parameter: int\n"
-"C function: lame_set_highpasswidth()\n"
-;
+    if ( 0 > mp3_data_size ) {
+        encoder_lean_release( self );
+        return encoder_set_error( self, mp3_data_size );
+    }
 
+    written = encoder_output_fd( self, fd, self->mp3_buf, mp3_data_size, 0 );
+    encoder_lean_release( self );
+    if ( 0 > written )
+        return NULL;
+
+    return PyInt_FromSsize_t( written );
+}
+
+#if PY_VERSION_HEX >= 0x03070000
 static PyObject *
-mp3enc_set_highpass_width(Encoder *self, PyObject *args)
+mp3enc_encode_to_fd(Encoder *self, PyObject *const *args, Py_ssize_t nargs,
+                    PyObject *kwnames)
 {
-    int highpass_width;
-
-    if ( !PyArg_ParseTuple( args, "i", &highpass_width ) )
+    static const char *const keywords[] = { "audiodata", "fd" };
+    PyObject   *arg[2];
+    int         fd;
+
+    if ( 2 == nargs && NULL == kwnames )
+        memcpy( arg, args, sizeof(arg) );
+    else if ( 0 > parse_fastcall( "encode_to_fd", keywords, 2, args, nargs,
+                                  kwnames, arg ) )
         return NULL;
-
-    if ( 0 > lame_set_highpasswidth( self->gfp, highpass_width ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set highpass width" );
+    if ( 0 > parse_int_arg( arg[1], &fd ) )
         return NULL;
-    }
+    return encoder_encode_to_fd( self, arg[0], fd );
+}
+#else
+static PyObject *
+mp3enc_encode_to_fd(Encoder *self, PyObject *args)
+{
+    PyObject   *object;
+    int         fd;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    if ( !PyArg_ParseTuple( args, "Oi", &object, &fd ) )
+        return NULL;
+    return encoder_encode_to_fd( self, object, fd );
 }
+#endif
 
 
-static char mp3enc_set_ath_for_masking_only__doc__[] =
-"Only use ATH for masking.\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_ATHonly()\n"
+static char mp3enc_flush_to_fd__doc__[] =
+"Encode remaining samples, flush the MP3 buffer and write everything that\n"
+"is still pending straight to a file descriptor.  Returns the number of\n"
+"bytes written.\n"
+"Parameter: int (file descriptor)\n"
+"C functions: lame_encode_flush(), writev()\n"
 ;
 
 static PyObject *
-mp3enc_set_ath_for_masking_only(Encoder *self, PyObject *args)
+mp3enc_flush_to_fd(Encoder *self, PyObject *arg)
 {
-    int ath_for_masking_only;
+    int         fd;
+    int         mp3_buf_fill_size;
+    Py_ssize_t  written;
+
+    ENCODER_CHECK_IDLE(self)
 
-    if ( !PyArg_ParseTuple( args, "i", &ath_for_masking_only) )
+    if ( 0 > parse_int_arg( arg, &fd ) )
         return NULL;
 
-    if ( 0 > lame_set_ATHonly( self->gfp, ath_for_masking_only ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set ath_for_masking_only" );
+    if ( 0 > encoder_grow_buf( self, 0 ) )
         return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    mp3_buf_fill_size = encoder_flush_to(self, 0, self->mp3_buf,
+                                         self->mp3_buf_size);
+    if ( 0 < mp3_buf_fill_size && NULL != self->scan )
+        scan_feed( self, self->mp3_buf, mp3_buf_fill_size );
+    Py_END_ALLOW_THREADS
+
+    if ( 0 > mp3_buf_fill_size ) {
+        encoder_lean_release( self );
+        return encoder_set_error( self, mp3_buf_fill_size );
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    written = encoder_output_fd( self, fd, self->mp3_buf,
+                                 mp3_buf_fill_size, 1 );
+    encoder_lean_release( self );
+    if ( 0 > written )
+        return NULL;
+
+    return PyInt_FromSsize_t( written );
 }
 
 
-static char mp3enc_set_ath_for_short_only__doc__[] =
-"Only use ATH for short blocks.\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_ATHshort()\n"
-;
+/* BEGIN live mode: a lock-free single producer / single consumer ring
+ * buffer of PCM in front of a native encoder thread, and a second ring
+ * for the encoded output.  push() and pull() never block and never wait
+ * for the encoder, they only copy bytes and move the ring indices. */
 
-static PyObject *
-mp3enc_set_ath_for_short_only(Encoder *self, PyObject *args)
+static size_t
+ring_round_size(size_t size)
 {
-    int ath_for_short_only;
+    size_t n = 4096;
 
-    if ( !PyArg_ParseTuple( args, "i", &ath_for_short_only ) )
-        return NULL;
+    while (n < size)
+        n <<= 1;
+    return n;
+}
 
-    if ( 0 > lame_set_ATHshort( self->gfp, ath_for_short_only ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set ath_for_short_only" );
-        return NULL;
+static int
+ring_alloc(live_ring *ring, size_t size)
+{
+    ring->size = ring_round_size(size);
+    ring->data = PyMem_Malloc(ring->size);
+    ring->head = 0;
+    ring->tail = 0;
+    return NULL == ring->data ? -1 : 0;
+}
+
+static void
+ring_free(live_ring *ring)
+{
+    if (NULL != ring->data) {
+        PyMem_Free(ring->data);
+        ring->data = NULL;
     }
+}
 
-    Py_INCREF(Py_None);
-    return Py_None;
+/* Bytes ready to be read; callable from either side. */
+static size_t
+ring_used(live_ring *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+        - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
 }
 
+/* Producer side: copy up to len bytes in, returns the number copied. */
+static size_t
+ring_write(live_ring *ring, const unsigned char *buf, size_t len)
+{
+    size_t head, tail, space, offset, first;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    space = ring->size - (head - tail);
+    if (len > space)
+        len = space;
+
+    offset = head & (ring->size - 1);
+    first = ring->size - offset;
+    if (first > len)
+        first = len;
+    memcpy(ring->data + offset, buf, first);
+    memcpy(ring->data, buf + first, len - first);
+
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
 
-static char mp3enc_set_ath_disable__doc__[] =
-"Disable ATH.\n"
-"Default: 0 (use ATH)\n"
-"Parameter: int\n"
-"C function: lame_set_noATH()\n"
-;
+/* Consumer side: copy up to len bytes out, returns the number copied. */
+static size_t
+ring_read(live_ring *ring, unsigned char *buf, size_t len)
+{
+    size_t head, tail, offset, first;
+
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (len > head - tail)
+        len = head - tail;
+
+    offset = tail & (ring->size - 1);
+    first = ring->size - offset;
+    if (first > len)
+        first = len;
+    memcpy(buf, ring->data + offset, first);
+    memcpy(buf + first, ring->data, len - first);
+
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
 
-static PyObject *
-mp3enc_set_ath_disable(Encoder *self, PyObject *args)
+
+/* Wait on a semaphore for at most ms milliseconds. */
+static void
+live_wait(sem_t *sem, int ms)
 {
-    int ath_disable;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (1000000000L <= ts.tv_nsec) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    while (0 > sem_timedwait(sem, &ts) && EINTR == errno)
+        ;
+}
 
-    if ( !PyArg_ParseTuple( args, "i", &ath_disable ) )
-        return NULL;
 
-    if ( 0 > lame_set_noATH( self->gfp, ath_disable ) ) {
-        PyErr_SetString( (PyObject *)self, "can't disable ATH" );
-        return NULL;
+/* The encoder thread: encode the input ring in chunks of live_chunk bytes
+ * and move the result to the output ring.  It never touches Python
+ * objects.  If the consumer does not keep up it waits for room in the
+ * output ring, which in turn makes push() count overruns. */
+static void *
+live_thread_main(void *arg)
+{
+    Encoder *self = arg;
+    int      rc;
+    size_t   n;
+
+    for (;;) {
+        if (ring_used(&self->live_in) < (size_t)self->live_chunk)
+            live_wait(&self->live_wake, self->live_latency_ms);
+
+        while (ring_used(&self->live_in) >= (size_t)self->live_chunk) {
+            if (__atomic_load_n(&self->live_stop, __ATOMIC_ACQUIRE))
+                return NULL;
+
+            ring_read(&self->live_in, self->live_pcm, self->live_chunk);
+            rc = encoder_encode_to(self, (int16_t *)self->live_pcm,
+                                   self->live_chunk, self->live_mp3,
+                                   self->live_mp3_size);
+            if (0 > rc) {
+                __atomic_store_n(&self->live_error, rc, __ATOMIC_RELEASE);
+                return NULL;
+            }
+
+            self->live_mp3_off = 0;
+            self->live_mp3_len = rc;
+            while (0 < self->live_mp3_len) {
+                n = ring_write(&self->live_out,
+                               self->live_mp3 + self->live_mp3_off,
+                               self->live_mp3_len);
+                self->live_mp3_off += n;
+                self->live_mp3_len -= n;
+                if (0 < self->live_mp3_len) {
+                    if (__atomic_load_n(&self->live_stop, __ATOMIC_ACQUIRE))
+                        return NULL;    /* stop_live() picks up the rest */
+                    live_wait(&self->live_space, self->live_latency_ms);
+                }
+            }
+        }
+
+        if (__atomic_load_n(&self->live_stop, __ATOMIC_ACQUIRE))
+            return NULL;
+    }
+}
+
+
+/* Bytes held by the live mode buffers allocated so far. */
+static Py_ssize_t
+live_bytes(Encoder *self)
+{
+    Py_ssize_t bytes = 0;
+
+    if (NULL != self->live_in.data)
+        bytes += self->live_in.size;
+    if (NULL != self->live_out.data)
+        bytes += self->live_out.size;
+    if (NULL != self->live_pcm)
+        bytes += self->live_chunk;
+    if (NULL != self->live_mp3)
+        bytes += self->live_mp3_size;
+    return bytes;
+}
+
+
+static void
+live_release(Encoder *self)
+{
+    encoder_account(self, -live_bytes(self));
+    ring_free(&self->live_in);
+    ring_free(&self->live_out);
+    if (NULL != self->live_pcm) {
+        PyMem_Free(self->live_pcm);
+        self->live_pcm = NULL;
+    }
+    if (NULL != self->live_mp3) {
+        PyMem_Free(self->live_mp3);
+        self->live_mp3 = NULL;
     }
+}
 
-    Py_INCREF(Py_None);
-    return Py_None;
+
+/* Stop and join the encoder thread.  Called with the GIL held. */
+static void
+live_join(Encoder *self)
+{
+    __atomic_store_n(&self->live_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&self->live_wake);
+    sem_post(&self->live_space);
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(self->live_thread, NULL);
+    Py_END_ALLOW_THREADS
+
+    sem_destroy(&self->live_wake);
+    sem_destroy(&self->live_space);
+    self->live_running = 0;
 }
 
 
-static char mp3enc_set_ath_type__doc__[] =
-"Select type of ATH.\n"
-"Default: XXX\n"
-"Parameter: int  XXX should be lame.YYY\n"
-"C function: lame_set_ATHtype()\n"
+static char mp3enc_start_live__doc__[] =
+"Start live mode: PCM is queued with push() and encoded by a native\n"
+"encoder thread in chunks of target_latency milliseconds; the output is\n"
+"collected with pull().  buffer_ms sizes the input and output rings.\n"
+"Other encode and flush methods are refused until stop_live().\n"
+"Parameters: int (target latency in ms), int (buffer in ms, default 1000)\n"
 ;
 
 static PyObject *
-mp3enc_set_ath_type(Encoder *self, PyObject *args)
+mp3enc_start_live(Encoder *self, PyObject *args)
 {
-    int ath_type;
+    int latency_ms, buffer_ms = 1000;
+    int frame_bytes, samplerate, chunk_samples;
 
-    if ( !PyArg_ParseTuple( args, "i", &ath_type ) )
+    if ( !PyArg_ParseTuple( args, "i|i", &latency_ms, &buffer_ms ) )
         return NULL;
 
-    if ( 0 > lame_set_ATHtype( self->gfp, ath_type ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set ATH type" );
+    ENCODER_CHECK_IDLE(self)
+
+    if ( !self->initialized ) {
+        PyErr_SetString(ENCODER_ERROR(self), "init() not called");
+        return NULL;
+    }
+
+    if ( NULL != self->trim || trim_draining(self) ) {
+        PyErr_SetString(ENCODER_ERROR(self),
+            "silence trimming is not available in live mode");
         return NULL;
     }
 
+    if ( 0 >= latency_ms || latency_ms > buffer_ms ) {
+        PyErr_SetString(PyExc_ValueError,
+            "need 0 < target latency <= buffer size");
+        return NULL;
+    }
+
+    frame_bytes = 2 * lame_get_num_channels(self->gfp);
+    samplerate = lame_get_in_samplerate(self->gfp);
+    chunk_samples = (int)((PY_LONG_LONG)samplerate * latency_ms / 1000);
+    if ( 1 > chunk_samples )
+        chunk_samples = 1;
+
+    self->live_chunk = chunk_samples * frame_bytes;
+    self->live_frame_bytes = frame_bytes;
+    self->live_samplerate = samplerate;
+    self->live_latency_ms = latency_ms;
+    self->live_mp3_size = 1.25 * chunk_samples + 7200;
+    self->live_mp3_off = self->live_mp3_len = 0;
+    self->live_stop = 0;
+    self->live_error = 0;
+    self->live_overruns = 0;
+    self->live_overrun_events = 0;
+    self->live_carry_len = 0;
+
+    self->live_pcm = PyMem_Malloc(self->live_chunk);
+    self->live_mp3 = PyMem_Malloc(self->live_mp3_size);
+    if ( NULL == self->live_pcm || NULL == self->live_mp3
+         || 0 > ring_alloc( &self->live_in, (size_t)samplerate * buffer_ms
+                                            / 1000 * frame_bytes )
+         /* 320 kbps are 40 bytes per millisecond. */
+         || 0 > ring_alloc( &self->live_out,
+                            (size_t)buffer_ms * 40 + 2 * 7200 ) ) {
+        encoder_account(self, live_bytes(self));
+        live_release(self);
+        return PyErr_NoMemory();
+    }
+    encoder_account(self, live_bytes(self));
+
+    if ( 0 > sem_init( &self->live_wake, 0, 0 ) ) {
+        live_release(self);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if ( 0 > sem_init( &self->live_space, 0, 0 ) ) {
+        sem_destroy(&self->live_wake);
+        live_release(self);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+
+    errno = pthread_create( &self->live_thread, NULL, live_thread_main, self );
+    if ( 0 != errno ) {
+        sem_destroy(&self->live_wake);
+        sem_destroy(&self->live_space);
+        live_release(self);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    self->live_running = 1;
+
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 
-static char mp3enc_set_ath_lower__doc__[] =
-"Lower ATH by this many dB.\n"
-"Default: 0\n"
-"Parameter: int\n"
-"C function: lame_set_ATHlower()\n"
+static char mp3enc_push__doc__[] =
+"Queue interleaved 16 bit audio data for the live encoder thread.\n"
+"Never blocks: what does not fit into the input ring is dropped and\n"
+"counted as an overrun.  The bytes of an incomplete sample at the end\n"
+"are kept for the next push().  Returns the number of bytes taken.\n"
+"Parameter: audiodata\n"
 ;
 
 static PyObject *
-mp3enc_set_ath_lower(Encoder *self, PyObject *args)
+mp3enc_push(Encoder *self, PyObject *arg)
 {
-    int ath_lower;
-
-    if ( !PyArg_ParseTuple( args, "i", &ath_lower ) )
+    Py_buffer            view;
+    const unsigned char *data;
+    size_t               before, space, avail, len, tail;
+    size_t               queued = 0, ringed = 0, dropped = 0;
+    int                  frame_bytes, need;
+
+    if ( !self->live_running ) {
+        PyErr_SetString(ENCODER_ERROR(self), "live mode not started");
         return NULL;
+    }
 
-    if ( 0 > lame_set_ATHlower( self->gfp, ath_lower ) ) {
-        PyErr_SetString( (PyObject *)self, "can't lower ATH" );
+    if ( 0 > PyObject_GetBuffer( arg, &view, PyBUF_SIMPLE ) )
         return NULL;
+
+    /* Only whole sample frames go into the ring.  Only this thread moves
+     * the head, so the free space can only grow while we copy. */
+    frame_bytes = self->live_frame_bytes;
+    before = ring_used(&self->live_in);
+    space = self->live_in.size - before;
+    data = view.buf;
+    avail = view.len;
+
+    /* Complete the sample left over from the last push() first.  Without
+     * room for it the whole sample is dropped, so the rest stays in phase. */
+    if ( 0 < self->live_carry_len ) {
+        need = frame_bytes - self->live_carry_len;
+        if ( (size_t)need > avail )
+            need = (int)avail;
+        memcpy( self->live_carry + self->live_carry_len, data, need );
+        self->live_carry_len += need;
+        data += need;
+        avail -= need;
+        if ( self->live_carry_len == frame_bytes ) {
+            if ( space >= (size_t)frame_bytes ) {
+                ringed = ring_write( &self->live_in, self->live_carry,
+                                     frame_bytes );
+                space -= frame_bytes;
+                queued += need;
+            } else
+                dropped += frame_bytes;
+            self->live_carry_len = 0;
+        } else
+            queued += need;
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    /* Drop only whole samples; a partial one at the very end waits for
+     * the next call. */
+    len = space < avail ? space : avail;
+    len -= len % frame_bytes;
+    ringed += ring_write( &self->live_in, data, len );
+    queued += len;
+    tail = (avail - len) % frame_bytes;
+    dropped += avail - len - tail;
+    if ( 0 < tail ) {
+        memcpy( self->live_carry, data + avail - tail, tail );
+        self->live_carry_len = (int)tail;
+        queued += tail;
+    }
+    PyBuffer_Release( &view );
+
+    if ( 0 < dropped ) {
+        self->live_overruns += dropped;
+        self->live_overrun_events++;
+    }
+
+    if ( before < (size_t)self->live_chunk
+         && before + ringed >= (size_t)self->live_chunk )
+        sem_post(&self->live_wake);
+
+    return PyInt_FromSsize_t( (Py_ssize_t)queued );
 }
 
 
-static char mp3enc_set_athaa_type__doc__[] =
-"Select type of ATH adaptive adjustment.\n"
-"Default: XXX\n"
-"Parameter: int  XXX should be lame.YYY\n"
-"C function: lame_set_athaa_type()\n"
+static char mp3enc_pull__doc__[] =
+"Collect the MP3 data the live encoder thread produced so far.\n"
+"Never blocks; returns an empty string if there is nothing new.\n"
 ;
 
 static PyObject *
-mp3enc_set_athaa_type(Encoder *self, PyObject *args)
+mp3enc_pull(Encoder *self, PyObject *args)
 {
-    int athaa_type;
+    PyObject *result;
+    size_t    len;
+    int       rc;
 
-    if ( !PyArg_ParseTuple( args, "i", &athaa_type ) )
+    if ( !self->live_running ) {
+        PyErr_SetString(ENCODER_ERROR(self), "live mode not started");
         return NULL;
+    }
 
-    if ( 0 > lame_set_athaa_type( self->gfp, athaa_type ) ) {
-        PyErr_SetString( (PyObject *)self, "can't select type of ATH adaptive adjustment" );
+    rc = __atomic_load_n(&self->live_error, __ATOMIC_ACQUIRE);
+    if ( 0 > rc )
+        return encoder_set_error( self, rc );
+
+    len = ring_used(&self->live_out);
+    result = PyString_FromStringAndSize(NULL, len);
+    if ( NULL == result )
         return NULL;
-    }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    ring_read(&self->live_out, (unsigned char *)PyString_AS_STRING(result),
+              len);
+    if ( 0 < len )
+        sem_post(&self->live_space);
+
+    return result;
 }
 
 
-static char mp3enc_set_athaa_sensitivity__doc__[] =
-"Adjust the point below which adaptive ATH level adjustment occurs (in dB).\n"
-"Default: 0\n"
+static char mp3enc_set_low_latency__doc__[] =
+"Minimise the audio buffered in the encoder: the bit reservoir is\n"
+"disabled, so every frame is output as soon as it is encoded, and\n"
+"encode_to_fd() does not hold back output.  Costs some quality at a\n"
+"given bitrate.  Use get_latency() to see what is still buffered.\n"
+"Call it before init().\n"
+"Default: 0 (disabled)\n"
 "Parameter: int\n"
-"C function: lame_set_athaa_sensitivity()\n"
+"C function: lame_set_disable_reservoir()\n"
 ;
 
 static PyObject *
-mp3enc_set_athaa_sensitivity(Encoder *self, PyObject *args)
+mp3enc_set_low_latency(Encoder *self, PyObject *arg)
 {
-    int athaa_sensitivity;
+    int low_latency;
+
+    ENCODER_CHECK_IDLE(self)
 
-    if ( !PyArg_ParseTuple( args, "i", &athaa_sensitivity ) )
+    if ( 0 > parse_int_arg( arg, &low_latency ) )
         return NULL;
 
-    if ( 0 > lame_set_athaa_sensitivity( self->gfp, athaa_sensitivity ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set ATHaa sensitivity" );
+    /* LAME only looks at the reservoir setting in lame_init_params(). */
+    if ( self->initialized ) {
+        PyErr_SetString( ENCODER_ERROR(self),
+                         "low latency mode must be set before init()" );
+        return NULL;
+    }
+
+    if ( 0 > lame_set_disable_reservoir( self->gfp, 0 != low_latency ) ) {
+        PyErr_SetString( ENCODER_ERROR(self), "can't set low latency mode" );
         return NULL;
     }
+    self->low_latency = 0 != low_latency;
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 
-static char mp3enc_set_allow_blocktype_difference__doc__[] =
-"Allow blocktypes to differ between channels.\n"
-"Default: 0 (disabled) for JOINT_STEREO, 1 (enabled) for STEREO\n"
-"Parameter: int\n"
-"C function: lame_set_allow_diff_short()\n"
+static char mp3enc_get_latency__doc__[] =
+"Get a dictionary describing the audio held in the encoder pipeline:\n"
+"queued_samples (live mode input not yet passed to LAME),\n"
+"buffered_samples (input inside LAME not yet in a frame),\n"
+"buffered_bytes (encoded data held back by LAME), encoder_delay and\n"
+"decoder_delay (priming samples on either side), and latency_ms, the\n"
+"queued and buffered audio in milliseconds.  In live mode LAME belongs to\n"
+"the encoder thread: buffered_samples, buffered_bytes and encoder_delay\n"
+"are None and latency_ms covers the queued audio only.\n"
+"C functions: lame_get_mf_samples_to_encode(), lame_get_size_mp3buffer(),\n"
+"             lame_get_encoder_delay()\n"
 ;
 
 static PyObject *
-mp3enc_set_allow_blocktype_difference(Encoder *self, PyObject *args)
+mp3enc_get_latency(Encoder *self, PyObject *args)
 {
-    int allow_blocktype_difference;
-
-    if ( !PyArg_ParseTuple( args, "i", &allow_blocktype_difference ) )
-        return NULL;
-
-    if ( 0 > lame_set_allow_diff_short( self->gfp, allow_blocktype_difference ) ) {
-        PyErr_SetString( (PyObject *)self, "can't set allow_blocktype_difference" );
-        return NULL;
+    Py_ssize_t queued = 0;
+    int        buffered, out_samplerate;
+
+    if ( self->live_running ) {
+        queued = ring_used( &self->live_in ) / self->live_frame_bytes;
+        return Py_BuildValue( "{snsOsOsOsisd}",
+                              "queued_samples", queued,
+                              "buffered_samples", Py_None,
+                              "buffered_bytes", Py_None,
+                              "encoder_delay", Py_None,
+                              "decoder_delay", 528 + 1,
+                              "latency_ms",
+                              1000.0 * queued / self->live_samplerate );
     }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    /* LAME buffers resampled input, so at the output rate. */
+    buffered = lame_get_mf_samples_to_encode( self->gfp );
+    out_samplerate = lame_get_out_samplerate( self->gfp );
+    if ( 0 >= out_samplerate )
+        out_samplerate = 44100;
+
+    return Py_BuildValue( "{snsisisisisd}",
+                          "queued_samples", queued,
+                          "buffered_samples", buffered,
+                          "buffered_bytes", lame_get_size_mp3buffer( self->gfp ),
+                          "encoder_delay", lame_get_encoder_delay( self->gfp ),
+                          "decoder_delay", 528 + 1,
+                          "latency_ms",
+                          1000.0 * buffered / out_samplerate );
 }
 
 
-static char mp3enc_set_use_temporal_masking__doc__[] =
-"Use temporal masking.\n"
-"Default: 1 (enabled)\n"
+static char mp3enc_set_lean__doc__[] =
+"Keep no output buffers between calls, to hold down the memory of many\n"
+"concurrent encoders: encode_interleaved() and the flush methods write\n"
+"straight into the returned string, the fd methods free their buffers\n"
+"after each call and encode_to_fd() does not hold back output.  The\n"
+"state of LAME itself is not affected; resampling, analysis,\n"
+"find_replay_gain and decode_on_the_fly each add to it.\n"
+"Call it before init().\n"
+"Default: 0 (disabled)\n"
 "Parameter: int\n"
-"C function: lame_set_useTemporal()\n"
 ;
 
 static PyObject *
-mp3enc_set_use_temporal_masking(Encoder *self, PyObject *args)
+mp3enc_set_lean(Encoder *self, PyObject *arg)
 {
-    int use_temporal_masking;
+    int lean;
 
-    if ( !PyArg_ParseTuple( args, "i", &use_temporal_masking ) )
+    if ( 0 > parse_int_arg( arg, &lean ) )
         return NULL;
 
-    if ( 0 > lame_set_useTemporal( self->gfp, use_temporal_masking ) ) {
-        PyErr_SetString( (PyObject *)self, "can't change temporal masking" );
-        return NULL;
-    }
+    ENCODER_CHECK_IDLE(self)
+
+    self->lean = 0 != lean;
+    encoder_lean_release( self );
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 
-static char mp3enc_set_inter_channel_ratio__doc__[] =
-"Set inter channel ratio.\n"
-"Default: XXX\n"
-"Parameter: float\n"
-"C function: lame_set_interChRatio()\n"
+static char mp3enc_memory_usage__doc__[] =
+"Get a dictionary of the memory held by this encoder in bytes: object\n"
+"(the Python object), buffers (output, fd and live mode buffers of the\n"
+"binding), lame (heap growth over lame_init() and lame_init_params(),\n"
+"None where the C library cannot tell) and total.\n"
 ;
 
 static PyObject *
-mp3enc_set_inter_channel_ratio(Encoder *self, PyObject *args)
+mp3enc_memory_usage(Encoder *self, PyObject *args)
 {
-    float inter_channel_ratio;
+    Py_ssize_t total;
+
+    total = Py_TYPE(self)->tp_basicsize + self->buffer_bytes;
+    if ( 0 > self->lame_bytes )
+        return Py_BuildValue("{s:n,s:n,s:O,s:n}",
+                             "object", Py_TYPE(self)->tp_basicsize,
+                             "buffers", self->buffer_bytes,
+                             "lame", Py_None,
+                             "total", total);
+
+    return Py_BuildValue("{s:n,s:n,s:n,s:n}",
+                         "object", Py_TYPE(self)->tp_basicsize,
+                         "buffers", self->buffer_bytes,
+                         "lame", self->lame_bytes,
+                         "total", total + self->lame_bytes);
+}
 
-    if ( !PyArg_ParseTuple( args, "f", &inter_channel_ratio ) )
-        return NULL;
 
-    if ( 0 > lame_set_interChRatio( self->gfp, inter_channel_ratio ) ) {
-        PyErr_SetString( (PyObject *)self, "can't change inter channel ratio" );
-        return NULL;
-    }
+/* BEGIN analysis arrays */
 
-    Py_INCREF(Py_None);
-    return Py_None;
+static void
+analysis_free(Encoder *self)
+{
+    frame_analysis *a = self->analysis;
+
+    if ( NULL == a )
+        return;
+    encoder_account(self, -(Py_ssize_t)(sizeof(*a)
+                                        + a->capacity * ANALYSIS_FRAME_BYTES));
+    PyMem_Free(a->bitrate);
+    PyMem_Free(a);
+    self->analysis = NULL;
 }
 
+static void
+scanner_free(Encoder *self)
+{
+    if ( NULL == self->scan || NULL != self->analysis || NULL != self->seek )
+        return;
+    PyMem_Free(self->scan);
+    self->scan = NULL;
+    encoder_account(self, -(Py_ssize_t)sizeof(frame_scanner));
+}
 
-static char mp3enc_set_no_short_blocks__doc__[] =
-"Disable the use of short blocks.\n"
-"Default: 0 (use short blocks)\n"
-"Parameter: int\n"
-"C function: lame_set_no_short_blocks()\n"
+static int
+scanner_alloc(Encoder *self)
+{
+    if ( NULL != self->scan )
+        return 0;
+    self->scan = PyMem_Malloc(sizeof(frame_scanner));
+    if ( NULL == self->scan ) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    /* Started before encoding, the tag frame is still to come. */
+    if ( 0 == self->samples_encoded )
+        scanner_restart(self);
+    else
+        memset(self->scan, 0, sizeof(frame_scanner));
+    encoder_account(self, sizeof(frame_scanner));
+    return 0;
+}
+
+
+static char mp3enc_start_analysis__doc__[] =
+"Collect the side information and scalefactors of the next max_frames\n"
+"frames of output into preallocated arrays; see get_analysis().  The\n"
+"data is parsed from the frames encode_interleaved(), the flush methods\n"
+"and the fd methods produce (not in live mode), so call it before\n"
+"encoding.  LAME's tag frame, the first frame of a bitstream when\n"
+"bWriteVbrTag is set, holds no audio and is skipped.  Masking thresholds\n"
+"and the other psychoacoustic data of set_analysis() stay inside LAME,\n"
+"which does not export them.\n"
+"Parameter: int (max_frames)\n"
 ;
 
 static PyObject *
-mp3enc_set_no_short_blocks(Encoder *self, PyObject *args)
+mp3enc_start_analysis(Encoder *self, PyObject *arg)
 {
-    int no_short_blocks;
+    frame_analysis *a;
+    int max_frames;
+    size_t granules;
+    unsigned char *p;
 
-    if ( !PyArg_ParseTuple( args, "i", &no_short_blocks ) )
+    if ( 0 > parse_int_arg( arg, &max_frames ) )
         return NULL;
 
-    if ( 0 > lame_set_no_short_blocks( self->gfp, no_short_blocks ) ) {
-        PyErr_SetString( (PyObject *)self, "can't change the use of short blocks" );
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 >= max_frames || max_frames > INT_MAX / ANALYSIS_FRAME_BYTES ) {
+        PyErr_SetString(PyExc_ValueError, "max_frames out of range");
+        return NULL;
+    }
+
+    analysis_free(self);
+    if ( 0 > scanner_alloc(self) )
         return NULL;
+
+    a = PyMem_Malloc(sizeof(*a));
+    granules = 4 * (size_t)max_frames;
+    p = PyMem_Malloc(max_frames * ANALYSIS_FRAME_BYTES);
+    if ( NULL == a || NULL == p ) {
+        PyMem_Free(a);
+        PyMem_Free(p);
+        scanner_free(self);
+        return PyErr_NoMemory();
     }
 
+    memset(a, 0, sizeof(*a));
+    a->capacity = max_frames;
+    /* one block, 16 bit arrays first */
+    a->bitrate = (unsigned short *)p;
+    a->frame_bytes = a->bitrate + max_frames;
+    a->main_data_begin = a->frame_bytes + max_frames;
+    a->part2_3_length = a->main_data_begin + max_frames;
+    a->big_values = a->part2_3_length + granules;
+    a->scalefac_compress = a->big_values + granules;
+    p = (unsigned char *)(a->scalefac_compress + granules);
+    a->mode_extension = p;
+    a->global_gain = a->mode_extension + max_frames;
+    a->block_type = a->global_gain + granules;
+    a->mixed_block = a->block_type + granules;
+    a->preflag = a->mixed_block + granules;
+    a->scalefac_scale = a->preflag + granules;
+    a->scalefactors = a->scalefac_scale + granules;
+
+    self->analysis = a;
+    encoder_account(self, sizeof(*a) + max_frames * ANALYSIS_FRAME_BYTES);
+
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 
-static char mp3enc_set_force_short_blocks__doc__[] =
-"Force the use of short blocks.\n"
-"Default: 0 (disabled)\n"
-"Parameter: int\n"
-"C function: lame_set_force_short_blocks()\n"
+static char mp3enc_get_analysis__doc__[] =
+"Get the data collected since start_analysis() as a dict of arrays:\n"
+"per frame bitrate (kbps), frame_bytes, main_data_begin and\n"
+"mode_extension (1: intensity, 2: mid/side stereo); per granule and\n"
+"channel (2 granules of 2 channels per frame, granule major, zero where\n"
+"the stream has fewer) part2_3_length (the bits allocated),\n"
+"big_values, global_gain, scalefac_compress, block_type (0 normal,\n"
+"1 start, 2 short, 3 stop), mixed_block, preflag, scalefac_scale; and\n"
+"scalefactors, 39 per granule and channel (long blocks: band order;\n"
+"short blocks: band major with 3 windows, after 8 long bands for mixed\n"
+"blocks; not decoded for MPEG 2).  Also frames (audio frames, without\n"
+"the tag frame), dropped (frames past max_frames) and sync_errors (bytes\n"
+"that were not part of a frame).\n"
 ;
 
 static PyObject *
-mp3enc_set_force_short_blocks(Encoder *self, PyObject *args)
+mp3enc_get_analysis(Encoder *self, PyObject *args)
 {
-    int force_short_blocks;
+    frame_analysis *a = self->analysis;
+    PyObject *result, *value;
+    Py_ssize_t n, g;
 
-    if ( !PyArg_ParseTuple( args, "i", &force_short_blocks ) )
+    if ( NULL == a ) {
+        PyErr_SetString(ENCODER_ERROR(self), "start_analysis() not called");
         return NULL;
+    }
 
-    if ( 0 > lame_set_force_short_blocks( self->gfp, force_short_blocks ) ) {
-        PyErr_SetString( (PyObject *)self, "can't force short blocks" );
+    n = a->frames;
+    g = 4 * n;
+
+    result = Py_BuildValue("{s:n,s:n,s:K}",
+                           "frames", n,
+                           "dropped", a->dropped,
+                           "sync_errors", self->scan->sync_errors);
+    if ( NULL == result )
         return NULL;
-    }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+#define ANALYSIS_ARRAY(key, typecode, field, count) \
+    value = new_array( typecode, a->field, (count) * sizeof(*a->field) ); \
+    if ( NULL == value || 0 > PyDict_SetItemString( result, key, value ) ) { \
+        Py_XDECREF( value ); \
+        Py_DECREF( result ); \
+        return NULL; \
+    } \
+    Py_DECREF( value );
+
+    ANALYSIS_ARRAY( "bitrate",           "H", bitrate,           n )
+    ANALYSIS_ARRAY( "frame_bytes",       "H", frame_bytes,       n )
+    ANALYSIS_ARRAY( "main_data_begin",   "H", main_data_begin,   n )
+    ANALYSIS_ARRAY( "mode_extension",    "B", mode_extension,    n )
+    ANALYSIS_ARRAY( "part2_3_length",    "H", part2_3_length,    g )
+    ANALYSIS_ARRAY( "big_values",        "H", big_values,        g )
+    ANALYSIS_ARRAY( "global_gain",       "B", global_gain,       g )
+    ANALYSIS_ARRAY( "scalefac_compress", "H", scalefac_compress, g )
+    ANALYSIS_ARRAY( "block_type",        "B", block_type,        g )
+    ANALYSIS_ARRAY( "mixed_block",       "B", mixed_block,       g )
+    ANALYSIS_ARRAY( "preflag",           "B", preflag,           g )
+    ANALYSIS_ARRAY( "scalefac_scale",    "B", scalefac_scale,    g )
+    ANALYSIS_ARRAY( "scalefactors",      "B", scalefactors,
+                    g * SCAN_NUM_SCALEFACTORS )
+#undef ANALYSIS_ARRAY
+
+    return result;
 }
 
 
-static char mp3enc_get_bitrate_histogram__doc__[] =
-"Get tuple of histogram dictionaries with bitrate/value keys.\n"
-"C functions: lame_bitrate_kbps(), lame_bitrate_hist()\n"
+static char mp3enc_stop_analysis__doc__[] =
+"Stop collecting analysis data and free the arrays.\n"
 ;
 
 static PyObject *
-mp3enc_get_bitrate_histogram(Encoder *self, PyObject *args)
+mp3enc_stop_analysis(Encoder *self, PyObject *args)
 {
-    int bitrate_count[14];
-    int bitrate_value[14];
+    ENCODER_CHECK_IDLE(self)
 
-    lame_bitrate_kbps(self->gfp, bitrate_value);
-    lame_bitrate_hist(self->gfp, bitrate_count);
+    analysis_free(self);
+    scanner_free(self);
 
-    return Py_BuildValue("({sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi})",
-                         "bitrate", bitrate_value[ 0],
-                         "value"  , bitrate_count[ 0],
-                         "bitrate", bitrate_value[ 1],
-                         "value"  , bitrate_count[ 1],
-                         "bitrate", bitrate_value[ 2],
-                         "value"  , bitrate_count[ 2],
-                         "bitrate", bitrate_value[ 3],
-                         "value"  , bitrate_count[ 3],
-                         "bitrate", bitrate_value[ 4],
-                         "value"  , bitrate_count[ 4],
-                         "bitrate", bitrate_value[ 5],
-                         "value"  , bitrate_count[ 5],
-                         "bitrate", bitrate_value[ 6],
-                         "value"  , bitrate_count[ 6],
-                         "bitrate", bitrate_value[ 7],
-                         "value"  , bitrate_count[ 7],
-                         "bitrate", bitrate_value[ 8],
-                         "value"  , bitrate_count[ 8],
-                         "bitrate", bitrate_value[ 9],
-                         "value"  , bitrate_count[ 9],
-                         "bitrate", bitrate_value[10],
-                         "value"  , bitrate_count[10],
-                         "bitrate", bitrate_value[11],
-                         "value"  , bitrate_count[11],
-                         "bitrate", bitrate_value[12],
-                         "value"  , bitrate_count[12],
-                         "bitrate", bitrate_value[13],
-                         "value"  , bitrate_count[13]);
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
+/* END analysis arrays */
 
-static char mp3enc_get_bitrate_values__doc__[] =
-"Get tuple of possible bitrates.\n"
-"C function: lame_bitrate_kbps()\n"
+
+/* BEGIN seek index */
+
+static void
+seek_index_free(Encoder *self)
+{
+    if ( NULL == self->seek )
+        return;
+    encoder_account(self, -(Py_ssize_t)(sizeof(seek_index)
+                                        + self->seek->size
+                                          * sizeof(unsigned long)));
+    free(self->seek->offsets);
+    PyMem_Free(self->seek);
+    self->seek = NULL;
+}
+
+
+static char mp3enc_start_seek_index__doc__[] =
+"Record a seek index while encoding: the stream offset of the frame\n"
+"holding every interval_ms of audio (encoder delay accounted for), or\n"
+"with 0 of every audio frame.  Offsets count from the start of the\n"
+"output including the Xing/LAME tag frame.  It follows the output of\n"
+"encode_interleaved(), the flush methods and the fd methods (not live\n"
+"mode), so call it after init() and before encoding.\n"
+"Parameter: int (interval_ms, default 0)\n"
 ;
 
 static PyObject *
-mp3enc_get_bitrate_values(Encoder *self, PyObject *args)
+mp3enc_start_seek_index(Encoder *self, PyObject *args)
 {
-    int bitrate_count[14];
+    int interval_ms = 0;
 
-    lame_bitrate_kbps( self->gfp, bitrate_count );
+    if ( !PyArg_ParseTuple( args, "|i", &interval_ms ) )
+        return NULL;
 
-    return Py_BuildValue( "(iiiiiiiiiiiiii)",
-			  bitrate_count[ 0],
-			  bitrate_count[ 1],
-			  bitrate_count[ 2],
-			  bitrate_count[ 3],
-			  bitrate_count[ 4],
-			  bitrate_count[ 5],
-			  bitrate_count[ 6],
-			  bitrate_count[ 7],
-			  bitrate_count[ 8],
-			  bitrate_count[ 9],
-			  bitrate_count[10],
-			  bitrate_count[11],
-			  bitrate_count[12],
-			  bitrate_count[13] );
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > interval_ms ) {
+        PyErr_SetString(PyExc_ValueError, "interval_ms must not be negative");
+        return NULL;
+    }
+
+    seek_index_free(self);
+    if ( 0 > scanner_alloc(self) )
+        return NULL;
+
+    self->seek = PyMem_Malloc(sizeof(seek_index));
+    if ( NULL == self->seek ) {
+        scanner_free(self);
+        return PyErr_NoMemory();
+    }
+    memset(self->seek, 0, sizeof(seek_index));
+    encoder_account(self, sizeof(seek_index));
+    self->seek->interval_ms = interval_ms;
+    self->seek->delay = lame_get_encoder_delay(self->gfp);
+
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
 
-static char mp3enc_get_bitrate_stereo_mode_histogram__doc__[] =
-"Get tuple of dictionaries for stereo mode histogram with LR/LR-I/MS/MS-I keys.\n"
-"C function: lame_bitrate_stereo_mode_hist()\n"
+static char mp3enc_get_seek_index__doc__[] =
+"Get the seek index recorded since start_seek_index() as a dict:\n"
+"offsets (array of stream offsets, entry n for n * interval_ms or for\n"
+"audio frame n), interval_ms, samplerate, samples_per_frame and\n"
+"encoder_delay.\n"
 ;
 
 static PyObject *
-mp3enc_get_bitrate_stereo_mode_histogram(Encoder *self, PyObject *args)
+mp3enc_get_seek_index(Encoder *self, PyObject *args)
 {
-    int bitrate_stmode_count[14][4];
+    seek_index *ix = self->seek;
+    PyObject *offsets;
 
-    lame_bitrate_stereo_mode_hist( self->gfp, bitrate_stmode_count );
+    if ( NULL == ix ) {
+        PyErr_SetString(ENCODER_ERROR(self), "start_seek_index() not called");
+        return NULL;
+    }
+    if ( ix->failed )
+        return PyErr_NoMemory();
 
-    return Py_BuildValue( "({sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi})",
-			  "LR"  , bitrate_stmode_count[ 0][0],
-			  "LR-I", bitrate_stmode_count[ 0][1],
-			  "MS"  , bitrate_stmode_count[ 0][2],
-			  "MS-I", bitrate_stmode_count[ 0][3],
-			  "LR"  , bitrate_stmode_count[ 1][0],
-			  "LR-I", bitrate_stmode_count[ 1][1],
-			  "MS"  , bitrate_stmode_count[ 1][2],
-			  "MS-I", bitrate_stmode_count[ 1][3],
-			  "LR"  , bitrate_stmode_count[ 2][0],
-			  "LR-I", bitrate_stmode_count[ 2][1],
-			  "MS"  , bitrate_stmode_count[ 2][2],
-			  "MS-I", bitrate_stmode_count[ 2][3],
-			  "LR"  , bitrate_stmode_count[ 3][0],
-			  "LR-I", bitrate_stmode_count[ 3][1],
-			  "MS"  , bitrate_stmode_count[ 3][2],
-			  "MS-I", bitrate_stmode_count[ 3][3],
-			  "LR"  , bitrate_stmode_count[ 4][0],
-			  "LR-I", bitrate_stmode_count[ 4][1],
-			  "MS"  , bitrate_stmode_count[ 4][2],
-			  "MS-I", bitrate_stmode_count[ 4][3],
-			  "LR"  , bitrate_stmode_count[ 5][0],
-			  "LR-I", bitrate_stmode_count[ 5][1],
-			  "MS"  , bitrate_stmode_count[ 5][2],
-			  "MS-I", bitrate_stmode_count[ 5][3],
-			  "LR"  , bitrate_stmode_count[ 6][0],
-			  "LR-I", bitrate_stmode_count[ 6][1],
-			  "MS"  , bitrate_stmode_count[ 6][2],
-			  "MS-I", bitrate_stmode_count[ 6][3],
-			  "LR"  , bitrate_stmode_count[ 7][0],
-			  "LR-I", bitrate_stmode_count[ 7][1],
-			  "MS"  , bitrate_stmode_count[ 7][2],
-			  "MS-I", bitrate_stmode_count[ 7][3],
-			  "LR"  , bitrate_stmode_count[ 8][0],
-			  "LR-I", bitrate_stmode_count[ 8][1],
-			  "MS"  , bitrate_stmode_count[ 8][2],
-			  "MS-I", bitrate_stmode_count[ 8][3],
-			  "LR"  , bitrate_stmode_count[ 9][0],
-			  "LR-I", bitrate_stmode_count[ 9][1],
-			  "MS"  , bitrate_stmode_count[ 9][2],
-			  "MS-I", bitrate_stmode_count[ 9][3],
-			  "LR"  , bitrate_stmode_count[10][0],
-			  "LR-I", bitrate_stmode_count[10][1],
-			  "MS"  , bitrate_stmode_count[10][2],
-			  "MS-I", bitrate_stmode_count[10][3],
-			  "LR"  , bitrate_stmode_count[11][0],
-			  "LR-I", bitrate_stmode_count[11][1],
-			  "MS"  , bitrate_stmode_count[11][2],
-			  "MS-I", bitrate_stmode_count[11][3],
-			  "LR"  , bitrate_stmode_count[12][0],
-			  "LR-I", bitrate_stmode_count[12][1],
-			  "MS"  , bitrate_stmode_count[12][2],
-			  "MS-I", bitrate_stmode_count[12][3],
-			  "LR"  , bitrate_stmode_count[13][0],
-			  "LR-I", bitrate_stmode_count[13][1],
-			  "MS"  , bitrate_stmode_count[13][2],
-			  "MS-I", bitrate_stmode_count[13][3] );
+    offsets = new_array( "L", ix->offsets, ix->len * sizeof(unsigned long) );
+    if ( NULL == offsets )
+        return NULL;
+
+    return Py_BuildValue("{s:N,s:i,s:i,s:i,s:i}",
+                         "offsets", offsets,
+                         "interval_ms", ix->interval_ms,
+                         "samplerate", ix->samplerate,
+                         "samples_per_frame", ix->samples_per_frame,
+                         "encoder_delay", ix->delay);
 }
 
 
-static char mp3enc_get_stereo_mode_histogram__doc__[] =
-"Get dictionary for stereo mode histogram with LR/LR-I/MS/MS-I keys.\n"
-"C function: lame_stereo_mode_hist()\n"
+static char mp3enc_stop_seek_index__doc__[] =
+"Stop recording the seek index and free it.\n"
 ;
 
 static PyObject *
-mp3enc_get_stereo_mode_histogram(Encoder *self, PyObject *args)
+mp3enc_stop_seek_index(Encoder *self, PyObject *args)
 {
-    int stmode_count[4];
+    ENCODER_CHECK_IDLE(self)
 
-    lame_stereo_mode_hist( self->gfp, stmode_count );
+    seek_index_free(self);
+    scanner_free(self);
 
-    return Py_BuildValue( "{sisisisi}",
-			  "LR"  , stmode_count[0],
-			  "LR-I", stmode_count[1],
-			  "MS"  , stmode_count[2],
-			  "MS-I", stmode_count[3] );
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
-
-static char mp3enc_write_tags__doc__[] =
-"Write ID3v1 TAG's.\n"
-"Parameter: file\n"
-"C function: lame_mp3_tags_fid()\n"
+/* END seek index */
+
+
+static char mp3enc_set_silence_trim__doc__[] =
+"Trim silence before it reaches LAME: a run of samples whose peak stays\n"
+"at or below threshold_db (dBFS) and lasts min_silence_ms or longer is\n"
+"cut at the start and at the end of the stream (the flush methods end\n"
+"it), and with compress_gaps also inside it.  keep_ms of silence stay\n"
+"on each side of a cut, so a gap inside the audio shrinks to\n"
+"2 * keep_ms.  Silence is held back until it is known to be cut;\n"
+"without compress_gaps that is a whole gap inside the audio.  None\n"
+"turns trimming off; silence held back then goes to LAME with the next\n"
+"encode or flush call, as it does when trimming is reconfigured.\n"
+"Reconfiguring keeps the sample offsets and the regions cut so far, and\n"
+"trims leading silence only while no audio has reached LAME.\n"
+"get_silence_trim() reports what was cut.  Not available in live mode.\n"
+"Parameters: float (threshold_db) or None, int (min_silence_ms,\n"
+"default 500), int (keep_ms, default 100), int (compress_gaps, default 0)\n"
 ;
 
 static PyObject *
-mp3enc_write_tags(Encoder *self, PyObject *args)
+mp3enc_set_silence_trim(Encoder *self, PyObject *args)
 {
-    PyObject *object;
-    FILE *mp3_file;
+    PyObject     *db;
+    int           min_ms = 500, keep_ms = 100, compress = 0;
+    double        threshold_db, peak;
+    silence_trim *t, *old;
 
-    if ( !PyArg_ParseTuple( args, "O", &object ) )
+    if ( !PyArg_ParseTuple( args, "O|iii", &db, &min_ms, &keep_ms,
+                            &compress ) )
         return NULL;
 
-    if ( 0 == PyFile_Check( object ) )
-	return NULL;
+    ENCODER_CHECK_IDLE(self)
 
-    mp3_file = PyFile_AsFile( object );
+    if ( Py_None == db ) {
+        trim_retire(self);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
 
-    lame_mp3_tags_fid( self->gfp, mp3_file );
+    threshold_db = PyFloat_AsDouble(db);
+    if ( -1.0 == threshold_db && PyErr_Occurred() )
+        return NULL;
+    if ( 0 > keep_ms || min_ms < 2 * keep_ms || 0 >= min_ms ) {
+        PyErr_SetString(PyExc_ValueError,
+            "need 0 <= 2 * keep_ms <= min_silence_ms");
+        return NULL;
+    }
+
+    t = PyMem_Malloc(sizeof(silence_trim));
+    if ( NULL == t )
+        return PyErr_NoMemory();
+    memset(t, 0, sizeof(silence_trim));
+    t->threshold_db = threshold_db;
+    peak = 32768.0 * pow(10.0, threshold_db / 20.0);
+    t->threshold = peak >= 32767.0 ? 32767 : peak < 0.0 ? 0 : (int)peak;
+    t->min_ms = min_ms;
+    t->keep_ms = keep_ms;
+    t->compress = 0 != compress;
+
+    old = self->trim;
+    self->trim = t;
+    if ( self->initialized && 0 > trim_prepare(self) ) {
+        self->trim = old;
+        return NULL;
+    }
+    if ( NULL != old ) {
+        trim_take_over(t, old);
+        self->trim = old;
+        trim_retire(self);
+    } else if ( 0 < self->samples_encoded ) {
+        /* Turned on in the middle of the audio. */
+        t->leading = 0;
+        t->silent = 0;
+    }
+    self->trim = t;
 
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 
-static struct PyMethodDef mp3enc_methods[] = {
-    {"init", (PyCFunction)mp3enc_init,
-        METH_NOARGS, mp3enc_init__doc__},
-    {"encode_interleaved", (PyCFunction)mp3enc_encode_interleaved,
-        METH_VARARGS, mp3enc_encode_interleaved__doc__},
-    {"flush_buffers", (PyCFunction)mp3enc_flush_buffers,
-        METH_NOARGS, mp3enc_flush_buffers__doc__},
-    {"set_num_samples", (PyCFunction)mp3enc_set_num_samples,
-	METH_VARARGS, mp3enc_set_num_samples__doc__                  },
-    {"set_out_samplerate", (PyCFunction)mp3enc_set_out_samplerate,
-	METH_VARARGS, mp3enc_set_out_samplerate__doc__               },
-    {"set_analysis", (PyCFunction)mp3enc_set_analysis,
-	METH_VARARGS, mp3enc_set_analysis__doc__                     },
-    {"set_write_vbr_tag", (PyCFunction)mp3enc_set_write_vbr_tag,
-	METH_VARARGS, mp3enc_set_write_vbr_tag__doc__                },
-    {"set_quality", (PyCFunction)mp3enc_set_quality,
-	METH_VARARGS, mp3enc_set_quality__doc__                       },
-    {"set_free_format", (PyCFunction)mp3enc_set_free_format,
-	METH_VARARGS, mp3enc_set_free_format__doc__                   },
-    {"set_bitrate", (PyCFunction)mp3enc_set_bitrate,
-	METH_VARARGS, mp3enc_set_bitrate__doc__                       },
-    {"set_compression_ratio", (PyCFunction)mp3enc_set_compression_ratio,
-	METH_VARARGS, mp3enc_set_compression_ratio__doc__             },
-    {"set_preset", (PyCFunction)mp3enc_set_preset,
-	METH_VARARGS, mp3enc_set_preset__doc__                        },
-    {"set_asm_optimizations", (PyCFunction)mp3enc_set_asm_optimizations,
-	METH_VARARGS, mp3enc_set_asm_optimizations__doc__             },
-    {"set_error_protection", (PyCFunction)mp3enc_set_error_protection,
-	METH_VARARGS, mp3enc_set_error_protection__doc__              },
-    {"set_extension", (PyCFunction)mp3enc_set_extension,
-	METH_VARARGS, mp3enc_set_extension__doc__                     },
-    {"set_strict_iso", (PyCFunction)mp3enc_set_strict_iso,
-	METH_VARARGS, mp3enc_set_strict_iso__doc__                    },
-    {"set_disable_reservoir", (PyCFunction)mp3enc_set_disable_reservoir,
-	METH_VARARGS, mp3enc_set_disable_reservoir__doc__             },
-    {"set_exp_quantization", (PyCFunction)mp3enc_set_exp_quantization,
-	METH_VARARGS, mp3enc_set_exp_quantization__doc__              },
-    {"set_exp_y", (PyCFunction)mp3enc_set_exp_y,
-	METH_VARARGS, mp3enc_set_exp_y__doc__                         },
-    {"set_exp_z", (PyCFunction)mp3enc_set_exp_z,
-	METH_VARARGS, mp3enc_set_exp_z__doc__                         },
-    {"set_exp_nspsytune", (PyCFunction)mp3enc_set_exp_nspsytune,
-	METH_VARARGS, mp3enc_set_exp_nspsytune__doc__                 },
-    {"set_vbr", (PyCFunction)mp3enc_set_vbr,
-	METH_VARARGS, mp3enc_set_vbr__doc__                           },
-    {"set_vbr_quality", (PyCFunction)mp3enc_set_vbr_quality,
-	METH_VARARGS, mp3enc_set_vbr_quality__doc__                   },
-    {"set_abr_bitrate", (PyCFunction)mp3enc_set_abr_bitrate,
-	METH_VARARGS, mp3enc_set_abr_bitrate__doc__                   },
-    {"set_vbr_min_bitrate", (PyCFunction)mp3enc_set_vbr_min_bitrate,
-	METH_VARARGS, mp3enc_set_vbr_min_bitrate__doc__               },
-    {"set_vbr_max_bitrate", (PyCFunction)mp3enc_set_vbr_max_bitrate,
-	METH_VARARGS, mp3enc_set_vbr_max_bitrate__doc__               },
-    {"set_vbr_min_enforce", (PyCFunction)mp3enc_set_vbr_min_enforce,
-	METH_VARARGS, mp3enc_set_vbr_min_enforce__doc__               },
-    {"set_lowpass_frequency", (PyCFunction)mp3enc_set_lowpass_frequency,
-	METH_VARARGS, mp3enc_set_lowpass_frequency__doc__             },
-    {"set_lowpass_width", (PyCFunction)mp3enc_set_lowpass_width,
-	METH_VARARGS, mp3enc_set_lowpass_width__doc__                 },
-    {"set_highpass_frequency", (PyCFunction)mp3enc_set_highpass_frequency,
-	METH_VARARGS, mp3enc_set_highpass_frequency__doc__            },
-    {"set_highpass_width", (PyCFunction)mp3enc_set_highpass_width,
-	METH_VARARGS, mp3enc_set_highpass_width__doc__                },
-    {"set_ath_for_masking_only", (PyCFunction)mp3enc_set_ath_for_masking_only,
-	METH_VARARGS, mp3enc_set_ath_for_masking_only__doc__          },
-    {"set_ath_for_short_only", (PyCFunction)mp3enc_set_ath_for_short_only,
-	METH_VARARGS, mp3enc_set_ath_for_short_only__doc__            },
-    {"set_ath_disable", (PyCFunction)mp3enc_set_ath_disable,
-	METH_VARARGS, mp3enc_set_ath_disable__doc__                   },
-    {"set_ath_type", (PyCFunction)mp3enc_set_ath_type,
-	METH_VARARGS, mp3enc_set_ath_type__doc__                      },
-    {"set_ath_lower", (PyCFunction)mp3enc_set_ath_lower,
-	METH_VARARGS, mp3enc_set_ath_lower__doc__                     },
-    {"set_athaa_type", (PyCFunction)mp3enc_set_athaa_type,
-	METH_VARARGS, mp3enc_set_athaa_type__doc__                    },
-    {"set_athaa_sensitivity", (PyCFunction)mp3enc_set_athaa_sensitivity,
-	METH_VARARGS, mp3enc_set_athaa_sensitivity__doc__             },
-    {"set_allow_blocktype_difference", (PyCFunction)mp3enc_set_allow_blocktype_difference,
-	METH_VARARGS, mp3enc_set_allow_blocktype_difference__doc__    },
-    {"set_use_temporal_masking", (PyCFunction)mp3enc_set_use_temporal_masking,
-	METH_VARARGS, mp3enc_set_use_temporal_masking__doc__          },
-    {"set_inter_channel_ratio", (PyCFunction)mp3enc_set_inter_channel_ratio,
-	METH_VARARGS, mp3enc_set_inter_channel_ratio__doc__           },
-    {"set_no_short_blocks", (PyCFunction)mp3enc_set_no_short_blocks,
-	METH_VARARGS, mp3enc_set_no_short_blocks__doc__               },
-    {"set_force_short_blocks", (PyCFunction)mp3enc_set_force_short_blocks,
-	METH_VARARGS, mp3enc_set_force_short_blocks__doc__            },
-    {"get_bitrate_histogram", (PyCFunction)mp3enc_get_bitrate_histogram,
-        METH_NOARGS, mp3enc_get_bitrate_histogram__doc__},
-    {"get_bitrate_values", (PyCFunction)mp3enc_get_bitrate_values,
-        METH_NOARGS, mp3enc_get_bitrate_values__doc__},
-    {"get_bitrate_stereo_mode_histogram", (PyCFunction)mp3enc_get_bitrate_stereo_mode_histogram,
-        METH_NOARGS, mp3enc_get_bitrate_stereo_mode_histogram__doc__ },
-    {"get_stereo_mode_histogram", (PyCFunction)mp3enc_get_stereo_mode_histogram,
-        METH_NOARGS, mp3enc_get_stereo_mode_histogram__doc__},
-    {"write_tags", (PyCFunction)mp3enc_write_tags,
-	METH_VARARGS, mp3enc_write_tags__doc__                        },
-    {NULL, NULL, 0, NULL}  /* Sentinel */
-};
-
-/* "Generic" setters for int and float values of the lame encoder that
-take care of the argument verification needed when dealing with
-attributes. */
+static char mp3enc_get_silence_trim__doc__[] =
+"Get a dictionary of what the silence trimming cut so far: regions (a\n"
+"list of (start, end) sample offsets into the input), removed (samples\n"
+"cut) and samples (samples seen), or None when trimming is off.\n"
+"Samples held back at the time of the call are in neither list.\n"
+;
 
-static int
-generic_set_int(Encoder *self, PyObject *value, const char *attr,
-                int (fptr)(lame_global_flags*, int))
+static PyObject *
+mp3enc_get_silence_trim(Encoder *self, PyObject *args)
 {
-    if (value == NULL) {
-        PyErr_Format(PyExc_AttributeError, "Cannot delete the '%s' attribute.",
-                     attr);
-        return -1;
-    }
+    silence_trim *t = self->trim;
+    PyObject     *regions, *item;
+    size_t        i;
 
-    if (!PyInt_Check(value)) {
-        PyErr_Format(PyExc_TypeError, "Attribute '%s' must be an integer.", attr);
-        return -1;
+    if ( NULL == t ) {
+        Py_INCREF(Py_None);
+        return Py_None;
     }
 
-    if (0 != (fptr)(self->gfp, PyInt_AS_LONG(value))) {
-        PyErr_Format(PyExc_ValueError, "Set '%s' failed (out of range?).", attr);
-        return -1;
+    if ( t->failed )
+        return PyErr_NoMemory();
+
+    regions = PyList_New(t->regions_len);
+    if ( NULL == regions )
+        return NULL;
+    for (i = 0; i < t->regions_len; i++) {
+        item = Py_BuildValue("(KK)", t->regions[2 * i],
+                             t->regions[2 * i + 1]);
+        if ( NULL == item ) {
+            Py_DECREF(regions);
+            return NULL;
+        }
+        PyList_SET_ITEM(regions, i, item);
     }
 
-    return 0;
+    return Py_BuildValue("{s:N,s:K,s:K}",
+                         "regions", regions,
+                         "removed", t->removed,
+                         "samples", t->pos);
 }
 
-static int
-generic_set_float(Encoder *self, PyObject *value, const char *attr,
-                  int (fptr)(lame_global_flags*, float))
-{
-    if (value == NULL) {
-        PyErr_Format(PyExc_AttributeError, "Cannot delete the '%s' attribute.",
-                     attr);
-        return -1;
-    }
 
-    if (!PyFloat_Check(value)) {
-        PyErr_Format(PyExc_TypeError, "Attribute '%s' must be a float.", attr);
-        return -1;
-    }
+static char mp3enc_live_stats__doc__[] =
+"Get a dictionary with the live mode fill levels and overrun counters:\n"
+"input_fill/input_size and output_fill/output_size (bytes), latency_ms\n"
+"(queued input in milliseconds), overruns (bytes dropped by push()) and\n"
+"overrun_events (push() calls that dropped data).\n"
+;
 
-    if (0 != (fptr)(self->gfp, PyFloat_AS_DOUBLE(value))) {
-        PyErr_Format(PyExc_ValueError, "Set '%s' failed (out of range?).", attr);
-        return -1;
+static PyObject *
+mp3enc_live_stats(Encoder *self, PyObject *args)
+{
+    size_t input_fill;
+
+    if ( !self->live_running ) {
+        PyErr_SetString(ENCODER_ERROR(self), "live mode not started");
+        return NULL;
     }
 
-    return 0;
+    /* The thread owns gfp: use the values taken by start_live(). */
+    input_fill = ring_used(&self->live_in);
+
+    return Py_BuildValue("{snsnsnsnsdsKsK}",
+                         "input_fill", (Py_ssize_t)input_fill,
+                         "input_size", (Py_ssize_t)self->live_in.size,
+                         "output_fill", (Py_ssize_t)ring_used(&self->live_out),
+                         "output_size", (Py_ssize_t)self->live_out.size,
+                         "latency_ms",
+                         1000.0 * input_fill / self->live_frame_bytes
+                                  / self->live_samplerate,
+                         "overruns", self->live_overruns,
+                         "overrun_events", self->live_overrun_events);
 }
 
 
-/* Macros to ease creation of attribute getter/setter wrapper
- * functions.  I Know this is a bit much, but you can use "gcc -E" to
- * see what it generates, and it would be truly tedious without.
- *
- * This cleverness throws warnings when the set type is an enum, so we
- * still write some of these out long-hand.
- */
-#define GETATTR(attrname, format) \
-    static PyObject *\
-    mp3enc_get_##attrname(Encoder *self, void *closure) { \
-        return Py_BuildValue(#format, lame_get_##attrname(self->gfp)); \
+static char mp3enc_stop_live__doc__[] =
+"Stop live mode: the encoder thread is joined, the audio still queued is\n"
+"encoded and all MP3 data not yet pulled is returned.  Call\n"
+"flush_buffers() afterwards to end the stream.\n"
+;
+
+static PyObject *
+mp3enc_stop_live(Encoder *self, PyObject *args)
+{
+    PyObject *result;
+    size_t    out_len, in_len, offset;
+    int       rc;
+
+    if ( !self->live_running ) {
+        PyErr_SetString(ENCODER_ERROR(self), "live mode not started");
+        return NULL;
     }
 
-#define SETATTR_INT(attrname, lamefunc) \
-    static int \
-    mp3enc_set_##attrname(Encoder *self, PyObject *value, void *closure) { \
-        return generic_set_int(self, value, #attrname, lamefunc); \
+    live_join(self);
+
+    rc = self->live_error;
+    if ( 0 > rc || 0 > encoder_grow_buf( self, self->live_chunk ) ) {
+        live_release(self);
+        return 0 > rc ? encoder_set_error( self, rc ) : NULL;
     }
 
-#define SETATTR_FLOAT(attrname, lamefunc) \
-    static int \
-    mp3enc_set_##attrname(Encoder *self, PyObject *value, void *closure) { \
-        return generic_set_float(self, value, #attrname, lamefunc); \
+    /* Queued output, the part the thread could not hand over, and the
+     * encoded rest of the input. */
+    out_len = ring_used(&self->live_out);
+    result = PyString_FromStringAndSize(NULL, out_len + self->live_mp3_len);
+    if ( NULL == result ) {
+        live_release(self);
+        return NULL;
+    }
+    offset = ring_read(&self->live_out,
+                       (unsigned char *)PyString_AS_STRING(result), out_len);
+    memcpy(PyString_AS_STRING(result) + offset,
+           self->live_mp3 + self->live_mp3_off, self->live_mp3_len);
+
+    /* The input ring might wrap, so encode it from a linear copy.  A
+     * partial sample from push() goes last. */
+    rc = 0;
+    while ( 0 <= rc && (0 < ring_used(&self->live_in)
+                        || 0 < self->live_carry_len) ) {
+        if ( 0 < ring_used(&self->live_in) )
+            in_len = ring_read(&self->live_in, self->live_pcm,
+                               self->live_chunk);
+        else {
+            in_len = self->live_carry_len;
+            memcpy(self->live_pcm, self->live_carry, in_len);
+            self->live_carry_len = 0;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        rc = encoder_encode( self, (int16_t *)self->live_pcm, (int)in_len );
+        Py_END_ALLOW_THREADS
+        if ( 0 < rc ) {
+            offset = PyString_GET_SIZE(result);
+            if ( 0 > _PyString_Resize( &result, offset + rc ) )
+                break;
+            memcpy( PyString_AS_STRING(result) + offset, self->mp3_buf, rc );
+        }
+    }
+
+    live_release(self);
+    encoder_lean_release(self);
+
+    if ( 0 > rc ) {
+        Py_XDECREF(result);
+        return encoder_set_error( self, rc );
+    }
+
+    return result;
+}
+
+/* END live mode */
+
+
+static char mp3enc_set_num_samples__doc__[] =
+"Set the number of samples.\n"
+"Default: 2^32-1\n"
+"Parameter: int\n"
+"C function: lame_set_num_samples()\n"
+;
+
+static PyObject *
+mp3enc_set_num_samples(Encoder *self, PyObject *arg)
+{
+    unsigned long num_samples;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_ulong_arg( arg, &num_samples ) )
+        return NULL;
+
+    if ( 0 > lame_set_num_samples( self->gfp, num_samples ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set number of samples" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static char mp3enc_set_out_samplerate__doc__[] =
+"Set output samplerate (in Hz).\n"
+"Default: 0 (let LAME choose one)\n"
+"Parameter: int\n"
+"C function: lame_set_out_samplerate()\n"
+;
+
+static PyObject *
+mp3enc_set_out_samplerate(Encoder *self, PyObject *arg)
+{
+    int out_samplerate;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &out_samplerate ) )
+        return NULL;
+
+    if ( 0 > lame_set_out_samplerate( self->gfp, out_samplerate ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set output samplerate" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_analysis__doc__[] =
+"Collect data for an MP3 frame analyzer.\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_analysis\n"
+;
+
+static PyObject *
+mp3enc_set_analysis(Encoder *self, PyObject *arg)
+{
+    int analysis;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &analysis ) )
+        return NULL;
+
+    if ( 0 > lame_set_analysis( self->gfp, analysis ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set analysis mode" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_write_vbr_tag__doc__[] =
+"Write a Xing VBR header frame.\n"
+"Default: 1\n"
+"Paramter: int\n"
+"C function: lame_set_bWriteVbrTag()\n"
+;
+
+static PyObject *
+mp3enc_set_write_vbr_tag(Encoder *self, PyObject *arg)
+{
+    int write_vbr_tag;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &write_vbr_tag ) )
+        return NULL;
+
+    if ( 0 > lame_set_bWriteVbrTag( self->gfp, write_vbr_tag ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set write_vbr_tag" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_quality__doc__[] =
+"Choose quality.\n"
+"Range: 0 (best) - 9 (worst)\n"
+"Parameter: int\n"
+"C function: lame_set_quality()\n"
+;
+
+static PyObject *
+mp3enc_set_quality(Encoder *self, PyObject *arg)
+{
+    int quality;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &quality ) )
+        return NULL;
+
+    if ( 0 > lame_set_quality( self->gfp, quality ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set quality" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_free_format__doc__[] =
+"Use free format.\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_free_format()\n"
+;
+
+static PyObject *
+mp3enc_set_free_format(Encoder *self, PyObject *arg)
+{
+    int free_format;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &free_format ) )
+        return NULL;
+
+    if ( 0 > lame_set_free_format( self->gfp, free_format ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set to free format" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_bitrate__doc__[] =
+"Set bitrate.\n"
+"Default: 128\n"
+"Paramter: int\n"
+"C function: lame_set_brate()\n"
+;
+
+static PyObject *
+mp3enc_set_bitrate(Encoder *self, PyObject *arg)
+{
+    int brate;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &brate ) )
+        return NULL;
+
+    if ( 0 > lame_set_brate( self->gfp, brate ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set bitrate" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_compression_ratio__doc__[] =
+"Set compression ratio.\n"
+"Default: 11.0\n"
+"Paramter: float\n"
+"C function: lame_set_compression_ratio()\n"
+;
+
+static PyObject *
+mp3enc_set_compression_ratio(Encoder *self, PyObject *arg)
+{
+    float compression_ratio;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_float_arg( arg, &compression_ratio ) )
+        return NULL;
+
+    if ( 0 > lame_set_compression_ratio( self->gfp, compression_ratio ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set compression ratio" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_preset__doc__[] =
+"Set a built-in preset.  Paramter: int (bitrate) or any of the\n"
+"lame.PRESET_* contstants.\n"
+"C function: lame_set_preset()\n"
+;
+
+static PyObject *
+mp3enc_set_preset(Encoder *self, PyObject *arg)
+{
+    int preset;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &preset ) )
+        return NULL;
+
+    if ( 0 > lame_set_preset( self->gfp, preset ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set preset" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_asm_optimizations__doc__[] =
+"Disable specific asm optimizations (if compiled in).\n"
+"Paramters: lame.ASM_MMX, lame.ASM_3DNOW, lame.ASM_SSE;\n"
+"           int (0 = disable)\n"
+"C function: lame_set_asm_optimizations()\n"
+;
+
+static PyObject *
+mp3enc_set_asm_optimizations(Encoder *self, PyObject *args)
+{
+    int val1, val2;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( !PyArg_ParseTuple( args, "ii", &val1, &val2 ) )
+        return NULL;
+
+    if ( 0 > lame_set_asm_optimizations( self->gfp, val1, val2 ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set asm optimizations" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_error_protection__doc__[] =
+"Add error protection (uses 2 bytes from each frame for CRC).\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_error_protection()\n"
+;
+
+static PyObject *
+mp3enc_set_error_protection(Encoder *self, PyObject *arg)
+{
+    int error_protection;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &error_protection ) )
+        return NULL;
+
+    if ( 0 > lame_set_error_protection( self->gfp, error_protection ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set error protection" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_extension__doc__[] =
+"Set extension bit (meaningless).\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_extension()\n"
+;
+
+static PyObject *
+mp3enc_set_extension(Encoder *self, PyObject *arg)
+{
+    int extension;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &extension ) )
+        return NULL;
+
+    if ( 0 > lame_set_extension( self->gfp, extension ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set extension bit" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_strict_iso__doc__[] =
+"Enforce strict ISO compliance.\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_strict_ISO()\n"
+;
+
+static PyObject *
+mp3enc_set_strict_iso(Encoder *self, PyObject *arg)
+{
+    int strict_iso;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &strict_iso ) )
+        return NULL;
+
+    if ( 0 > lame_set_strict_ISO( self->gfp, strict_iso ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set strict ISO compliance" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_disable_reservoir__doc__[] =
+"Disable the bit reservoir (purpose: for testing only).\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_disable_reservoir()\n"
+;
+
+static PyObject *
+mp3enc_set_disable_reservoir(Encoder *self, PyObject *arg)
+{
+    int disable_reservoir;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &disable_reservoir ) )
+        return NULL;
+
+    if ( 0 > lame_set_disable_reservoir( self->gfp, disable_reservoir ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set disable_reservoir" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_exp_quantization__doc__[] =
+"Select a different 'best quantization' function (experimental!).\n"
+"Default: 0\n"
+"Parameter: int\n"
+"C function: lame_set_experimentalX()\n"
+;
+
+static PyObject *
+mp3enc_set_exp_quantization(Encoder *self, PyObject *arg)
+{
+    int quantization;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &quantization ) )
+        return NULL;
+
+    if ( 0 > lame_set_experimentalX( self->gfp, quantization ) ) {
+        PyErr_SetString( (PyObject *)self, "can't choose quantization function" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_exp_y__doc__[] =
+"Experimental option.\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_experimentalY()\n"
+;
+
+static PyObject *
+mp3enc_set_exp_y(Encoder *self, PyObject *arg)
+{
+    int y;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &y ) )
+        return NULL;
+
+    if ( 0 > lame_set_experimentalY( self->gfp, y ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set exp_y" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_exp_z__doc__[] =
+"Experimantal option.\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_experimentalZ()\n"
+;
+
+static PyObject *
+mp3enc_set_exp_z(Encoder *self, PyObject *arg)
+{
+    int z;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &z ) )
+        return NULL;
+
+    if ( 0 > lame_set_experimentalZ( self->gfp, z ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set exp_z" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_exp_nspsytune__doc__[] =
+"Use Naoki's psycho acoustic model instead of GPSYCHO (experimental!).\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_exp_nspsytune()\n"
+;
+
+static PyObject *
+mp3enc_set_exp_nspsytune(Encoder *self, PyObject *arg)
+{
+    int nspsytune;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &nspsytune ) )
+        return NULL;
+
+    if ( 0 > lame_set_exp_nspsytune( self->gfp, nspsytune ) ) {
+        PyErr_SetString( (PyObject *)self, "can't use nspsytune" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_vbr__doc__[] =
+"Set VBR mode.\n"
+"Default: lame.VBR_OFF (disabled)\n"
+"Parameter: lame.VBR_OFF, lame.VBR_OLD, lame.VBR_ABR, lame.VBR_NEW,\n"
+"           lame.VBR_DEFAULT\n"
+"C function: lame_set_VBR()\n"
+;
+
+static PyObject *
+mp3enc_set_vbr(Encoder *self, PyObject *arg)
+{
+    int vbr;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &vbr ) )
+        return NULL;
+
+    if ( 0 > lame_set_VBR( self->gfp, vbr ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set VBR mode" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_vbr_quality__doc__[] =
+"Set VBR quality level.\n"
+"Default: 4\n"
+"Parameter: 0 (highest) - 9 (lowest)\n"
+"C function: lame_set_VBR_q()\n"
+;
+
+static PyObject *
+mp3enc_set_vbr_quality(Encoder *self, PyObject *arg)
+{
+    int vbr_quality;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &vbr_quality ) )
+        return NULL;
+
+    if ( 0 > lame_set_VBR_q( self->gfp, vbr_quality ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set VBR quality level" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_abr_bitrate__doc__[] =
+"Set ABR bitrate.\n"
+"Default: 128\n"
+"Parameter: int\n"
+"C function: lame_set_VBR_mean_bitrate_kbps()\n"
+;
+
+static PyObject *
+mp3enc_set_abr_bitrate(Encoder *self, PyObject *arg)
+{
+    int abr_bitrate;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &abr_bitrate ) )
+        return NULL;
+
+    if ( 0 > lame_set_VBR_mean_bitrate_kbps( self->gfp, abr_bitrate ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set ABR bitrate" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_vbr_min_bitrate__doc__[] =
+"Set minimal bitrate for ABR/VBR.\n"
+"Default: lowest possible bitrate\n"
+"Parameter: int\n"
+"C function: lame_set_VBR_min_bitrate_kbps()\n"
+;
+
+static PyObject *
+mp3enc_set_vbr_min_bitrate(Encoder *self, PyObject *arg)
+{
+    int vbr_min_bitrate;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &vbr_min_bitrate ) )
+        return NULL;
+
+    if ( 0 > lame_set_VBR_min_bitrate_kbps( self->gfp, vbr_min_bitrate ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set minimum bitrate" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_vbr_max_bitrate__doc__[] =
+"Set maximal bitrate for ABR/VBR.\n"
+"Default: highest possible bitrate\n"
+"Parameter: int\n"
+"C function: lame_set_VBR_max_bitrate_kbps()\n"
+;
+
+static PyObject *
+mp3enc_set_vbr_max_bitrate(Encoder *self, PyObject *arg)
+{
+    int vbr_max_bitrate;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &vbr_max_bitrate ) )
+        return NULL;
+
+    if ( 0 > lame_set_VBR_max_bitrate_kbps( self->gfp, vbr_max_bitrate ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set maximal bitrate" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_vbr_min_enforce__doc__[] =
+"Enforce minimum bitrate for ABR/VBR, normally it will be violated for\n"
+"analog silence.\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_VBR_hard_min()\n"
+;
+
+static PyObject *
+mp3enc_set_vbr_min_enforce(Encoder *self, PyObject *arg)
+{
+    int vbr_min_enforce;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &vbr_min_enforce ) )
+        return NULL;
+
+    if ( 0 > lame_set_VBR_hard_min( self->gfp, vbr_min_enforce ) ) {
+        PyErr_SetString( (PyObject *)self, "can't enforce minimal bitrate" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_lowpass_frequency__doc__[] =
+"Lowpass frequency in Hz (-1: disabled).\n"
+"Default: 0 (LAME chooses)\n"
+"Parameter: int\n"
+"C function: lame_set_lowpassfreq()\n"
+;
+
+static PyObject *
+mp3enc_set_lowpass_frequency(Encoder *self, PyObject *arg)
+{
+    int lowpass_frequency;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &lowpass_frequency ) )
+        return NULL;
+
+    if ( 0 > lame_set_lowpassfreq( self->gfp, lowpass_frequency ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set lowpass frequency" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_lowpass_width__doc__[] =
+"Width of transition band in Hz.\n"
+"Default: one polyphase filter band\n"
+"Parameter: int\n"
+"C function: lame_set_lowpasswidth()\n"
+;
+
+static PyObject *
+mp3enc_set_lowpass_width(Encoder *self, PyObject *arg)
+{
+    int lowpass_width;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &lowpass_width ) )
+        return NULL;
+
+    if ( 0 > lame_set_lowpasswidth( self->gfp, lowpass_width ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set width of lowpass" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_highpass_frequency__doc__[] =
+"Highpass frequency in Hz (-1: disabled).\n"
+"Default: 0 (LAME chooses)\n"
+"Parameter: int\n"
+"C function: lame_set_highpassfreq()\n"
+;
+
+static PyObject *
+mp3enc_set_highpass_frequency(Encoder *self, PyObject *arg)
+{
+    int highpass_frequency;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &highpass_frequency ) )
+        return NULL;
+
+    if ( 0 > lame_set_highpassfreq( self->gfp, highpass_frequency ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set highpass frequency" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_highpass_width__doc__[] =
+"Set width of highpass in Hz.\n"
+"Default: one polyphase filter band\n"
+"Parameter: int\n"
+"C function: lame_set_highpasswidth()\n"
+;
+
+static PyObject *
+mp3enc_set_highpass_width(Encoder *self, PyObject *arg)
+{
+    int highpass_width;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &highpass_width ) )
+        return NULL;
+
+    if ( 0 > lame_set_highpasswidth( self->gfp, highpass_width ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set highpass width" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_ath_for_masking_only__doc__[] =
+"Only use ATH for masking.\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_ATHonly()\n"
+;
+
+static PyObject *
+mp3enc_set_ath_for_masking_only(Encoder *self, PyObject *arg)
+{
+    int ath_for_masking_only;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &ath_for_masking_only ) )
+        return NULL;
+
+    if ( 0 > lame_set_ATHonly( self->gfp, ath_for_masking_only ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set ath_for_masking_only" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_ath_for_short_only__doc__[] =
+"Only use ATH for short blocks.\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_ATHshort()\n"
+;
+
+static PyObject *
+mp3enc_set_ath_for_short_only(Encoder *self, PyObject *arg)
+{
+    int ath_for_short_only;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &ath_for_short_only ) )
+        return NULL;
+
+    if ( 0 > lame_set_ATHshort( self->gfp, ath_for_short_only ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set ath_for_short_only" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_ath_disable__doc__[] =
+"Disable ATH.\n"
+"Default: 0 (use ATH)\n"
+"Parameter: int\n"
+"C function: lame_set_noATH()\n"
+;
+
+static PyObject *
+mp3enc_set_ath_disable(Encoder *self, PyObject *arg)
+{
+    int ath_disable;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &ath_disable ) )
+        return NULL;
+
+    if ( 0 > lame_set_noATH( self->gfp, ath_disable ) ) {
+        PyErr_SetString( (PyObject *)self, "can't disable ATH" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_ath_type__doc__[] =
+"Select type of ATH.\n"
+"Default: XXX\n"
+"Parameter: int  XXX should be lame.YYY\n"
+"C function: lame_set_ATHtype()\n"
+;
+
+static PyObject *
+mp3enc_set_ath_type(Encoder *self, PyObject *arg)
+{
+    int ath_type;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &ath_type ) )
+        return NULL;
+
+    if ( 0 > lame_set_ATHtype( self->gfp, ath_type ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set ATH type" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_ath_lower__doc__[] =
+"Lower ATH by this many dB.\n"
+"Default: 0\n"
+"Parameter: int\n"
+"C function: lame_set_ATHlower()\n"
+;
+
+static PyObject *
+mp3enc_set_ath_lower(Encoder *self, PyObject *arg)
+{
+    int ath_lower;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &ath_lower ) )
+        return NULL;
+
+    if ( 0 > lame_set_ATHlower( self->gfp, ath_lower ) ) {
+        PyErr_SetString( (PyObject *)self, "can't lower ATH" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_athaa_type__doc__[] =
+"Select type of ATH adaptive adjustment.\n"
+"Default: XXX\n"
+"Parameter: int  XXX should be lame.YYY\n"
+"C function: lame_set_athaa_type()\n"
+;
+
+static PyObject *
+mp3enc_set_athaa_type(Encoder *self, PyObject *arg)
+{
+    int athaa_type;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &athaa_type ) )
+        return NULL;
+
+    if ( 0 > lame_set_athaa_type( self->gfp, athaa_type ) ) {
+        PyErr_SetString( (PyObject *)self, "can't select type of ATH adaptive adjustment" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_athaa_sensitivity__doc__[] =
+"Adjust the point below which adaptive ATH level adjustment occurs (in dB).\n"
+"Default: 0\n"
+"Parameter: int\n"
+"C function: lame_set_athaa_sensitivity()\n"
+;
+
+static PyObject *
+mp3enc_set_athaa_sensitivity(Encoder *self, PyObject *arg)
+{
+    int athaa_sensitivity;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &athaa_sensitivity ) )
+        return NULL;
+
+    if ( 0 > lame_set_athaa_sensitivity( self->gfp, athaa_sensitivity ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set ATHaa sensitivity" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_allow_blocktype_difference__doc__[] =
+"Allow blocktypes to differ between channels.\n"
+"Default: 0 (disabled) for JOINT_STEREO, 1 (enabled) for STEREO\n"
+"Parameter: int\n"
+"C function: lame_set_allow_diff_short()\n"
+;
+
+static PyObject *
+mp3enc_set_allow_blocktype_difference(Encoder *self, PyObject *arg)
+{
+    int allow_blocktype_difference;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &allow_blocktype_difference ) )
+        return NULL;
+
+    if ( 0 > lame_set_allow_diff_short( self->gfp, allow_blocktype_difference ) ) {
+        PyErr_SetString( (PyObject *)self, "can't set allow_blocktype_difference" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_use_temporal_masking__doc__[] =
+"Use temporal masking.\n"
+"Default: 1 (enabled)\n"
+"Parameter: int\n"
+"C function: lame_set_useTemporal()\n"
+;
+
+static PyObject *
+mp3enc_set_use_temporal_masking(Encoder *self, PyObject *arg)
+{
+    int use_temporal_masking;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &use_temporal_masking ) )
+        return NULL;
+
+    if ( 0 > lame_set_useTemporal( self->gfp, use_temporal_masking ) ) {
+        PyErr_SetString( (PyObject *)self, "can't change temporal masking" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_inter_channel_ratio__doc__[] =
+"Set inter channel ratio.\n"
+"Default: XXX\n"
+"Parameter: float\n"
+"C function: lame_set_interChRatio()\n"
+;
+
+static PyObject *
+mp3enc_set_inter_channel_ratio(Encoder *self, PyObject *arg)
+{
+    float inter_channel_ratio;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_float_arg( arg, &inter_channel_ratio ) )
+        return NULL;
+
+    if ( 0 > lame_set_interChRatio( self->gfp, inter_channel_ratio ) ) {
+        PyErr_SetString( (PyObject *)self, "can't change inter channel ratio" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_no_short_blocks__doc__[] =
+"Disable the use of short blocks.\n"
+"Default: 0 (use short blocks)\n"
+"Parameter: int\n"
+"C function: lame_set_no_short_blocks()\n"
+;
+
+static PyObject *
+mp3enc_set_no_short_blocks(Encoder *self, PyObject *arg)
+{
+    int no_short_blocks;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &no_short_blocks ) )
+        return NULL;
+
+    if ( 0 > lame_set_no_short_blocks( self->gfp, no_short_blocks ) ) {
+        PyErr_SetString( (PyObject *)self, "can't change the use of short blocks" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_force_short_blocks__doc__[] =
+"Force the use of short blocks.\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_force_short_blocks()\n"
+;
+
+static PyObject *
+mp3enc_set_force_short_blocks(Encoder *self, PyObject *arg)
+{
+    int force_short_blocks;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &force_short_blocks ) )
+        return NULL;
+
+    if ( 0 > lame_set_force_short_blocks( self->gfp, force_short_blocks ) ) {
+        PyErr_SetString( (PyObject *)self, "can't force short blocks" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_find_replay_gain__doc__[] =
+"Do ReplayGain analysis while encoding; read the result from the\n"
+"radio_gain and audiophile_gain attributes after flush_buffers().\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_findReplayGain()\n"
+;
+
+static PyObject *
+mp3enc_set_find_replay_gain(Encoder *self, PyObject *arg)
+{
+    int find_replay_gain;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &find_replay_gain ) )
+        return NULL;
+
+    if ( 0 > lame_set_findReplayGain( self->gfp, find_replay_gain ) ) {
+        PyErr_SetString( ENCODER_ERROR(self), "can't set ReplayGain analysis" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_set_decode_on_the_fly__doc__[] =
+"Decode the output while encoding to find the peak sample (see the\n"
+"peak_sample attribute); needs LAME built with its decoder.\n"
+"Default: 0 (disabled)\n"
+"Parameter: int\n"
+"C function: lame_set_decode_on_the_fly()\n"
+;
+
+static PyObject *
+mp3enc_set_decode_on_the_fly(Encoder *self, PyObject *arg)
+{
+    int decode_on_the_fly;
+
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 > parse_int_arg( arg, &decode_on_the_fly ) )
+        return NULL;
+
+    if ( 0 > lame_set_decode_on_the_fly( self->gfp, decode_on_the_fly ) ) {
+        PyErr_SetString( ENCODER_ERROR(self), "can't set decoding on the fly" );
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+static char mp3enc_get_bitrate_histogram__doc__[] =
+"Get tuple of histogram dictionaries with bitrate/value keys.\n"
+"C functions: lame_bitrate_kbps(), lame_bitrate_hist()\n"
+;
+
+static PyObject *
+mp3enc_get_bitrate_histogram(Encoder *self, PyObject *args)
+{
+    int bitrate_count[14];
+    int bitrate_value[14];
+
+    ENCODER_CHECK_IDLE(self)
+
+    lame_bitrate_kbps(self->gfp, bitrate_value);
+    lame_bitrate_hist(self->gfp, bitrate_count);
+
+    return Py_BuildValue("({sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi}{sisi})",
+                         "bitrate", bitrate_value[ 0],
+                         "value"  , bitrate_count[ 0],
+                         "bitrate", bitrate_value[ 1],
+                         "value"  , bitrate_count[ 1],
+                         "bitrate", bitrate_value[ 2],
+                         "value"  , bitrate_count[ 2],
+                         "bitrate", bitrate_value[ 3],
+                         "value"  , bitrate_count[ 3],
+                         "bitrate", bitrate_value[ 4],
+                         "value"  , bitrate_count[ 4],
+                         "bitrate", bitrate_value[ 5],
+                         "value"  , bitrate_count[ 5],
+                         "bitrate", bitrate_value[ 6],
+                         "value"  , bitrate_count[ 6],
+                         "bitrate", bitrate_value[ 7],
+                         "value"  , bitrate_count[ 7],
+                         "bitrate", bitrate_value[ 8],
+                         "value"  , bitrate_count[ 8],
+                         "bitrate", bitrate_value[ 9],
+                         "value"  , bitrate_count[ 9],
+                         "bitrate", bitrate_value[10],
+                         "value"  , bitrate_count[10],
+                         "bitrate", bitrate_value[11],
+                         "value"  , bitrate_count[11],
+                         "bitrate", bitrate_value[12],
+                         "value"  , bitrate_count[12],
+                         "bitrate", bitrate_value[13],
+                         "value"  , bitrate_count[13]);
+}
+
+
+static char mp3enc_get_bitrate_values__doc__[] =
+"Get tuple of possible bitrates.\n"
+"C function: lame_bitrate_kbps()\n"
+;
+
+static PyObject *
+mp3enc_get_bitrate_values(Encoder *self, PyObject *args)
+{
+    int bitrate_count[14];
+
+    ENCODER_CHECK_IDLE(self)
+
+    lame_bitrate_kbps( self->gfp, bitrate_count );
+
+    return Py_BuildValue( "(iiiiiiiiiiiiii)",
+			  bitrate_count[ 0],
+			  bitrate_count[ 1],
+			  bitrate_count[ 2],
+			  bitrate_count[ 3],
+			  bitrate_count[ 4],
+			  bitrate_count[ 5],
+			  bitrate_count[ 6],
+			  bitrate_count[ 7],
+			  bitrate_count[ 8],
+			  bitrate_count[ 9],
+			  bitrate_count[10],
+			  bitrate_count[11],
+			  bitrate_count[12],
+			  bitrate_count[13] );
+}
+
+
+static char mp3enc_get_bitrate_stereo_mode_histogram__doc__[] =
+"Get tuple of dictionaries for stereo mode histogram with LR/LR-I/MS/MS-I keys.\n"
+"C function: lame_bitrate_stereo_mode_hist()\n"
+;
+
+static PyObject *
+mp3enc_get_bitrate_stereo_mode_histogram(Encoder *self, PyObject *args)
+{
+    int bitrate_stmode_count[14][4];
+
+    ENCODER_CHECK_IDLE(self)
+
+    lame_bitrate_stereo_mode_hist( self->gfp, bitrate_stmode_count );
+
+    return Py_BuildValue( "({sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi}{sisisisi})",
+			  "LR"  , bitrate_stmode_count[ 0][0],
+			  "LR-I", bitrate_stmode_count[ 0][1],
+			  "MS"  , bitrate_stmode_count[ 0][2],
+			  "MS-I", bitrate_stmode_count[ 0][3],
+			  "LR"  , bitrate_stmode_count[ 1][0],
+			  "LR-I", bitrate_stmode_count[ 1][1],
+			  "MS"  , bitrate_stmode_count[ 1][2],
+			  "MS-I", bitrate_stmode_count[ 1][3],
+			  "LR"  , bitrate_stmode_count[ 2][0],
+			  "LR-I", bitrate_stmode_count[ 2][1],
+			  "MS"  , bitrate_stmode_count[ 2][2],
+			  "MS-I", bitrate_stmode_count[ 2][3],
+			  "LR"  , bitrate_stmode_count[ 3][0],
+			  "LR-I", bitrate_stmode_count[ 3][1],
+			  "MS"  , bitrate_stmode_count[ 3][2],
+			  "MS-I", bitrate_stmode_count[ 3][3],
+			  "LR"  , bitrate_stmode_count[ 4][0],
+			  "LR-I", bitrate_stmode_count[ 4][1],
+			  "MS"  , bitrate_stmode_count[ 4][2],
+			  "MS-I", bitrate_stmode_count[ 4][3],
+			  "LR"  , bitrate_stmode_count[ 5][0],
+			  "LR-I", bitrate_stmode_count[ 5][1],
+			  "MS"  , bitrate_stmode_count[ 5][2],
+			  "MS-I", bitrate_stmode_count[ 5][3],
+			  "LR"  , bitrate_stmode_count[ 6][0],
+			  "LR-I", bitrate_stmode_count[ 6][1],
+			  "MS"  , bitrate_stmode_count[ 6][2],
+			  "MS-I", bitrate_stmode_count[ 6][3],
+			  "LR"  , bitrate_stmode_count[ 7][0],
+			  "LR-I", bitrate_stmode_count[ 7][1],
+			  "MS"  , bitrate_stmode_count[ 7][2],
+			  "MS-I", bitrate_stmode_count[ 7][3],
+			  "LR"  , bitrate_stmode_count[ 8][0],
+			  "LR-I", bitrate_stmode_count[ 8][1],
+			  "MS"  , bitrate_stmode_count[ 8][2],
+			  "MS-I", bitrate_stmode_count[ 8][3],
+			  "LR"  , bitrate_stmode_count[ 9][0],
+			  "LR-I", bitrate_stmode_count[ 9][1],
+			  "MS"  , bitrate_stmode_count[ 9][2],
+			  "MS-I", bitrate_stmode_count[ 9][3],
+			  "LR"  , bitrate_stmode_count[10][0],
+			  "LR-I", bitrate_stmode_count[10][1],
+			  "MS"  , bitrate_stmode_count[10][2],
+			  "MS-I", bitrate_stmode_count[10][3],
+			  "LR"  , bitrate_stmode_count[11][0],
+			  "LR-I", bitrate_stmode_count[11][1],
+			  "MS"  , bitrate_stmode_count[11][2],
+			  "MS-I", bitrate_stmode_count[11][3],
+			  "LR"  , bitrate_stmode_count[12][0],
+			  "LR-I", bitrate_stmode_count[12][1],
+			  "MS"  , bitrate_stmode_count[12][2],
+			  "MS-I", bitrate_stmode_count[12][3],
+			  "LR"  , bitrate_stmode_count[13][0],
+			  "LR-I", bitrate_stmode_count[13][1],
+			  "MS"  , bitrate_stmode_count[13][2],
+			  "MS-I", bitrate_stmode_count[13][3] );
+}
+
+
+static char mp3enc_get_stereo_mode_histogram__doc__[] =
+"Get dictionary for stereo mode histogram with LR/LR-I/MS/MS-I keys.\n"
+"C function: lame_stereo_mode_hist()\n"
+;
+
+static PyObject *
+mp3enc_get_stereo_mode_histogram(Encoder *self, PyObject *args)
+{
+    int stmode_count[4];
+
+    ENCODER_CHECK_IDLE(self)
+
+    lame_stereo_mode_hist( self->gfp, stmode_count );
+
+    return Py_BuildValue( "{sisisisi}",
+			  "LR"  , stmode_count[0],
+			  "LR-I", stmode_count[1],
+			  "MS"  , stmode_count[2],
+			  "MS-I", stmode_count[3] );
+}
+
+
+static char mp3enc_write_tags__doc__[] =
+"Write ID3v1 TAG's.\n"
+"Parameter: file\n"
+"C function: lame_mp3_tags_fid()\n"
+;
+
+static PyObject *
+mp3enc_write_tags(Encoder *self, PyObject *object)
+{
+    FILE *mp3_file;
+#if PY_MAJOR_VERSION >= 3
+    PyObject *rc;
+    int       fd;
+
+    ENCODER_CHECK_IDLE(self)
+
+    /* Python 3 files have no FILE *: write through a stdio stream on a
+     * duplicate of the descriptor, after the buffered data of object. */
+    rc = PyObject_CallMethod( object, "flush", NULL );
+    if ( NULL == rc )
+        return NULL;
+    Py_DECREF( rc );
+    fd = PyObject_AsFileDescriptor( object );
+    if ( 0 > fd )
+        return NULL;
+    fd = dup( fd );
+    if ( 0 > fd || NULL == (mp3_file = fdopen( fd, "r+b" )) ) {
+        if ( 0 <= fd )
+            close( fd );
+        return PyErr_SetFromErrno( PyExc_IOError );
+    }
+
+    lame_mp3_tags_fid( self->gfp, mp3_file );
+    if ( PYLAME_ENABLED(tag__write) )
+        PYLAME_PROBE2( tag__write, self,
+                       lame_get_lametag_frame( self->gfp, NULL, 0 ) );
+    fclose( mp3_file );
+#else
+    ENCODER_CHECK_IDLE(self)
+
+    if ( 0 == PyFile_Check( object ) )
+	return NULL;
+
+    mp3_file = PyFile_AsFile( object );
+
+    lame_mp3_tags_fid( self->gfp, mp3_file );
+    if ( PYLAME_ENABLED(tag__write) )
+        PYLAME_PROBE2( tag__write, self,
+                       lame_get_lametag_frame( self->gfp, NULL, 0 ) );
+#endif
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+
+/* Helpers to fill the get_config() dictionary. */
+
+static int
+config_set_int(PyObject *dict, const char *key, long value)
+{
+    PyObject *item;
+    int       rc;
+
+    item = PyInt_FromLong( value );
+    if ( NULL == item )
+        return -1;
+    rc = PyDict_SetItemString( dict, key, item );
+    Py_DECREF( item );
+    return rc;
+}
+
+static int
+config_set_float(PyObject *dict, const char *key, double value)
+{
+    PyObject *item;
+    int       rc;
+
+    item = PyFloat_FromDouble( value );
+    if ( NULL == item )
+        return -1;
+    rc = PyDict_SetItemString( dict, key, item );
+    Py_DECREF( item );
+    return rc;
+}
+
+#define CONFIG_INT(key, lamefunc) \
+    if ( 0 > config_set_int( dict, key, lamefunc( self->gfp ) ) ) \
+        goto error;
+
+#define CONFIG_FLOAT(key, lamefunc) \
+    if ( 0 > config_set_float( dict, key, lamefunc( self->gfp ) ) ) \
+        goto error;
+
+static char mp3enc_get_config__doc__[] =
+"Get a dictionary of the effective encoder settings.\n"
+"The keys follow the set_*() method and attribute names where there is\n"
+"one.  After init() it reflects the values LAME derived from presets,\n"
+"so equal dictionaries mean identical encoder configurations.\n"
+"C functions: lame_get_*()\n"
+;
+
+static PyObject *
+mp3enc_get_config(Encoder *self, PyObject *args)
+{
+    PyObject *dict;
+
+    ENCODER_CHECK_IDLE(self)
+
+    dict = PyDict_New();
+    if ( NULL == dict )
+        return NULL;
+
+    CONFIG_INT(  "in_samplerate",          lame_get_in_samplerate )
+    CONFIG_INT(  "out_samplerate",         lame_get_out_samplerate )
+    CONFIG_INT(  "num_channels",           lame_get_num_channels )
+    CONFIG_INT(  "num_samples",            (long)lame_get_num_samples )
+    CONFIG_FLOAT("scale",                  lame_get_scale )
+    CONFIG_FLOAT("scale_left",             lame_get_scale_left )
+    CONFIG_FLOAT("scale_right",            lame_get_scale_right )
+    CONFIG_INT(  "analysis",               lame_get_analysis )
+    CONFIG_INT(  "write_vbr_tag",          lame_get_bWriteVbrTag )
+    CONFIG_INT(  "quality",                lame_get_quality )
+    CONFIG_INT(  "mode",                   (long)lame_get_mode )
+    CONFIG_INT(  "force_ms",               lame_get_force_ms )
+    CONFIG_INT(  "free_format",            lame_get_free_format )
+    CONFIG_INT(  "bitrate",                lame_get_brate )
+    CONFIG_FLOAT("compression_ratio",      lame_get_compression_ratio )
+    CONFIG_INT(  "copyright",              lame_get_copyright )
+    CONFIG_INT(  "original",               lame_get_original )
+    CONFIG_INT(  "error_protection",       lame_get_error_protection )
+    CONFIG_INT(  "extension",              lame_get_extension )
+    CONFIG_INT(  "strict_iso",             lame_get_strict_ISO )
+    CONFIG_INT(  "disable_reservoir",      lame_get_disable_reservoir )
+    CONFIG_INT(  "exp_quantization",       lame_get_experimentalX )
+    CONFIG_INT(  "exp_y",                  lame_get_experimentalY )
+    CONFIG_INT(  "exp_z",                  lame_get_experimentalZ )
+    CONFIG_INT(  "exp_nspsytune",          lame_get_exp_nspsytune )
+    CONFIG_FLOAT("msfix",                  lame_get_msfix )
+    CONFIG_INT(  "vbr",                    (long)lame_get_VBR )
+    CONFIG_INT(  "vbr_quality",            lame_get_VBR_q )
+    CONFIG_INT(  "abr_bitrate",            lame_get_VBR_mean_bitrate_kbps )
+    CONFIG_INT(  "vbr_min_bitrate",        lame_get_VBR_min_bitrate_kbps )
+    CONFIG_INT(  "vbr_max_bitrate",        lame_get_VBR_max_bitrate_kbps )
+    CONFIG_INT(  "vbr_min_enforce",        lame_get_VBR_hard_min )
+    CONFIG_INT(  "lowpass_frequency",      lame_get_lowpassfreq )
+    CONFIG_INT(  "lowpass_width",          lame_get_lowpasswidth )
+    CONFIG_INT(  "highpass_frequency",     lame_get_highpassfreq )
+    CONFIG_INT(  "highpass_width",         lame_get_highpasswidth )
+    CONFIG_INT(  "ath_for_masking_only",   lame_get_ATHonly )
+    CONFIG_INT(  "ath_for_short_only",     lame_get_ATHshort )
+    CONFIG_INT(  "ath_disable",            lame_get_noATH )
+    CONFIG_INT(  "ath_type",               lame_get_ATHtype )
+    CONFIG_FLOAT("ath_lower",              lame_get_ATHlower )
+    CONFIG_INT(  "athaa_type",             lame_get_athaa_type )
+    CONFIG_FLOAT("athaa_sensitivity",      lame_get_athaa_sensitivity )
+    CONFIG_INT(  "allow_blocktype_difference", lame_get_allow_diff_short )
+    CONFIG_INT(  "use_temporal_masking",   lame_get_useTemporal )
+    CONFIG_FLOAT("inter_channel_ratio",    lame_get_interChRatio )
+    CONFIG_INT(  "no_short_blocks",        lame_get_no_short_blocks )
+    CONFIG_INT(  "force_short_blocks",     lame_get_force_short_blocks )
+    CONFIG_INT(  "emphasis",               lame_get_emphasis )
+    CONFIG_INT(  "find_replay_gain",       lame_get_findReplayGain )
+    CONFIG_INT(  "decode_on_the_fly",      lame_get_decode_on_the_fly )
+    if ( 0 > config_set_int( dict, "lean", self->lean ) )
+        goto error;
+    /* Only with trimming on, so other configurations keep their keys. */
+    if ( NULL != self->trim
+         && ( 0 > config_set_float( dict, "silence_threshold_db",
+                                    self->trim->threshold_db )
+              || 0 > config_set_int( dict, "silence_min_ms",
+                                     self->trim->min_ms )
+              || 0 > config_set_int( dict, "silence_keep_ms",
+                                     self->trim->keep_ms )
+              || 0 > config_set_int( dict, "silence_compress_gaps",
+                                     self->trim->compress ) ) )
+        goto error;
+
+    return dict;
+
+error:
+    Py_DECREF( dict );
+    return NULL;
+}
+
+#undef CONFIG_INT
+#undef CONFIG_FLOAT
+
+
+static char mp3enc_get_lametag_frame__doc__[] =
+"Get the Xing/LAME tag frame (with encoder delay and padding) as a string.\n"
+"Call it after flush_buffers() and write it over the first frame of the\n"
+"stream; this works for any file-like object, unlike write_tags().\n"
+"C function: lame_get_lametag_frame()\n"
+;
+
+static PyObject *
+mp3enc_get_lametag_frame(Encoder *self, PyObject *args)
+{
+    unsigned char *tag_buf;
+    size_t         tag_size;
+    PyObject      *result;
+
+    ENCODER_CHECK_IDLE(self)
+
+    /* A zero sized buffer makes LAME report the size it needs. */
+    tag_size = lame_get_lametag_frame( self->gfp, NULL, 0 );
+    if ( 0 == tag_size ) {
+        PyErr_SetString(ENCODER_ERROR(self),
+            "no LAME tag available (write_vbr_tag disabled?)");
+        return NULL;
+    }
+
+    tag_buf = PyMem_Malloc( tag_size );
+    if ( NULL == tag_buf )
+        return PyErr_NoMemory();
+
+    tag_size = lame_get_lametag_frame( self->gfp, tag_buf, tag_size );
+    result = PyString_FromStringAndSize( (char *)tag_buf, tag_size );
+    PyMem_Free( tag_buf );
+
+    return result;
+}
+
+
+static char mp3enc_get_itunsmpb__doc__[] =
+"Get the iTunSMPB gapless comment for the encoded stream.\n"
+"Call it after flush_buffers(); the priming and padding counts include\n"
+"the 528+1 samples of decoder delay, as iTunes expects.\n"
+"C functions: lame_get_encoder_delay(), lame_get_encoder_padding()\n"
+;
+
+static PyObject *
+mp3enc_get_itunsmpb(Encoder *self, PyObject *args)
+{
+    char itunsmpb[128];
+    int  delay, padding;
+
+    ENCODER_CHECK_IDLE(self)
+
+    delay = lame_get_encoder_delay( self->gfp ) + 528 + 1;
+    padding = lame_get_encoder_padding( self->gfp ) - (528 + 1);
+    if ( 0 > padding )
+        padding = 0;
+
+    PyOS_snprintf( itunsmpb, sizeof(itunsmpb),
+                   " 00000000 %08X %08X %08X%08X 00000000 00000000"
+                   " 00000000 00000000 00000000 00000000 00000000 00000000",
+                   delay, padding,
+                   (unsigned int)(self->samples_encoded >> 32),
+                   (unsigned int)(self->samples_encoded & 0xffffffffUL) );
+
+    return Py_BuildValue( "s", itunsmpb );
+}
+
+
+/* Keyword arguments of the FASTCALL fronts: the setters take the
+ * setting by its name, e.g. set_bitrate(bitrate=128). */
+FASTCALL_O(mp3enc_encode_interleaved, "encode_interleaved", "audiodata")
+FASTCALL_O(mp3enc_set_low_latency, "set_low_latency", "low_latency")
+FASTCALL_O(mp3enc_set_lean, "set_lean", "lean")
+FASTCALL_O(mp3enc_set_num_samples, "set_num_samples", "num_samples")
+FASTCALL_O(mp3enc_set_out_samplerate, "set_out_samplerate", "out_samplerate")
+FASTCALL_O(mp3enc_set_analysis, "set_analysis", "analysis")
+FASTCALL_O(mp3enc_set_write_vbr_tag, "set_write_vbr_tag", "write_vbr_tag")
+FASTCALL_O(mp3enc_set_quality, "set_quality", "quality")
+FASTCALL_O(mp3enc_set_free_format, "set_free_format", "free_format")
+FASTCALL_O(mp3enc_set_bitrate, "set_bitrate", "bitrate")
+FASTCALL_O(mp3enc_set_compression_ratio, "set_compression_ratio", "compression_ratio")
+FASTCALL_O(mp3enc_set_preset, "set_preset", "preset")
+FASTCALL_O(mp3enc_set_error_protection, "set_error_protection", "error_protection")
+FASTCALL_O(mp3enc_set_extension, "set_extension", "extension")
+FASTCALL_O(mp3enc_set_strict_iso, "set_strict_iso", "strict_iso")
+FASTCALL_O(mp3enc_set_disable_reservoir, "set_disable_reservoir", "disable_reservoir")
+FASTCALL_O(mp3enc_set_exp_quantization, "set_exp_quantization", "exp_quantization")
+FASTCALL_O(mp3enc_set_exp_y, "set_exp_y", "exp_y")
+FASTCALL_O(mp3enc_set_exp_z, "set_exp_z", "exp_z")
+FASTCALL_O(mp3enc_set_exp_nspsytune, "set_exp_nspsytune", "exp_nspsytune")
+FASTCALL_O(mp3enc_set_vbr, "set_vbr", "vbr")
+FASTCALL_O(mp3enc_set_vbr_quality, "set_vbr_quality", "vbr_quality")
+FASTCALL_O(mp3enc_set_abr_bitrate, "set_abr_bitrate", "abr_bitrate")
+FASTCALL_O(mp3enc_set_vbr_min_bitrate, "set_vbr_min_bitrate", "vbr_min_bitrate")
+FASTCALL_O(mp3enc_set_vbr_max_bitrate, "set_vbr_max_bitrate", "vbr_max_bitrate")
+FASTCALL_O(mp3enc_set_vbr_min_enforce, "set_vbr_min_enforce", "vbr_min_enforce")
+FASTCALL_O(mp3enc_set_lowpass_frequency, "set_lowpass_frequency", "lowpass_frequency")
+FASTCALL_O(mp3enc_set_lowpass_width, "set_lowpass_width", "lowpass_width")
+FASTCALL_O(mp3enc_set_highpass_frequency, "set_highpass_frequency", "highpass_frequency")
+FASTCALL_O(mp3enc_set_highpass_width, "set_highpass_width", "highpass_width")
+FASTCALL_O(mp3enc_set_ath_for_masking_only, "set_ath_for_masking_only", "ath_for_masking_only")
+FASTCALL_O(mp3enc_set_ath_for_short_only, "set_ath_for_short_only", "ath_for_short_only")
+FASTCALL_O(mp3enc_set_ath_disable, "set_ath_disable", "ath_disable")
+FASTCALL_O(mp3enc_set_ath_type, "set_ath_type", "ath_type")
+FASTCALL_O(mp3enc_set_ath_lower, "set_ath_lower", "ath_lower")
+FASTCALL_O(mp3enc_set_athaa_type, "set_athaa_type", "athaa_type")
+FASTCALL_O(mp3enc_set_athaa_sensitivity, "set_athaa_sensitivity", "athaa_sensitivity")
+FASTCALL_O(mp3enc_set_allow_blocktype_difference, "set_allow_blocktype_difference", "allow_blocktype_difference")
+FASTCALL_O(mp3enc_set_use_temporal_masking, "set_use_temporal_masking", "use_temporal_masking")
+FASTCALL_O(mp3enc_set_inter_channel_ratio, "set_inter_channel_ratio", "inter_channel_ratio")
+FASTCALL_O(mp3enc_set_no_short_blocks, "set_no_short_blocks", "no_short_blocks")
+FASTCALL_O(mp3enc_set_force_short_blocks, "set_force_short_blocks", "force_short_blocks")
+FASTCALL_O(mp3enc_set_find_replay_gain, "set_find_replay_gain", "find_replay_gain")
+FASTCALL_O(mp3enc_set_decode_on_the_fly, "set_decode_on_the_fly", "decode_on_the_fly")
+
+
+static struct PyMethodDef mp3enc_methods[] = {
+    {"init", (PyCFunction)mp3enc_init,
+        METH_NOARGS, mp3enc_init__doc__},
+    {"encode_interleaved", METH_O_FAST(mp3enc_encode_interleaved),
+        mp3enc_encode_interleaved__doc__},
+    {"encode_chunks", (PyCFunction)mp3enc_encode_chunks,
+        METH_O, mp3enc_encode_chunks__doc__},
+    {"flush_buffers", (PyCFunction)mp3enc_flush_buffers,
+        METH_NOARGS, mp3enc_flush_buffers__doc__},
+    {"flush_nogap", (PyCFunction)mp3enc_flush_nogap,
+        METH_NOARGS, mp3enc_flush_nogap__doc__},
+    {"init_bitstream", (PyCFunction)mp3enc_init_bitstream,
+        METH_NOARGS, mp3enc_init_bitstream__doc__},
+    {"reset", (PyCFunction)mp3enc_reset,
+        METH_NOARGS, mp3enc_reset__doc__},
+    {"set_silence_trim", (PyCFunction)mp3enc_set_silence_trim,
+        METH_VARARGS, mp3enc_set_silence_trim__doc__},
+    {"get_silence_trim", (PyCFunction)mp3enc_get_silence_trim,
+        METH_NOARGS, mp3enc_get_silence_trim__doc__},
+    {"start_live", (PyCFunction)mp3enc_start_live,
+        METH_VARARGS, mp3enc_start_live__doc__},
+    {"push", (PyCFunction)mp3enc_push,
+        METH_O, mp3enc_push__doc__},
+    {"pull", (PyCFunction)mp3enc_pull,
+        METH_NOARGS, mp3enc_pull__doc__},
+    {"live_stats", (PyCFunction)mp3enc_live_stats,
+        METH_NOARGS, mp3enc_live_stats__doc__},
+    {"stop_live", (PyCFunction)mp3enc_stop_live,
+        METH_NOARGS, mp3enc_stop_live__doc__},
+    {"set_low_latency", METH_O_FAST(mp3enc_set_low_latency),
+        mp3enc_set_low_latency__doc__},
+    {"get_latency", (PyCFunction)mp3enc_get_latency,
+        METH_NOARGS, mp3enc_get_latency__doc__},
+    {"set_lean", METH_O_FAST(mp3enc_set_lean),
+        mp3enc_set_lean__doc__},
+    {"memory_usage", (PyCFunction)mp3enc_memory_usage,
+        METH_NOARGS, mp3enc_memory_usage__doc__},
+    {"start_analysis", (PyCFunction)mp3enc_start_analysis,
+        METH_O, mp3enc_start_analysis__doc__},
+    {"get_analysis", (PyCFunction)mp3enc_get_analysis,
+        METH_NOARGS, mp3enc_get_analysis__doc__},
+    {"stop_analysis", (PyCFunction)mp3enc_stop_analysis,
+        METH_NOARGS, mp3enc_stop_analysis__doc__},
+    {"start_seek_index", (PyCFunction)mp3enc_start_seek_index,
+        METH_VARARGS, mp3enc_start_seek_index__doc__},
+    {"get_seek_index", (PyCFunction)mp3enc_get_seek_index,
+        METH_NOARGS, mp3enc_get_seek_index__doc__},
+    {"stop_seek_index", (PyCFunction)mp3enc_stop_seek_index,
+        METH_NOARGS, mp3enc_stop_seek_index__doc__},
+#if PY_VERSION_HEX >= 0x03070000
+    {"encode_to_fd", (PyCFunction)(void (*)(void))mp3enc_encode_to_fd,
+        METH_FASTCALL | METH_KEYWORDS, mp3enc_encode_to_fd__doc__},
+#else
+    {"encode_to_fd", (PyCFunction)mp3enc_encode_to_fd,
+        METH_VARARGS, mp3enc_encode_to_fd__doc__},
+#endif
+    {"flush_to_fd", (PyCFunction)mp3enc_flush_to_fd,
+        METH_O, mp3enc_flush_to_fd__doc__},
+    {"set_num_samples", METH_O_FAST(mp3enc_set_num_samples),
+	mp3enc_set_num_samples__doc__                  },
+    {"set_out_samplerate", METH_O_FAST(mp3enc_set_out_samplerate),
+	mp3enc_set_out_samplerate__doc__               },
+    {"set_analysis", METH_O_FAST(mp3enc_set_analysis),
+	mp3enc_set_analysis__doc__                     },
+    {"set_write_vbr_tag", METH_O_FAST(mp3enc_set_write_vbr_tag),
+	mp3enc_set_write_vbr_tag__doc__                },
+    {"set_quality", METH_O_FAST(mp3enc_set_quality),
+	mp3enc_set_quality__doc__                       },
+    {"set_free_format", METH_O_FAST(mp3enc_set_free_format),
+	mp3enc_set_free_format__doc__                   },
+    {"set_bitrate", METH_O_FAST(mp3enc_set_bitrate),
+	mp3enc_set_bitrate__doc__                       },
+    {"set_compression_ratio", METH_O_FAST(mp3enc_set_compression_ratio),
+	mp3enc_set_compression_ratio__doc__             },
+    {"set_preset", METH_O_FAST(mp3enc_set_preset),
+	mp3enc_set_preset__doc__                        },
+    {"set_asm_optimizations", (PyCFunction)mp3enc_set_asm_optimizations,
+	METH_VARARGS, mp3enc_set_asm_optimizations__doc__             },
+    {"set_error_protection", METH_O_FAST(mp3enc_set_error_protection),
+	mp3enc_set_error_protection__doc__              },
+    {"set_extension", METH_O_FAST(mp3enc_set_extension),
+	mp3enc_set_extension__doc__                     },
+    {"set_strict_iso", METH_O_FAST(mp3enc_set_strict_iso),
+	mp3enc_set_strict_iso__doc__                    },
+    {"set_disable_reservoir", METH_O_FAST(mp3enc_set_disable_reservoir),
+	mp3enc_set_disable_reservoir__doc__             },
+    {"set_exp_quantization", METH_O_FAST(mp3enc_set_exp_quantization),
+	mp3enc_set_exp_quantization__doc__              },
+    {"set_exp_y", METH_O_FAST(mp3enc_set_exp_y),
+	mp3enc_set_exp_y__doc__                         },
+    {"set_exp_z", METH_O_FAST(mp3enc_set_exp_z),
+	mp3enc_set_exp_z__doc__                         },
+    {"set_exp_nspsytune", METH_O_FAST(mp3enc_set_exp_nspsytune),
+	mp3enc_set_exp_nspsytune__doc__                 },
+    {"set_vbr", METH_O_FAST(mp3enc_set_vbr),
+	mp3enc_set_vbr__doc__                           },
+    {"set_vbr_quality", METH_O_FAST(mp3enc_set_vbr_quality),
+	mp3enc_set_vbr_quality__doc__                   },
+    {"set_abr_bitrate", METH_O_FAST(mp3enc_set_abr_bitrate),
+	mp3enc_set_abr_bitrate__doc__                   },
+    {"set_vbr_min_bitrate", METH_O_FAST(mp3enc_set_vbr_min_bitrate),
+	mp3enc_set_vbr_min_bitrate__doc__               },
+    {"set_vbr_max_bitrate", METH_O_FAST(mp3enc_set_vbr_max_bitrate),
+	mp3enc_set_vbr_max_bitrate__doc__               },
+    {"set_vbr_min_enforce", METH_O_FAST(mp3enc_set_vbr_min_enforce),
+	mp3enc_set_vbr_min_enforce__doc__               },
+    {"set_lowpass_frequency", METH_O_FAST(mp3enc_set_lowpass_frequency),
+	mp3enc_set_lowpass_frequency__doc__             },
+    {"set_lowpass_width", METH_O_FAST(mp3enc_set_lowpass_width),
+	mp3enc_set_lowpass_width__doc__                 },
+    {"set_highpass_frequency", METH_O_FAST(mp3enc_set_highpass_frequency),
+	mp3enc_set_highpass_frequency__doc__            },
+    {"set_highpass_width", METH_O_FAST(mp3enc_set_highpass_width),
+	mp3enc_set_highpass_width__doc__                },
+    {"set_ath_for_masking_only", METH_O_FAST(mp3enc_set_ath_for_masking_only),
+	mp3enc_set_ath_for_masking_only__doc__          },
+    {"set_ath_for_short_only", METH_O_FAST(mp3enc_set_ath_for_short_only),
+	mp3enc_set_ath_for_short_only__doc__            },
+    {"set_ath_disable", METH_O_FAST(mp3enc_set_ath_disable),
+	mp3enc_set_ath_disable__doc__                   },
+    {"set_ath_type", METH_O_FAST(mp3enc_set_ath_type),
+	mp3enc_set_ath_type__doc__                      },
+    {"set_ath_lower", METH_O_FAST(mp3enc_set_ath_lower),
+	mp3enc_set_ath_lower__doc__                     },
+    {"set_athaa_type", METH_O_FAST(mp3enc_set_athaa_type),
+	mp3enc_set_athaa_type__doc__                    },
+    {"set_athaa_sensitivity", METH_O_FAST(mp3enc_set_athaa_sensitivity),
+	mp3enc_set_athaa_sensitivity__doc__             },
+    {"set_allow_blocktype_difference", METH_O_FAST(mp3enc_set_allow_blocktype_difference),
+	mp3enc_set_allow_blocktype_difference__doc__    },
+    {"set_use_temporal_masking", METH_O_FAST(mp3enc_set_use_temporal_masking),
+	mp3enc_set_use_temporal_masking__doc__          },
+    {"set_inter_channel_ratio", METH_O_FAST(mp3enc_set_inter_channel_ratio),
+	mp3enc_set_inter_channel_ratio__doc__           },
+    {"set_no_short_blocks", METH_O_FAST(mp3enc_set_no_short_blocks),
+	mp3enc_set_no_short_blocks__doc__               },
+    {"set_force_short_blocks", METH_O_FAST(mp3enc_set_force_short_blocks),
+	mp3enc_set_force_short_blocks__doc__            },
+    {"set_find_replay_gain", METH_O_FAST(mp3enc_set_find_replay_gain),
+	mp3enc_set_find_replay_gain__doc__                    },
+    {"set_decode_on_the_fly", METH_O_FAST(mp3enc_set_decode_on_the_fly),
+	mp3enc_set_decode_on_the_fly__doc__                   },
+    {"get_bitrate_histogram", (PyCFunction)mp3enc_get_bitrate_histogram,
+        METH_NOARGS, mp3enc_get_bitrate_histogram__doc__},
+    {"get_bitrate_values", (PyCFunction)mp3enc_get_bitrate_values,
+        METH_NOARGS, mp3enc_get_bitrate_values__doc__},
+    {"get_bitrate_stereo_mode_histogram", (PyCFunction)mp3enc_get_bitrate_stereo_mode_histogram,
+        METH_NOARGS, mp3enc_get_bitrate_stereo_mode_histogram__doc__ },
+    {"get_stereo_mode_histogram", (PyCFunction)mp3enc_get_stereo_mode_histogram,
+        METH_NOARGS, mp3enc_get_stereo_mode_histogram__doc__},
+    {"write_tags", (PyCFunction)mp3enc_write_tags,
+	METH_O, mp3enc_write_tags__doc__                        },
+    {"get_config", (PyCFunction)mp3enc_get_config,
+        METH_NOARGS, mp3enc_get_config__doc__},
+    {"get_lametag_frame", (PyCFunction)mp3enc_get_lametag_frame,
+        METH_NOARGS, mp3enc_get_lametag_frame__doc__},
+    {"get_itunsmpb", (PyCFunction)mp3enc_get_itunsmpb,
+        METH_NOARGS, mp3enc_get_itunsmpb__doc__},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+/* "Generic" setters for int and float values of the lame encoder that
+take care of the argument verification needed when dealing with
+attributes. */
+
+static int
+generic_set_int(Encoder *self, PyObject *value, const char *attr,
+                int (fptr)(lame_global_flags*, int))
+{
+    if (value == NULL) {
+        PyErr_Format(PyExc_AttributeError, "Cannot delete the '%s' attribute.",
+                     attr);
+        return -1;
+    }
+
+    ENCODER_CHECK_IDLE_OR(self, -1)
+
+    if (!PyInt_Check(value)) {
+        PyErr_Format(PyExc_TypeError, "Attribute '%s' must be an integer.", attr);
+        return -1;
+    }
+
+    if (0 != (fptr)(self->gfp, PyInt_AS_LONG(value))) {
+        PyErr_Format(PyExc_ValueError, "Set '%s' failed (out of range?).", attr);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+generic_set_float(Encoder *self, PyObject *value, const char *attr,
+                  int (fptr)(lame_global_flags*, float))
+{
+    if (value == NULL) {
+        PyErr_Format(PyExc_AttributeError, "Cannot delete the '%s' attribute.",
+                     attr);
+        return -1;
+    }
+
+    ENCODER_CHECK_IDLE_OR(self, -1)
+
+    if (!PyFloat_Check(value)) {
+        PyErr_Format(PyExc_TypeError, "Attribute '%s' must be a float.", attr);
+        return -1;
+    }
+
+    if (0 != (fptr)(self->gfp, PyFloat_AS_DOUBLE(value))) {
+        PyErr_Format(PyExc_ValueError, "Set '%s' failed (out of range?).", attr);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Macros to ease creation of attribute getter/setter wrapper
+ * functions.  I Know this is a bit much, but you can use "gcc -E" to
+ * see what it generates, and it would be truly tedious without.
+ *
+ * This cleverness throws warnings when the set type is an enum, so we
+ * still write some of these out long-hand.
+ */
+#define GETATTR(attrname, format) \
+    static PyObject *\
+    mp3enc_get_##attrname(Encoder *self, void *closure) { \
+        ENCODER_CHECK_IDLE(self) \
+        return Py_BuildValue(#format, lame_get_##attrname(self->gfp)); \
+    }
+
+#define SETATTR_INT(attrname, lamefunc) \
+    static int \
+    mp3enc_set_##attrname(Encoder *self, PyObject *value, void *closure) { \
+        return generic_set_int(self, value, #attrname, lamefunc); \
+    }
+
+#define SETATTR_FLOAT(attrname, lamefunc) \
+    static int \
+    mp3enc_set_##attrname(Encoder *self, PyObject *value, void *closure) { \
+        return generic_set_float(self, value, #attrname, lamefunc); \
     }
 
 
@@ -1613,152 +5213,1491 @@ SETATTR_INT(in_samplerate, lame_set_in_samplerate)
 GETATTR(num_channels, i)
 SETATTR_INT(num_channels, lame_set_num_channels)
 
-GETATTR(scale, f)
-SETATTR_FLOAT(scale, lame_set_scale)
-GETATTR(scale_left, f)
-SETATTR_FLOAT(scale_left, lame_set_scale_left)
-GETATTR(scale_right, f)
-SETATTR_FLOAT(scale_right, lame_set_scale_right)
+GETATTR(scale, f)
+SETATTR_FLOAT(scale, lame_set_scale)
+GETATTR(scale_left, f)
+SETATTR_FLOAT(scale_left, lame_set_scale_left)
+GETATTR(scale_right, f)
+SETATTR_FLOAT(scale_right, lame_set_scale_right)
+
+SETATTR_INT(copyright, lame_set_copyright)
+GETATTR(copyright, i)
+SETATTR_INT(original, lame_set_original)
+GETATTR(original, i)
+
+GETATTR(frameNum, i)
+GETATTR(totalframes, i)
+
+GETATTR(mode, i)
+
+GETATTR(encoder_delay, i)
+GETATTR(encoder_padding, i)
+GETATTR(mf_samples_to_encode, i)
+GETATTR(size_mp3buffer, i)
+
+GETATTR(RadioGain, i)
+GETATTR(AudiophileGain, i)
+GETATTR(PeakSample, f)
+GETATTR(noclipGainChange, i)
+GETATTR(noclipScale, f)
+GETATTR(framesize, i)
+
+static PyObject *
+mp3enc_get_samples_encoded(Encoder *self, void *closure)
+{
+    return PyLong_FromUnsignedLongLong(self->samples_encoded);
+}
+
+static PyObject *
+mp3enc_get_pending_bytes(Encoder *self, void *closure)
+{
+    return PyInt_FromLong(self->carry_len + self->live_carry_len);
+}
+
+static PyObject *
+mp3enc_get_fd_coalesce(Encoder *self, void *closure)
+{
+    return PyInt_FromLong(self->fd_coalesce);
+}
+
+static int
+mp3enc_set_fd_coalesce(Encoder *self, PyObject *value, void *closure)
+{
+    int fd_coalesce;
+
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError,
+                        "Cannot delete the 'fd_coalesce' attribute.");
+        return -1;
+    }
+
+    if (0 > parse_int_arg(value, &fd_coalesce))
+        return -1;
+
+    if (0 > fd_coalesce) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Set 'fd_coalesce' failed (out of range?).");
+        return -1;
+    }
+
+    self->fd_coalesce = fd_coalesce;
+    return 0;
+}
+
+static int
+mp3enc_setattr_mode(Encoder *self, PyObject *value, void *closure)
+{
+    if (value == NULL) {
+        PyErr_SetString(PyExc_AttributeError,
+                        "Cannot delete the 'mode' attribute.");
+        return -1;
+    }
+
+    ENCODER_CHECK_IDLE_OR(self, -1)
+
+    if (!PyInt_Check(value)) {
+        PyErr_SetString(PyExc_TypeError, "Attribute 'mode' must be an integer.");
+        return -1;
+    }
+
+    if (0 != lame_set_mode(self->gfp, PyInt_AS_LONG(value))) {
+        PyErr_SetString(PyExc_ValueError, "Set 'mode' failed (out of range?).");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyGetSetDef mp3enc_getseters[] = {
+    {"in_samplerate",
+     (getter)mp3enc_get_in_samplerate, (setter)mp3enc_set_in_samplerate,
+    "Input sample rate in Hz.", NULL},
+    {"num_channels",
+     (getter)mp3enc_get_num_channels, (setter)mp3enc_set_num_channels,
+    "Number of channels in the input stream.", NULL},
+    {"scale",
+     (getter)mp3enc_get_scale, (setter)mp3enc_set_scale,
+    "Scale the input by this amount before encoding.", NULL},
+    {"scale_left",
+     (getter)mp3enc_get_scale_left, (setter)mp3enc_set_scale_left,
+    "Scale channel 0 (left) of the input by this amount before encoding.", NULL},
+    {"scale_right",
+     (getter)mp3enc_get_scale_right, (setter)mp3enc_set_scale_right,
+    "Scale channel 1 (right) of the input by this amount before encoding.", NULL},
+    {"copyright",
+     (getter)mp3enc_get_copyright, (setter)mp3enc_set_copyright,
+     "Copyright bit.", NULL},
+    {"original",
+     (getter)mp3enc_get_original, (setter)mp3enc_set_original,
+     "Original bit.", NULL},
+    {"frame_num",
+     (getter)mp3enc_get_frameNum, (setter)NULL,
+     "Number of frames encoded (read-only).", NULL},
+    {"total_frames",
+     (getter)mp3enc_get_totalframes, (setter)NULL,
+     "Get estimate of the total number of frames to be encoded, only valid\n"
+     "if the calling program set num_samples (read-only).", NULL},
+    {"mode",
+     (getter)mp3enc_get_mode, (setter)mp3enc_setattr_mode,
+     "MPEG mode using MPEG_MODE_* constants.", NULL},
+    {"encoder_delay",
+     (getter)mp3enc_get_encoder_delay, (setter)NULL,
+     "Number of priming samples the encoder adds at the start (read-only).",
+     NULL},
+    {"encoder_padding",
+     (getter)mp3enc_get_encoder_padding, (setter)NULL,
+     "Number of padding samples added at the end, only valid after\n"
+     "flush_buffers() (read-only).", NULL},
+    {"mf_samples_to_encode",
+     (getter)mp3enc_get_mf_samples_to_encode, (setter)NULL,
+     "Number of samples buffered inside LAME, not yet encoded (read-only).",
+     NULL},
+    {"size_mp3buffer",
+     (getter)mp3enc_get_size_mp3buffer, (setter)NULL,
+     "Number of encoded bytes held back inside LAME (read-only).", NULL},
+    {"framesize",
+     (getter)mp3enc_get_framesize, (setter)NULL,
+     "Number of samples per channel in an MP3 frame (read-only).", NULL},
+    {"radio_gain",
+     (getter)mp3enc_get_RadioGain, (setter)NULL,
+     "ReplayGain track gain in units of 0.1 dB, only valid after\n"
+     "flush_buffers() with set_find_replay_gain(1) (read-only).", NULL},
+    {"audiophile_gain",
+     (getter)mp3enc_get_AudiophileGain, (setter)NULL,
+     "ReplayGain audiophile gain in units of 0.1 dB (read-only).", NULL},
+    {"peak_sample",
+     (getter)mp3enc_get_PeakSample, (setter)NULL,
+     "Largest absolute sample value of the decoded output, only valid\n"
+     "with set_decode_on_the_fly(1) (read-only).", NULL},
+    {"noclip_gain_change",
+     (getter)mp3enc_get_noclipGainChange, (setter)NULL,
+     "Gain change in units of 0.1 dB that avoids clipping (read-only).",
+     NULL},
+    {"noclip_scale",
+     (getter)mp3enc_get_noclipScale, (setter)NULL,
+     "Input scale factor that avoids clipping, or -1 if unknown\n"
+     "(read-only).", NULL},
+    {"samples_encoded",
+     (getter)mp3enc_get_samples_encoded, (setter)NULL,
+     "Number of samples per channel passed to the encoder (read-only).",
+     NULL},
+    {"pending_bytes",
+     (getter)mp3enc_get_pending_bytes, (setter)NULL,
+     "Bytes of an incomplete sample kept for the next encode call or\n"
+     "push() (read-only).",
+     NULL},
+    {"fd_coalesce",
+     (getter)mp3enc_get_fd_coalesce, (setter)mp3enc_set_fd_coalesce,
+     "encode_to_fd() holds back output until at least this many bytes can\n"
+     "be written with one writev() call (default: 0, write every call).",
+     NULL},
+    {NULL, NULL, NULL, NULL, NULL} /* Sentinel */
+};
+
+#if PY_MAJOR_VERSION >= 3
+/* Encoder type declaration: a heap type, created per module by
+ * lame_exec(). */
+static PyType_Slot encoder_slots[] = {
+    {Py_tp_dealloc, (void *)mp3enc_dealloc},
+    {Py_tp_doc, (void *)"Encoder object."},
+    {Py_tp_methods, mp3enc_methods},
+    {Py_tp_getset, mp3enc_getseters},
+    {Py_tp_new, (void *)mp3enc_new},
+    {0, NULL}
+};
+
+static PyType_Spec encoder_spec = {
+    "_lame.Encoder",
+    sizeof(Encoder),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    encoder_slots
+};
+#else
+/* Encoder type declaration */
+static PyTypeObject EncoderType = {
+        PyObject_HEAD_INIT(NULL)
+        0,                              /* ob_size */
+        "_lame.Encoder",                /* tp_name */
+        sizeof(Encoder),                /* tp_basicsize */
+        0,                              /* tp_itemsize */
+        /* methods */
+        (destructor)mp3enc_dealloc,     /* tp_dealloc */
+        0,                              /* tp_print */
+        0,                              /* tp_getattr */
+        0,                              /* tp_setattr */
+        0,                              /* tp_compare */
+        0,                              /* tp_repr */
+        0,                              /* tp_as_number */
+        0,                              /* tp_as_sequence */
+        0,                              /* tp_as_mapping */
+        0,                              /* tp_hashg */
+        0,                              /* tp_call */
+        0,                              /* tp_str */
+        0,                              /* tp_getattro */
+        0,                              /* tp_setattro */
+        0,                              /* tp_as_buffer */
+        Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
+        "Encoder object.",              /* tp_doc */
+        0,                              /* tp_traverse */
+        0,                              /* tp_clear */
+        0,                              /* tp_richcompare */
+        0,                              /* tp_weaklistoffset */
+        0,                              /* tp_iter */
+        0,                              /* tp_iternext */
+        mp3enc_methods,                 /* TODO tp_methods */
+        0,                              /* tp_members */
+        mp3enc_getseters,               /* tp_getset */
+        0,                              /* tp_base */
+        0,                              /* tp_dict */
+        0,                              /* tp_descr_get */
+        0,                              /* tp_descr_set */
+        0,                              /* tp_dictoffset */
+        0,                              /* tp_init */
+        0,                              /* tp_alloc */
+        mp3enc_new,                     /* tp_new */
+};
+#endif
+
 
-SETATTR_INT(copyright, lame_set_copyright)
-GETATTR(copyright, i)
-SETATTR_INT(original, lame_set_original)
-GETATTR(original, i)
+/* BEGIN lame module functions */
 
-GETATTR(frameNum, i)
-GETATTR(totalframes, i)
 
-GETATTR(mode, i)
+static char mp3lame_version__doc__[] =
+"Returns the version of LAME in a tuple: (major, minor, alpha, beta,\n"
+"psy_major, sy_minor, psy_alpha, psy_beta, compile_time_features)"
+;
+
+static PyObject *
+mp3lame_version(PyObject *self, PyObject *args)
+{
+    lame_version_t version;
+
+    get_lame_version_numerical(&version);
+
+    return Py_BuildValue("iiiiiiiis",
+                         version.major,
+                         version.minor,
+                         version.alpha,
+                         version.beta,
+                         version.psy_major,
+                         version.psy_minor,
+                         version.psy_alpha,
+                         version.psy_beta,
+                         version.features);
+}
+
+
+static char mp3lame_memory_usage__doc__[] =
+"Returns a dict of process wide memory figures in bytes: encoders (the\n"
+"number of live Encoder objects), buffers and lame (their sums over all\n"
+"encoders, see Encoder.memory_usage()) and rss (the resident set size of\n"
+"the process, None where /proc is not available)."
+;
+
+static PyObject *
+mp3lame_memory_usage(PyObject *self, PyObject *args)
+{
+    FILE *statm;
+    unsigned long size, resident;
+    PyObject *rss = NULL;
+
+    statm = fopen( "/proc/self/statm", "r" );
+    if ( NULL != statm ) {
+        if ( 2 == fscanf( statm, "%lu %lu", &size, &resident ) )
+            rss = PyLong_FromUnsignedLongLong(
+                      (unsigned PY_LONG_LONG)resident * sysconf( _SC_PAGESIZE ) );
+        fclose( statm );
+    }
+    if ( NULL == rss ) {
+        Py_INCREF( Py_None );
+        rss = Py_None;
+    }
+
+    return Py_BuildValue("{s:n,s:n,s:n,s:N}",
+                         "encoders", MEM_GET(mem_encoders),
+                         "buffers", MEM_GET(mem_buffer_bytes),
+                         "lame", MEM_GET(mem_lame_bytes),
+                         "rss", rss);
+}
+
+
+static char mp3lame_cpu_features__doc__[] =
+"Returns a dict of the SIMD instruction sets of this CPU (keys 'mmx',\n"
+"'sse', 'sse2', 'sse3', 'ssse3', 'sse4_1', 'sse4_2', 'avx', 'avx2' and\n"
+"'fma', empty on other architectures) and 'lame_vendored', true when\n"
+"LAME was built along with this module (see setup.py).\n"
+"LAME picks its MMX/3DNow!/SSE code paths from the CPU at run time; use\n"
+"Encoder.set_asm_optimizations() to turn them off."
+;
+
+static PyObject *
+mp3lame_cpu_features(PyObject *self, PyObject *args)
+{
+    PyObject *features, *value;
+
+    features = PyDict_New();
+    if ( NULL == features )
+        return NULL;
+
+#define CPU_FEATURE(key, expr) \
+    value = PyBool_FromLong( expr ); \
+    if ( 0 > PyDict_SetItemString( features, key, value ) ) { \
+        Py_DECREF( value ); \
+        Py_DECREF( features ); \
+        return NULL; \
+    } \
+    Py_DECREF( value );
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    __builtin_cpu_init();
+    CPU_FEATURE( "mmx",    __builtin_cpu_supports( "mmx" ) )
+    CPU_FEATURE( "sse",    __builtin_cpu_supports( "sse" ) )
+    CPU_FEATURE( "sse2",   __builtin_cpu_supports( "sse2" ) )
+    CPU_FEATURE( "sse3",   __builtin_cpu_supports( "sse3" ) )
+    CPU_FEATURE( "ssse3",  __builtin_cpu_supports( "ssse3" ) )
+    CPU_FEATURE( "sse4_1", __builtin_cpu_supports( "sse4.1" ) )
+    CPU_FEATURE( "sse4_2", __builtin_cpu_supports( "sse4.2" ) )
+    CPU_FEATURE( "avx",    __builtin_cpu_supports( "avx" ) )
+    CPU_FEATURE( "avx2",   __builtin_cpu_supports( "avx2" ) )
+    CPU_FEATURE( "fma",    __builtin_cpu_supports( "fma" ) )
+#endif
+#ifdef PYLAME_VENDORED_LAME
+    CPU_FEATURE( "lame_vendored", 1 )
+#else
+    CPU_FEATURE( "lame_vendored", 0 )
+#endif
+#undef CPU_FEATURE
+
+    return features;
+}
+
+
+/* Objective quality measurement, see quality_report().  The decoded
+ * stream is compared with the source per segment; segments are spread
+ * over worker threads that run without the GIL. */
+
+#define QA_FFT_SIZE     1024    /* spectral distance analysis window */
+#define QA_SUBFRAME     256     /* segmental SNR frame, per channel */
+#define QA_NUM_BANDS    8
+#define QA_MAX_THREADS  64
+#define QA_SEGSNR_MIN   -10.0   /* usual clamping of segmental SNR */
+#define QA_SEGSNR_MAX   35.0
+
+/* Lower band edges in Hz, the last band ends at the Nyquist frequency. */
+static const double qa_band_edges[QA_NUM_BANDS] = {
+    0.0, 150.0, 400.0, 800.0, 1600.0, 3200.0, 6400.0, 12800.0
+};
+
+typedef struct {
+    const short *ref;           /* interleaved source */
+    const short *dec;           /* interleaved decoded output, aligned */
+    int channels;
+    int samplerate;
+    long segment;               /* samples per channel and segment */
+    long length;                /* samples per channel to compare */
+    int num_segments;
+    double *snr;
+    double *segmental_snr;
+    double *spectral;           /* num_segments * QA_NUM_BANDS */
+    long *clipped;
+} qa_shared;
+
+typedef struct {
+    qa_shared *shared;
+    int first;
+    int step;
+    int error;
+    pthread_t thread;
+} qa_worker;
+
+
+static double
+qa_db(double signal, double noise)
+{
+    if ( 0.0 >= noise )
+        return HUGE_VAL;
+    if ( 0.0 >= signal )
+        return -HUGE_VAL;
+    return 10.0 * log10( signal / noise );
+}
+
+
+/* In place radix 2 FFT of QA_FFT_SIZE points. */
+static void
+qa_fft(double *re, double *im, const double *cos_tab, const double *sin_tab)
+{
+    int i, j, k, len, half, step;
+    double t_re, t_im;
+
+    for (i = 1, j = 0; i < QA_FFT_SIZE; i++) {
+        k = QA_FFT_SIZE >> 1;
+        while ( j & k ) {
+            j ^= k;
+            k >>= 1;
+        }
+        j |= k;
+        if ( i < j ) {
+            t_re = re[i]; re[i] = re[j]; re[j] = t_re;
+            t_im = im[i]; im[i] = im[j]; im[j] = t_im;
+        }
+    }
+
+    for (len = 2; len <= QA_FFT_SIZE; len <<= 1) {
+        half = len >> 1;
+        step = QA_FFT_SIZE / len;
+        for (i = 0; i < QA_FFT_SIZE; i += len) {
+            for (j = 0; j < half; j++) {
+                double w_re = cos_tab[j * step];
+                double w_im = -sin_tab[j * step];
+                double *a_re = re + i + j, *a_im = im + i + j;
+                double *b_re = a_re + half, *b_im = a_im + half;
+
+                t_re = *b_re * w_re - *b_im * w_im;
+                t_im = *b_re * w_im + *b_im * w_re;
+                *b_re = *a_re - t_re;
+                *b_im = *a_im - t_im;
+                *a_re += t_re;
+                *a_im += t_im;
+            }
+        }
+    }
+}
+
+
+/* Band energies of a mono downmix of QA_FFT_SIZE frames starting at pcm,
+ * of which only avail are valid (the rest is taken as silence). */
+static void
+qa_band_energy(const qa_shared *s, const short *pcm, long avail,
+               double *re, double *im, const double *window,
+               const double *cos_tab, const double *sin_tab,
+               const int *band_of_bin, double *energy)
+{
+    long i;
+    int c;
+
+    for (i = 0; i < QA_FFT_SIZE; i++) {
+        double x = 0.0;
+
+        if ( i < avail ) {
+            for (c = 0; c < s->channels; c++)
+                x += pcm[i * s->channels + c];
+            x /= s->channels;
+        }
+        re[i] = x * window[i];
+        im[i] = 0.0;
+    }
+
+    qa_fft( re, im, cos_tab, sin_tab );
+
+    memset( energy, 0, QA_NUM_BANDS * sizeof(double) );
+    for (i = 0; i <= QA_FFT_SIZE / 2; i++)
+        energy[band_of_bin[i]] += re[i] * re[i] + im[i] * im[i];
+}
+
+
+static void *
+qa_worker_main(void *arg)
+{
+    qa_worker *w = (qa_worker *)arg;
+    qa_shared *s = w->shared;
+    double *re, *im, *window, *cos_tab, *sin_tab;
+    int band_of_bin[QA_FFT_SIZE / 2 + 1];
+    int seg, b, i;
+
+    re = malloc( 5 * QA_FFT_SIZE * sizeof(double) );
+    if ( NULL == re ) {
+        w->error = -1;
+        return NULL;
+    }
+    im = re + QA_FFT_SIZE;
+    window = im + QA_FFT_SIZE;
+    cos_tab = window + QA_FFT_SIZE;
+    sin_tab = cos_tab + QA_FFT_SIZE;
+
+    for (i = 0; i < QA_FFT_SIZE; i++) {
+        window[i] = 0.5 - 0.5 * cos( 2.0 * M_PI * i / QA_FFT_SIZE );
+        cos_tab[i] = cos( 2.0 * M_PI * i / QA_FFT_SIZE );
+        sin_tab[i] = sin( 2.0 * M_PI * i / QA_FFT_SIZE );
+    }
+    for (i = 0, b = 0; i <= QA_FFT_SIZE / 2; i++) {
+        double freq = (double)i * s->samplerate / QA_FFT_SIZE;
+
+        while ( QA_NUM_BANDS - 1 > b && qa_band_edges[b + 1] <= freq )
+            b++;
+        band_of_bin[i] = b;
+    }
+
+    for (seg = w->first; seg < s->num_segments; seg += w->step) {
+        long start = seg * s->segment;
+        long end = start + s->segment < s->length ?
+                   start + s->segment : s->length;
+        const short *ref = s->ref + start * s->channels;
+        const short *dec = s->dec + start * s->channels;
+        long n = (end - start) * s->channels;
+        long sub = (long)QA_SUBFRAME * s->channels;
+        double signal = 0.0, noise = 0.0, segsnr = 0.0;
+        double distance[QA_NUM_BANDS];
+        long clipped = 0, pos;
+        int subframes = 0, frames = 0;
+
+        /* SNR, segmental SNR and clipping */
+        for (pos = 0; pos < n; pos += sub) {
+            long stop = pos + sub < n ? pos + sub : n;
+            double sub_signal = 0.0, sub_noise = 0.0, db;
+            long k;
+
+            for (k = pos; k < stop; k++) {
+                double x = ref[k];
+                double e = x - dec[k];
+
+                sub_signal += x * x;
+                sub_noise += e * e;
+                if ( 32767 <= dec[k] || -32768 >= dec[k] )
+                    clipped++;
+            }
+            signal += sub_signal;
+            noise += sub_noise;
+
+            db = qa_db( sub_signal, sub_noise );
+            if ( QA_SEGSNR_MIN > db )
+                db = QA_SEGSNR_MIN;
+            else if ( QA_SEGSNR_MAX < db )
+                db = QA_SEGSNR_MAX;
+            segsnr += db;
+            subframes++;
+        }
+
+        /* mean absolute difference of the band levels in dB */
+        memset( distance, 0, sizeof(distance) );
+        for (pos = 0; pos < end - start; pos += QA_FFT_SIZE) {
+            double e_ref[QA_NUM_BANDS], e_dec[QA_NUM_BANDS];
+            long avail = end - start - pos;
+
+            qa_band_energy( s, ref + pos * s->channels, avail, re, im,
+                            window, cos_tab, sin_tab, band_of_bin, e_ref );
+            qa_band_energy( s, dec + pos * s->channels, avail, re, im,
+                            window, cos_tab, sin_tab, band_of_bin, e_dec );
+            for (b = 0; b < QA_NUM_BANDS; b++)
+                distance[b] += fabs( 10.0 * log10( (e_ref[b] + 1.0) /
+                                                   (e_dec[b] + 1.0) ) );
+            frames++;
+        }
+
+        s->snr[seg] = qa_db( signal, noise );
+        s->segmental_snr[seg] = subframes ? segsnr / subframes : 0.0;
+        for (b = 0; b < QA_NUM_BANDS; b++)
+            s->spectral[seg * QA_NUM_BANDS + b] =
+                frames ? distance[b] / frames : 0.0;
+        s->clipped[seg] = clipped;
+    }
+
+    free( re );
+    return NULL;
+}
+
+
+/* Decode a whole MP3 stream into interleaved 16 bit samples.  Runs
+ * without the GIL, so it only uses malloc(). */
+static int
+qa_decode(const unsigned char *data, size_t len, short **out,
+          long *out_len, int *channels, int *samplerate)
+{
+    hip_t hip;
+    short pcm_l[1152 * 2], pcm_r[1152 * 2];
+    mp3data_struct mp3data;
+    short *buf = NULL;
+    long used = 0, size = 0;
+    size_t pos = 0;
+    int ret = 0;
+
+    hip = hip_decode_init();
+    if ( NULL == hip )
+        return -2;
+    hip_set_errorf( hip, quiet_lib_printf );
+    hip_set_debugf( hip, quiet_lib_printf );
+    hip_set_msgf( hip, quiet_lib_printf );
+
+    memset( &mp3data, 0, sizeof(mp3data) );
+    *channels = 0;
+    *samplerate = 0;
+
+    for (;;) {
+        size_t chunk = len - pos < 4096 ? len - pos : 4096;
+        int n;
+
+        /* feed a chunk, then drain the frames it completed; once it is
+         * all in, ask once more with nothing, as hip sits on what it was
+         * handed in one piece until it is asked again */
+        n = hip_decode1_headers( hip, (unsigned char *)data + pos, chunk,
+                                 pcm_l, pcm_r, &mp3data );
+        pos += chunk;
+
+        while ( 0 < n ) {
+            int i, ch = mp3data.stereo;
+
+            if ( 0 == *channels ) {
+                *channels = ch;
+                *samplerate = mp3data.samplerate;
+            }
+            if ( used + (long)n * ch > size ) {
+                short *grown;
+
+                size = (used + (long)n * ch) * 2 + 65536;
+                grown = realloc( buf, size * sizeof(short) );
+                if ( NULL == grown ) {
+                    ret = -2;
+                    goto out;
+                }
+                buf = grown;
+            }
+            for (i = 0; i < n; i++) {
+                buf[used++] = pcm_l[i];
+                if ( 2 == ch )
+                    buf[used++] = pcm_r[i];
+            }
+            n = hip_decode1_headers( hip, (unsigned char *)data, 0,
+                                     pcm_l, pcm_r, &mp3data );
+        }
+        if ( 0 > n ) {
+            ret = -1;
+            goto out;
+        }
+        if ( 0 == chunk )
+            break;
+    }
+
+  out:
+    hip_decode_exit( hip );
+    if ( 0 != ret ) {
+        free( buf );
+        return ret;
+    }
+    *out = buf;
+    *out_len = *channels ? used / *channels : 0;
+    return 0;
+}
+
+
+static char mp3lame_quality_report__doc__[] =
+"Decode MP3 data and compare it against the source audio.\n"
+"Parameter: source PCM (interleaved 16 bit, native byte order), MP3 data,\n"
+"           number of channels, samples per channel and segment\n"
+"           (default 44100), decoder output samples to skip before the\n"
+"           first source sample (default 1105: LAME's default encoder\n"
+"           delay of 576 plus the decoder delay of 529), number of\n"
+"           threads (default 0: one per online CPU)\n"
+"Returns a dict with one entry per segment in the arrays 'snr' and\n"
+"'segmental_snr' (dB), 'spectral_distance' (mean absolute band level\n"
+"difference in dB, 'bands' values per segment) and 'clipped' (decoded\n"
+"samples at full scale), plus 'bands' (lower band edges in Hz),\n"
+"'samplerate' and 'samples' (compared samples per channel).\n"
+"The source must be at the samplerate of the MP3 data.  The default offset\n"
+"assumes the data has no unpatched placeholder tag frame: write\n"
+"get_lametag_frame() over the first frame before, or the 1152 silent\n"
+"samples it decodes to shift the comparison by a frame.\n"
+;
+
+static PyObject *
+mp3lame_quality_report(PyObject *self, PyObject *args)
+{
+    PyObject *ref_arg, *mp3_arg, *result = NULL, *value, *bands;
+    Py_buffer ref, mp3;
+    int num_channels, threads = 0, i, ret;
+    long segment = 44100, offset = 576 + 529, dec_len = 0;
+    short *decoded = NULL;
+    int dec_channels, samplerate;
+    qa_shared shared;
+    qa_worker workers[QA_MAX_THREADS];
+    double *metrics = NULL;
+    long *clipped = NULL;
+
+    if ( !PyArg_ParseTuple( args, "OOi|lli", &ref_arg, &mp3_arg,
+                            &num_channels, &segment, &offset, &threads ) )
+        return NULL;
+
+    if ( 1 > num_channels || 2 < num_channels ) {
+        PyErr_SetString( PyExc_ValueError, "num_channels must be 1 or 2" );
+        return NULL;
+    }
+    if ( 1 > segment || 0 > offset ) {
+        PyErr_SetString( PyExc_ValueError,
+                         "segment must be positive and offset not negative" );
+        return NULL;
+    }
+
+    if ( 0 > PyObject_GetBuffer( ref_arg, &ref, PyBUF_SIMPLE ) )
+        return NULL;
+    if ( 0 > PyObject_GetBuffer( mp3_arg, &mp3, PyBUF_SIMPLE ) ) {
+        PyBuffer_Release( &ref );
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = qa_decode( (const unsigned char *)mp3.buf, mp3.len, &decoded,
+                     &dec_len, &dec_channels, &samplerate );
+    Py_END_ALLOW_THREADS
+
+    if ( -2 == ret ) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    if ( 0 != ret || 0 == dec_channels ) {
+        PyErr_SetString( MODULE_ERROR(self), "could not decode the MP3 data" );
+        goto out;
+    }
+    if ( dec_channels != num_channels ) {
+        PyErr_SetString( PyExc_ValueError,
+                         "MP3 data and source differ in the number of channels" );
+        goto out;
+    }
+
+    memset( &shared, 0, sizeof(shared) );
+    shared.ref = (const short *)ref.buf;
+    shared.dec = decoded + (offset < dec_len ? offset : dec_len) * num_channels;
+    shared.channels = num_channels;
+    shared.samplerate = samplerate;
+    shared.segment = segment;
+    shared.length = ref.len / (2 * num_channels);
+    if ( shared.length > dec_len - offset )
+        shared.length = offset < dec_len ? dec_len - offset : 0;
+    shared.num_segments = (int)((shared.length + segment - 1) / segment);
+
+    metrics = PyMem_Malloc( (shared.num_segments * (2 + QA_NUM_BANDS) + 1)
+                            * sizeof(double) );
+    clipped = PyMem_Malloc( (shared.num_segments + 1) * sizeof(long) );
+    if ( NULL == metrics || NULL == clipped ) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    shared.snr = metrics;
+    shared.segmental_snr = metrics + shared.num_segments;
+    shared.spectral = metrics + 2 * shared.num_segments;
+    shared.clipped = clipped;
+
+    if ( 0 >= threads ) {
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        threads = 0 < cpus ? (int)cpus : 1;
+    }
+    if ( threads > QA_MAX_THREADS )
+        threads = QA_MAX_THREADS;
+    if ( threads > shared.num_segments )
+        threads = shared.num_segments;
+
+    ret = 0;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < threads; i++) {
+        workers[i].shared = &shared;
+        workers[i].first = i;
+        workers[i].step = threads;
+        workers[i].error = 0;
+    }
+    /* the calling thread takes the first share itself */
+    for (i = 1; i < threads; i++)
+        if ( 0 != pthread_create( &workers[i].thread, NULL,
+                                  qa_worker_main, &workers[i] ) ) {
+            workers[i].error = -2;
+        }
+    if ( 0 < threads )
+        qa_worker_main( &workers[0] );
+    for (i = 1; i < threads; i++) {
+        if ( -2 == workers[i].error ) {
+            /* not started, do its share here */
+            workers[i].error = 0;
+            qa_worker_main( &workers[i] );
+        } else
+            pthread_join( workers[i].thread, NULL );
+    }
+    for (i = 0; i < threads; i++)
+        if ( workers[i].error )
+            ret = -1;
+    Py_END_ALLOW_THREADS
+
+    if ( 0 != ret ) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    result = PyDict_New();
+    if ( NULL == result )
+        goto out;
+
+#define QA_SET(key, expr) \
+    if ( NULL == (value = (expr)) || \
+         0 > PyDict_SetItemString( result, key, value ) ) { \
+        Py_XDECREF( value ); \
+        Py_CLEAR( result ); \
+        goto out; \
+    } \
+    Py_DECREF( value );
+
+    QA_SET( "snr", new_array( "d", shared.snr,
+                              shared.num_segments * sizeof(double) ) );
+    QA_SET( "segmental_snr", new_array( "d", shared.segmental_snr,
+                              shared.num_segments * sizeof(double) ) );
+    QA_SET( "spectral_distance", new_array( "d", shared.spectral,
+                              shared.num_segments * QA_NUM_BANDS * sizeof(double) ) );
+    QA_SET( "clipped", new_array( "l", shared.clipped,
+                              shared.num_segments * sizeof(long) ) );
+    QA_SET( "samplerate", PyInt_FromLong( samplerate ) );
+    QA_SET( "samples", PyInt_FromLong( shared.length ) );
+
+    bands = PyTuple_New( QA_NUM_BANDS );
+    if ( NULL != bands )
+        for (i = 0; i < QA_NUM_BANDS; i++)
+            PyTuple_SET_ITEM( bands, i, PyFloat_FromDouble( qa_band_edges[i] ) );
+    QA_SET( "bands", bands );
+#undef QA_SET
+
+  out:
+    free( decoded );
+    PyMem_Free( metrics );
+    PyMem_Free( clipped );
+    PyBuffer_Release( &mp3 );
+    PyBuffer_Release( &ref );
+    return result;
+}
+
+
+/* Loudness analysis, see loudness().  Peak, RMS and the integrated
+ * loudness of ITU-R BS.1770: K-weighting, mean square per 100 ms step,
+ * 400 ms gating blocks, an absolute gate at -70 LUFS and a relative gate
+ * 10 LU below the loudness of the blocks that pass it. */
+
+typedef struct {
+    double b0, b1, b2, a1, a2;
+} ld_biquad;
+
+/* The two K-weighting stages for the sample rate: a high shelf and a
+ * high pass (the BS.1770 filters, redesigned for rates besides 48 kHz
+ * like libebur128 does). */
+static void
+ld_k_weighting(double rate, ld_biquad *shelf, ld_biquad *hp)
+{
+    double f0 = 1681.974450955533, g = 3.999843853973347;
+    double q = 0.7071752369554196, k, vh, vb, a0;
+
+    k = tan(M_PI * f0 / rate);
+    vh = pow(10.0, g / 20.0);
+    vb = pow(vh, 0.4996667741545416);
+    a0 = 1.0 + k / q + k * k;
+    shelf->b0 = (vh + vb * k / q + k * k) / a0;
+    shelf->b1 = 2.0 * (k * k - vh) / a0;
+    shelf->b2 = (vh - vb * k / q + k * k) / a0;
+    shelf->a1 = 2.0 * (k * k - 1.0) / a0;
+    shelf->a2 = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / rate);
+    a0 = 1.0 + k / q + k * k;
+    hp->b0 = 1.0;
+    hp->b1 = -2.0;
+    hp->b2 = 1.0;
+    hp->a1 = 2.0 * (k * k - 1.0) / a0;
+    hp->a2 = (1.0 - k / q + k * k) / a0;
+}
+
+typedef struct {
+    const unsigned char *pcm;
+    size_t frames;
+    int channels;
+    int step;                   /* frames per 100 ms */
+    int swap;                   /* byte swapped samples */
+    int peak;                   /* largest magnitude */
+    double sum_squares;         /* of the samples, full scale 1.0 */
+    double *steps;              /* K-weighted mean square per step */
+    size_t num_steps;
+} ld_job;
+
+static double
+ld_sample(const unsigned char *p, int swap, int *peak)
+{
+    uint16_t u;
+    int16_t  x;
+    int      a;
+
+    memcpy(&u, p, 2);
+    if ( swap )
+        u = (uint16_t)(u << 8 | u >> 8);
+    x = (int16_t)u;
+    a = x < 0 ? -(int)x : x;
+    if ( a > *peak )
+        *peak = a;
+    return x / 32768.0;
+}
+
+/* One pass over the audio.  Stereo runs both channels through the
+ * filters at once in SSE2 registers.  Runs without the GIL. */
+static void
+ld_analyze(ld_job *j, double rate)
+{
+    ld_biquad sh, hp;
+    const unsigned char *p = j->pcm;
+    double acc = 0.0, sq = 0.0, x[2], y;
+    double s1[2][2] = {{0, 0}, {0, 0}}, s2[2][2] = {{0, 0}, {0, 0}};
+    size_t i;
+    int c, n = 0, peak = 0;
+
+    ld_k_weighting(rate, &sh, &hp);
+    j->num_steps = 0;
+
+#ifdef __SSE2__
+    if ( 2 == j->channels ) {
+        __m128d z1a = _mm_setzero_pd(), z2a = _mm_setzero_pd();
+        __m128d z1b = _mm_setzero_pd(), z2b = _mm_setzero_pd();
+        __m128d vacc = _mm_setzero_pd(), vsq = _mm_setzero_pd();
+        double out[2];
+
+        for (i = 0; i < j->frames; i++, p += 4) {
+            __m128d v, w;
+
+            x[0] = ld_sample(p, j->swap, &peak);
+            x[1] = ld_sample(p + 2, j->swap, &peak);
+            v = _mm_loadu_pd(x);
+            vsq = _mm_add_pd(vsq, _mm_mul_pd(v, v));
+            /* transposed direct form II, both channels per register */
+            w = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(sh.b0), v), z1a);
+            z1a = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(_mm_set1_pd(sh.b1), v),
+                                        _mm_mul_pd(_mm_set1_pd(sh.a1), w)),
+                             z2a);
+            z2a = _mm_sub_pd(_mm_mul_pd(_mm_set1_pd(sh.b2), v),
+                             _mm_mul_pd(_mm_set1_pd(sh.a2), w));
+            v = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(hp.b0), w), z1b);
+            z1b = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(_mm_set1_pd(hp.b1), w),
+                                        _mm_mul_pd(_mm_set1_pd(hp.a1), v)),
+                             z2b);
+            z2b = _mm_sub_pd(_mm_mul_pd(_mm_set1_pd(hp.b2), w),
+                             _mm_mul_pd(_mm_set1_pd(hp.a2), v));
+            vacc = _mm_add_pd(vacc, _mm_mul_pd(v, v));
+            if ( ++n == j->step ) {
+                _mm_storeu_pd(out, vacc);
+                j->steps[j->num_steps++] = (out[0] + out[1]) / n;
+                vacc = _mm_setzero_pd();
+                n = 0;
+            }
+        }
+        _mm_storeu_pd(out, vsq);
+        j->sum_squares = out[0] + out[1];
+        j->peak = peak;
+        return;
+    }
+#endif
+
+    for (i = 0; i < j->frames; i++) {
+        for (c = 0; c < j->channels; c++, p += 2) {
+            x[0] = ld_sample(p, j->swap, &peak);
+            sq += x[0] * x[0];
+            y = sh.b0 * x[0] + s1[0][c];
+            s1[0][c] = sh.b1 * x[0] - sh.a1 * y + s2[0][c];
+            s2[0][c] = sh.b2 * x[0] - sh.a2 * y;
+            x[1] = hp.b0 * y + s1[1][c];
+            s1[1][c] = hp.b1 * y - hp.a1 * x[1] + s2[1][c];
+            s2[1][c] = hp.b2 * y - hp.a2 * x[1];
+            acc += x[1] * x[1];
+        }
+        if ( ++n == j->step ) {
+            j->steps[j->num_steps++] = acc / n;
+            acc = 0.0;
+            n = 0;
+        }
+    }
+    j->sum_squares = sq;
+    j->peak = peak;
+}
+
+/* Gated integrated loudness in LUFS, or 1.0 if no block passes. */
+static double
+ld_integrated(const double *steps, size_t num_steps)
+{
+    double z, sum = 0.0, gate;
+    size_t i, count = 0;
+
+    if ( 4 > num_steps )
+        return 1.0;
+
+    for (i = 0; i + 4 <= num_steps; i++) {
+        z = (steps[i] + steps[i + 1] + steps[i + 2] + steps[i + 3]) / 4.0;
+        if ( -0.691 + 10.0 * log10(z) > -70.0 ) {
+            sum += z;
+            count++;
+        }
+    }
+    if ( 0 == count )
+        return 1.0;
+
+    gate = -0.691 + 10.0 * log10(sum / count) - 10.0;
+    sum = 0.0;
+    count = 0;
+    for (i = 0; i + 4 <= num_steps; i++) {
+        z = (steps[i] + steps[i + 1] + steps[i + 2] + steps[i + 3]) / 4.0;
+        if ( -0.691 + 10.0 * log10(z) > -70.0
+             && -0.691 + 10.0 * log10(z) > gate ) {
+            sum += z;
+            count++;
+        }
+    }
+    return 0 == count ? 1.0 : -0.691 + 10.0 * log10(sum / count);
+}
+
+
+static char mp3lame_loudness__doc__[] =
+"Measure 16 bit interleaved audio for normalization.\n"
+"Parameter: source (a buffer, or a file descriptor or file whose data is\n"
+"           mapped into memory), number of channels (1 or 2),\n"
+"           samplerate, byte offset of the audio in a file (default 0),\n"
+"           its length in bytes (default -1: to the end of the file),\n"
+"           byte swap (default 0: native byte order)\n"
+"Returns a dict with 'peak' (largest sample magnitude, full scale 1.0),\n"
+"'peak_db' and 'rms_db' (dBFS), 'loudness' (integrated loudness after\n"
+"ITU-R BS.1770 in LUFS, None for less than 400 ms or only silence) and\n"
+"'samples' (per channel).  The analysis runs without the GIL.\n"
+;
+
+static PyObject *
+mp3lame_loudness(PyObject *self, PyObject *args)
+{
+    PyObject     *source, *loudness, *result = NULL;
+    Py_buffer     view;
+    int           channels, samplerate, swap = 0, fd = -1;
+    Py_ssize_t    offset = 0, length = -1;
+    void         *map = MAP_FAILED;
+    size_t        map_len = 0;
+    long          page;
+    struct stat   st;
+    ld_job        job;
+    double        integrated;
+
+    if ( !PyArg_ParseTuple( args, "Oii|nni", &source, &channels,
+                            &samplerate, &offset, &length, &swap ) )
+        return NULL;
+
+    if ( 1 > channels || 2 < channels || 0 >= samplerate || 0 > offset ) {
+        PyErr_SetString( PyExc_ValueError,
+                         "need 1 or 2 channels, a samplerate and offset >= 0" );
+        return NULL;
+    }
+
+    memset( &job, 0, sizeof(job) );
+    view.obj = NULL;
+    if ( PyObject_CheckBuffer( source ) ) {
+        if ( 0 > PyObject_GetBuffer( source, &view, PyBUF_SIMPLE ) )
+            return NULL;
+        if ( offset > view.len )
+            offset = view.len;
+        if ( 0 > length || length > view.len - offset )
+            length = view.len - offset;
+        job.pcm = (const unsigned char *)view.buf + offset;
+    } else {
+        fd = PyObject_AsFileDescriptor( source );
+        if ( 0 > fd )
+            return NULL;
+        if ( 0 > fstat( fd, &st ) )
+            return PyErr_SetFromErrno( PyExc_OSError );
+        if ( offset > st.st_size )
+            offset = st.st_size;
+        if ( 0 > length || length > st.st_size - offset )
+            length = st.st_size - offset;
+        if ( 0 < length ) {
+            page = sysconf( _SC_PAGESIZE );
+            map_len = offset % page + length;
+            map = mmap( NULL, map_len, PROT_READ, MAP_PRIVATE, fd,
+                        offset - offset % page );
+            if ( MAP_FAILED == map )
+                return PyErr_SetFromErrno( PyExc_OSError );
+            madvise( map, map_len, MADV_SEQUENTIAL );
+            job.pcm = (const unsigned char *)map + offset % page;
+        }
+    }
+
+    job.channels = channels;
+    job.frames = length / (2 * channels);
+    job.swap = 0 != swap;
+    job.step = samplerate / 10 ? samplerate / 10 : 1;
+    job.steps = PyMem_Malloc( (job.frames / job.step + 1) * sizeof(double) );
+    if ( NULL == job.steps ) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ld_analyze( &job, samplerate );
+    integrated = ld_integrated( job.steps, job.num_steps );
+    Py_END_ALLOW_THREADS
+
+    if ( 0.0 < integrated ) {
+        Py_INCREF( Py_None );
+        loudness = Py_None;
+    } else {
+        loudness = PyFloat_FromDouble( integrated );
+        if ( NULL == loudness )
+            goto out;
+    }
+
+    result = Py_BuildValue( "{s:d,s:d,s:d,s:N,s:n}",
+        "peak", job.peak / 32768.0,
+        "peak_db", job.peak ? 20.0 * log10(job.peak / 32768.0) : -HUGE_VAL,
+        "rms_db", 0.0 < job.sum_squares
+                  ? 10.0 * log10(job.sum_squares / (job.frames * channels))
+                  : -HUGE_VAL,
+        "loudness", loudness,
+        "samples", (Py_ssize_t)job.frames );
+
+  out:
+    PyMem_Free( job.steps );
+    if ( MAP_FAILED != map )
+        munmap( map, map_len );
+    if ( NULL != view.obj )
+        PyBuffer_Release( &view );
+    return result;
+}
+
+
+/* BEGIN frame level editing */
+
+/* CRC-16 (polynomial 0x8005, reflected) of the LAME tag and music CRC. */
+static const unsigned short crc16_table[256] = {
+    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+
+typedef struct {
+    unsigned long  *offsets;
+    unsigned short *frame_bytes;
+    unsigned short *main_data_begin;
+    unsigned short *bitrate;
+    Py_ssize_t      len;
+    Py_ssize_t      size;
+    mpeg_header     first;
+    size_t          start;          /* behind a leading ID3v2 tag */
+    size_t          end;            /* behind the last frame */
+    long            tag_offset;     /* Xing/Info frame, -1 if none */
+    int             tag_bytes;
+    int             delay;          /* from the LAME tag, -1 if none */
+    int             padding;
+    unsigned long   sync_errors;
+} frame_table;
+
+
+static void
+frame_table_free(frame_table *t)
+{
+    free(t->offsets);
+    free(t->frame_bytes);
+    free(t->main_data_begin);
+    free(t->bitrate);
+}
+
+static int
+frame_table_append(frame_table *t, size_t offset, const unsigned char *frame,
+                   const mpeg_header *h)
+{
+    const unsigned char *side = frame + 4 + (h->crc ? 2 : 0);
+
+    if ( t->len == t->size ) {
+        Py_ssize_t size = t->size ? 2 * t->size : 4096;
+        void *p;
+
+#define FRAME_TABLE_GROW(field) \
+        p = realloc(t->field, size * sizeof(*t->field)); \
+        if ( NULL == p ) \
+            return -1; \
+        t->field = p;
+
+        FRAME_TABLE_GROW(offsets)
+        FRAME_TABLE_GROW(frame_bytes)
+        FRAME_TABLE_GROW(main_data_begin)
+        FRAME_TABLE_GROW(bitrate)
+#undef FRAME_TABLE_GROW
+        t->size = size;
+    }
+
+    t->offsets[t->len] = (unsigned long)offset;
+    t->frame_bytes[t->len] = h->size;
+    t->main_data_begin[t->len] = h->lsf ? side[0]
+                                        : (side[0] << 1) | (side[1] >> 7);
+    t->bitrate[t->len] = h->bitrate;
+    t->len++;
+    return 0;
+}
+
+/* Read the encoder delay and padding from the LAME tag behind the Xing
+ * header of a tag frame. */
+static void
+frame_table_lame_tag(frame_table *t, const unsigned char *frame,
+                     const mpeg_header *h)
+{
+    const unsigned char *p = frame + 4 + (h->crc ? 2 : 0) + h->side_info;
+    const unsigned char *end = frame + h->size;
+    int flags = p[7];
+
+    p += 8;
+    if ( flags & 1 )
+        p += 4;                 /* frames */
+    if ( flags & 2 )
+        p += 4;                 /* bytes */
+    if ( flags & 4 )
+        p += 100;               /* TOC */
+    if ( flags & 8 )
+        p += 4;                 /* quality */
+    if ( p + 36 > end || (0 != memcmp(p, "LAME", 4)
+                          && 0 != memcmp(p, "L3.99", 5)) )
+        return;
+    t->delay = (p[21] << 4) | (p[22] >> 4);
+    t->padding = ((p[22] & 15) << 8) | p[23];
+}
 
+/* Build the frame table of an MP3 stream.  Frames must agree with the
+ * first one in version, samplerate and channels; anything else is
+ * skipped byte by byte.  Runs without the GIL.  Returns 0 or -1 if out
+ * of memory. */
 static int
-mp3enc_setattr_mode(Encoder *self, PyObject *value, void *closure)
+frame_table_build(frame_table *t, const unsigned char *data, size_t len)
 {
-    if (value == NULL) {
-        PyErr_SetString(PyExc_AttributeError,
-                        "Cannot delete the 'mode' attribute.");
-        return -1;
+    mpeg_header h, next;
+    size_t pos = 0;
+
+    memset(t, 0, sizeof(*t));
+    t->tag_offset = -1;
+    t->delay = -1;
+    t->padding = -1;
+
+    if ( 10 <= len && 0 == memcmp(data, "ID3", 3)
+         && !((data[6] | data[7] | data[8] | data[9]) & 0x80) ) {
+        pos = 10 + (((size_t)data[6] << 21) | (data[7] << 14)
+                    | (data[8] << 7) | data[9]);
+        if ( data[5] & 0x10 )
+            pos += 10;          /* footer */
+        if ( pos > len )
+            pos = len;
     }
-
-    if (!PyInt_Check(value)) {
-        PyErr_SetString(PyExc_TypeError, "Attribute 'mode' must be an integer.");
-        return -1;
+    t->start = pos;
+    t->end = pos;
+
+    while ( pos + 4 <= len ) {
+        if ( 0 > parse_mpeg_header(data + pos, &h) || pos + h.size > len
+             || (0 < t->len && (h.lsf != t->first.lsf
+                                || h.samplerate != t->first.samplerate
+                                || h.channels != t->first.channels)) ) {
+            pos++;
+            t->sync_errors++;
+            continue;
+        }
+        if ( 0 == t->len && -1 == t->tag_offset ) {
+            /* insist on a second frame behind the first one */
+            if ( pos + h.size + 4 <= len
+                 && 0 > parse_mpeg_header(data + pos + h.size, &next) ) {
+                pos++;
+                t->sync_errors++;
+                continue;
+            }
+            if ( scan_is_tag_frame(data + pos, &h) ) {
+                t->tag_offset = (long)pos;
+                t->tag_bytes = h.size;
+                frame_table_lame_tag(t, data + pos, &h);
+                pos += h.size;
+                continue;
+            }
+        }
+        if ( 0 == t->len )
+            t->first = h;
+        if ( 0 > frame_table_append(t, pos, data + pos, &h) )
+            return -1;
+        pos += h.size;
+        t->end = pos;
     }
+    return 0;
+}
 
-    if (0 != lame_set_mode(self->gfp, PyInt_AS_LONG(value))) {
-        PyErr_SetString(PyExc_ValueError, "Set 'mode' failed (out of range?).");
-        return -1;
+
+static char mp3lame_mp3_frames__doc__[] =
+"Parse the layer III frames of MP3 data, e.g. for cutting it.\n"
+"Parameter: MP3 data\n"
+"Returns a dict with the arrays 'offsets', 'frame_bytes',\n"
+"'main_data_begin' and 'bitrate' (one entry per audio frame), the\n"
+"'samplerate', 'channels', 'mode' and 'samples_per_frame' of the first\n"
+"frame, 'header_bytes' (header, CRC and side info in front of the main\n"
+"data), 'start' and 'end' of the frames (behind an ID3v2 tag, in front\n"
+"of trailing tags), 'tag' ((offset, size) of the Xing/Info frame or\n"
+"None), 'delay' and 'padding' from the LAME tag (-1 without one) and\n"
+"'sync_errors' (bytes skipped).  Parsing runs without the GIL.\n"
+;
+
+static PyObject *
+mp3lame_mp3_frames(PyObject *self, PyObject *arg)
+{
+    PyObject   *result = NULL, *offsets = NULL, *frame_bytes = NULL;
+    PyObject   *main_data_begin = NULL, *bitrate = NULL, *tag;
+    Py_buffer   view;
+    frame_table t;
+    int         ret;
+
+    if ( 0 > PyObject_GetBuffer( arg, &view, PyBUF_SIMPLE ) )
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = frame_table_build( &t, (const unsigned char *)view.buf, view.len );
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release( &view );
+
+    if ( 0 > ret ) {
+        PyErr_NoMemory();
+        goto out;
     }
 
-    return 0;
+    offsets = new_array( "L", t.offsets, t.len * sizeof(unsigned long) );
+    frame_bytes = new_array( "H", t.frame_bytes,
+                             t.len * sizeof(unsigned short) );
+    main_data_begin = new_array( "H", t.main_data_begin,
+                                 t.len * sizeof(unsigned short) );
+    bitrate = new_array( "H", t.bitrate, t.len * sizeof(unsigned short) );
+    if ( NULL == offsets || NULL == frame_bytes || NULL == main_data_begin
+         || NULL == bitrate )
+        goto out;
+
+    if ( 0 <= t.tag_offset )
+        tag = Py_BuildValue( "(li)", t.tag_offset, t.tag_bytes );
+    else {
+        Py_INCREF( Py_None );
+        tag = Py_None;
+    }
+    if ( NULL == tag )
+        goto out;
+
+    result = Py_BuildValue( "{s:O,s:O,s:O,s:O,s:i,s:i,s:i,s:i,s:i,s:n,s:n,"
+                            "s:N,s:i,s:i,s:k}",
+        "offsets", offsets,
+        "frame_bytes", frame_bytes,
+        "main_data_begin", main_data_begin,
+        "bitrate", bitrate,
+        "samplerate", t.first.samplerate,
+        "channels", t.first.channels,
+        "mode", t.first.mode,
+        "samples_per_frame", t.len ? (t.first.lsf ? 576 : 1152) : 0,
+        "header_bytes", t.len ? 4 + (t.first.crc ? 2 : 0)
+                                + t.first.side_info : 0,
+        "start", (Py_ssize_t)t.start,
+        "end", (Py_ssize_t)t.end,
+        "tag", tag,
+        "delay", t.delay,
+        "padding", t.padding,
+        "sync_errors", t.sync_errors );
+
+  out:
+    Py_XDECREF( offsets );
+    Py_XDECREF( frame_bytes );
+    Py_XDECREF( main_data_begin );
+    Py_XDECREF( bitrate );
+    frame_table_free( &t );
+    return result;
 }
 
-static PyGetSetDef mp3enc_getseters[] = {
-    {"in_samplerate",
-     (getter)mp3enc_get_in_samplerate, (setter)mp3enc_set_in_samplerate,
-    "Input sample rate in Hz.", NULL},
-    {"num_channels",
-     (getter)mp3enc_get_num_channels, (setter)mp3enc_set_num_channels,
-    "Number of channels in the input stream.", NULL},
-    {"scale",
-     (getter)mp3enc_get_scale, (setter)mp3enc_set_scale,
-    "Scale the input by this amount before encoding.", NULL},
-    {"scale_left",
-     (getter)mp3enc_get_scale_left, (setter)mp3enc_set_scale_left,
-    "Scale channel 0 (left) of the input by this amount before encoding.", NULL},
-    {"scale_right",
-     (getter)mp3enc_get_scale_right, (setter)mp3enc_set_scale_right,
-    "Scale channel 1 (right) of the input by this amount before encoding.", NULL},
-    {"copyright",
-     (getter)mp3enc_get_copyright, (setter)mp3enc_set_copyright,
-     "Copyright bit.", NULL},
-    {"original",
-     (getter)mp3enc_get_original, (setter)mp3enc_set_original,
-     "Original bit.", NULL},
-    {"frame_num",
-     (getter)mp3enc_get_frameNum, (setter)NULL,
-     "Number of frames encoded (read-only).", NULL},
-    {"total_frames",
-     (getter)mp3enc_get_totalframes, (setter)NULL,
-     "Get estimate of the total number of frames to be encoded, only valid\n"
-     "if the calling program set num_samples (read-only).", NULL},
-    {"mode",
-     (getter)mp3enc_get_mode, (setter)mp3enc_setattr_mode,
-     "MPEG mode using MPEG_MODE_* constants.", NULL},
-    {NULL, NULL, NULL, NULL, NULL} /* Sentinel */
-};
 
-/* Encoder type declaration */
-static PyTypeObject EncoderType = {
-        PyObject_HEAD_INIT(NULL)
-        0,                              /* ob_size */
-        "_lame.Encoder",                /* tp_name */
-        sizeof(Encoder),                /* tp_basicsize */
-        0,                              /* tp_itemsize */
-        /* methods */
-        (destructor)mp3enc_dealloc,     /* tp_dealloc */
-        0,                              /* tp_print */
-        0,                              /* tp_getattr */
-        0,                              /* tp_setattr */
-        0,                              /* tp_compare */
-        0,                              /* tp_repr */
-        0,                              /* tp_as_number */
-        0,                              /* tp_as_sequence */
-        0,                              /* tp_as_mapping */
-        0,                              /* tp_hashg */
-        0,                              /* tp_call */
-        0,                              /* tp_str */
-        0,                              /* tp_getattro */
-        0,                              /* tp_setattro */
-        0,                              /* tp_as_buffer */
-        Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
-        "Encoder object.",              /* tp_doc */
-        0,                              /* tp_traverse */
-        0,                              /* tp_clear */
-        0,                              /* tp_richcompare */
-        0,                              /* tp_weaklistoffset */
-        0,                              /* tp_iter */
-        0,                              /* tp_iternext */
-        mp3enc_methods,                 /* TODO tp_methods */
-        0,                              /* tp_members */
-        mp3enc_getseters,               /* tp_getset */
-        0,                              /* tp_base */
-        0,                              /* tp_dict */
-        0,                              /* tp_descr_get */
-        0,                              /* tp_descr_set */
-        0,                              /* tp_dictoffset */
-        0,                              /* tp_init */
-        0,                              /* tp_alloc */
-        mp3enc_new,                     /* tp_new */
-};
+static char mp3lame_decode__doc__[] =
+"Decode MP3 data into interleaved 16 bit samples in native byte order.\n"
+"Parameter: MP3 data\n"
+"Returns a (samples, channels, samplerate) tuple.  Decoding runs without\n"
+"the GIL.\n"
+"C functions: hip_decode_init(), hip_decode1_headers(), hip_decode_exit()\n"
+;
+
+static PyObject *
+mp3lame_decode(PyObject *self, PyObject *arg)
+{
+    PyObject *result = NULL;
+    Py_buffer view;
+    short    *decoded = NULL;
+    long      len = 0;
+    int       channels, samplerate, ret;
 
+    if ( 0 > PyObject_GetBuffer( arg, &view, PyBUF_SIMPLE ) )
+        return NULL;
 
-/* BEGIN lame module functions */
+    Py_BEGIN_ALLOW_THREADS
+    ret = qa_decode( (const unsigned char *)view.buf, view.len, &decoded,
+                     &len, &channels, &samplerate );
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release( &view );
 
+    if ( -2 == ret )
+        return PyErr_NoMemory();
+    if ( 0 != ret ) {
+        PyErr_SetString( MODULE_ERROR(self), "could not decode the MP3 data" );
+        return NULL;
+    }
 
-static char mp3lame_version__doc__[] =
-"Returns the version of LAME in a tuple: (major, minor, alpha, beta,\n"
-"psy_major, sy_minor, psy_alpha, psy_beta, compile_time_features)"
+    result = Py_BuildValue( "(Nii)",
+        PyString_FromStringAndSize( (const char *)decoded,
+                                    len * channels * sizeof(short) ),
+        channels, samplerate );
+    free( decoded );
+    return result;
+}
+
+
+static char mp3lame_crc16__doc__[] =
+"Compute the CRC-16 LAME uses for the LAME tag and the music CRC.\n"
+"Parameter: data, CRC to continue from (default 0)\n"
+"Returns the CRC.\n"
 ;
 
 static PyObject *
-mp3lame_version(PyObject *self, PyObject *args)
+mp3lame_crc16(PyObject *self, PyObject *args)
 {
-    lame_version_t version;
+    PyObject            *data;
+    Py_buffer            view;
+    const unsigned char *p;
+    unsigned int         crc = 0;
+    Py_ssize_t           i;
 
-    get_lame_version_numerical(&version);
+    if ( !PyArg_ParseTuple( args, "O|I", &data, &crc ) )
+        return NULL;
+    if ( 0 > PyObject_GetBuffer( data, &view, PyBUF_SIMPLE ) )
+        return NULL;
 
-    return Py_BuildValue("iiiiiiiis",
-                         version.major,
-                         version.minor,
-                         version.alpha,
-                         version.beta,
-                         version.psy_major,
-                         version.psy_minor,
-                         version.psy_alpha,
-                         version.psy_beta,
-                         version.features);
+    p = (const unsigned char *)view.buf;
+    crc &= 0xffff;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < view.len; i++)
+        crc = (crc >> 8) ^ crc16_table[(crc ^ p[i]) & 0xff];
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release( &view );
+
+    return Py_BuildValue( "i", (int)crc );
 }
 
+/* END frame level editing */
+
 
 /* END lame module functions. */
 
@@ -1766,41 +6705,20 @@ mp3lame_version(PyObject *self, PyObject *args)
 
 static struct PyMethodDef mp3lame_methods[] = {
     {"version", (PyCFunction)mp3lame_version, METH_NOARGS, mp3lame_version__doc__},
+    {"cpu_features", (PyCFunction)mp3lame_cpu_features, METH_NOARGS, mp3lame_cpu_features__doc__},
+    {"memory_usage", (PyCFunction)mp3lame_memory_usage, METH_NOARGS, mp3lame_memory_usage__doc__},
+    {"quality_report", (PyCFunction)mp3lame_quality_report, METH_VARARGS, mp3lame_quality_report__doc__},
+    {"loudness", (PyCFunction)mp3lame_loudness, METH_VARARGS, mp3lame_loudness__doc__},
+    {"mp3_frames", (PyCFunction)mp3lame_mp3_frames, METH_O, mp3lame_mp3_frames__doc__},
+    {"decode", (PyCFunction)mp3lame_decode, METH_O, mp3lame_decode__doc__},
+    {"crc16", (PyCFunction)mp3lame_crc16, METH_VARARGS, mp3lame_crc16__doc__},
     {NULL}  /* Sentinel */
 };
 
-/* Initialization function for the module (*must* be called initlame) */
-
-static char lame_module_documentation[] =
-"Python module for the LAME encoder."
-;
-
-PyMODINIT_FUNC
-init_lame(void)
+/* Add the symbolic constants to the module; -1 on errors. */
+static int
+lame_add_constants(PyObject *m)
 {
-    PyObject *m;
-
-    if (PyType_Ready(&EncoderType) < 0)
-        return;
-
-    /* Create the module and add the functions */
-    m = Py_InitModule3("_lame", mp3lame_methods, lame_module_documentation);
-    if (NULL == m)
-        return;
-
-    /* Register the lame.Encoder object type */
-    Py_INCREF(&EncoderType);
-    PyModule_AddObject(m, "Encoder", (PyObject *)&EncoderType);
-
-    /* Set up the exceptions. */
-    EncoderError = PyErr_NewException("_lame.EncoderError",
-                                      PyExc_Exception, NULL);
-    if (EncoderError == NULL)
-        return;
-    Py_INCREF(EncoderError);
-    if (PyModule_AddObject(m, "EncoderError", EncoderError) < 0)
-        return;
-
     /* Add some symbolic constants to the module */
     /* String version constants for convenience. */
     PyModule_AddStringConstant(m, "LAME_VERSION",
@@ -1859,7 +6777,126 @@ init_lame(void)
     /* Defined at compile time. */
     PyModule_AddStringConstant(m, "module_version", PYLAME_VERSION);
 
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static char lame_module_documentation[] =
+"Python module for the LAME encoder."
+;
+
+#if PY_MAJOR_VERSION >= 3
+
+/* Multi-phase initialization (PEP 489): runs once for every interpreter
+ * that imports the module.  Nothing in the module or in LAME keeps
+ * Python objects in globals, so it declares support for interpreters
+ * with a GIL of their own (PEP 684). */
+static int
+lame_exec(PyObject *m)
+{
+    lame_state *st = MODULE_STATE(m);
+
+    st->EncoderType = (PyTypeObject *)PyType_FromModuleAndSpec(
+                          m, &encoder_spec, NULL);
+    if (NULL == st->EncoderType)
+        return -1;
+    if (0 > PyModule_AddType(m, st->EncoderType))
+        return -1;
+
+    st->EncoderError = PyErr_NewException("_lame.EncoderError",
+                                          PyExc_Exception, NULL);
+    if (NULL == st->EncoderError)
+        return -1;
+    if (0 > PyModule_AddObjectRef(m, "EncoderError", st->EncoderError))
+        return -1;
+
+    return lame_add_constants(m);
+}
+
+static int
+lame_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    lame_state *st = MODULE_STATE(m);
+
+    Py_VISIT(st->EncoderType);
+    Py_VISIT(st->EncoderError);
+    return 0;
+}
+
+static int
+lame_clear(PyObject *m)
+{
+    lame_state *st = MODULE_STATE(m);
+
+    Py_CLEAR(st->EncoderType);
+    Py_CLEAR(st->EncoderError);
+    return 0;
+}
+
+static void
+lame_free(void *m)
+{
+    lame_clear((PyObject *)m);
+}
+
+static PyModuleDef_Slot lame_slots[] = {
+    {Py_mod_exec, (void *)lame_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+    {0, NULL}
+};
+
+static struct PyModuleDef lame_module = {
+    PyModuleDef_HEAD_INIT,
+    "_lame",
+    lame_module_documentation,
+    sizeof(lame_state),
+    mp3lame_methods,
+    lame_slots,
+    lame_traverse,
+    lame_clear,
+    lame_free
+};
+
+PyMODINIT_FUNC
+PyInit__lame(void)
+{
+    return PyModuleDef_Init(&lame_module);
+}
+
+#else
+
+/* Initialization function for the module (*must* be called initlame) */
+
+PyMODINIT_FUNC
+init_lame(void)
+{
+    PyObject *m;
+
+    if (PyType_Ready(&EncoderType) < 0)
+        return;
+
+    /* Create the module and add the functions */
+    m = Py_InitModule3("_lame", mp3lame_methods, lame_module_documentation);
+    if (NULL == m)
+        return;
+
+    /* Register the lame.Encoder object type */
+    Py_INCREF(&EncoderType);
+    PyModule_AddObject(m, "Encoder", (PyObject *)&EncoderType);
+
+    /* Set up the exceptions. */
+    EncoderError = PyErr_NewException("_lame.EncoderError",
+                                      PyExc_Exception, NULL);
+    if (EncoderError == NULL)
+        return;
+    Py_INCREF(EncoderError);
+    if (PyModule_AddObject(m, "EncoderError", EncoderError) < 0)
+        return;
+
     /* Check for errors */
-    if (PyErr_Occurred())
+    if (0 > lame_add_constants(m))
         Py_FatalError("can't initialize module lame");
 }
+
+#endif
@@ -1,13 +1,119 @@
 #!/usr/bin/env python
 
-from distutils.core import setup
-from distutils.extension import Extension
+import os
+import re
+import subprocess
 
-pylame_version = r'"\"0.1\""'
+try:
+    from distutils.command.build_ext import build_ext
+    from distutils.core import setup
+    from distutils.errors import DistutilsSetupError
+    from distutils.extension import Extension
+    from distutils.spawn import find_executable
+except ImportError:
+    # Python 3.12 dropped distutils; setuptools carries it on.
+    from setuptools import Extension, setup
+    from setuptools.command.build_ext import build_ext
+    from setuptools.errors import SetupError as DistutilsSetupError
+    from shutil import which as find_executable
+
+version = '0.1'
+# Quoted for the C compiler, see PYLAME_VERSION in lamemodule.c.
+pylame_version = r'"\"%s\""' % version
+
+# Set PYLAME_LAME_SRC to an unpacked LAME source tree to build a static
+# libmp3lame along with the module instead of linking the installed one.
+# PYLAME_LAME_CFLAGS replaces the default optimization flags.
+lame_pinned_version = '3.100'
+lame_src = os.environ.get('PYLAME_LAME_SRC')
+lame_cflags = os.environ.get('PYLAME_LAME_CFLAGS', '-O3 -fomit-frame-pointer')
+# Set PYLAME_USDT=1 to build in the static tracepoints (needs sys/sdt.h,
+# e.g. from systemtap-sdt-dev).
+lame_usdt = os.environ.get('PYLAME_USDT', '') not in ('', '0')
+
+
+def lame_source_version(src):
+    """Return the version of the LAME source tree in src."""
+    try:
+        f = open(os.path.join(src, 'libmp3lame', 'version.h'))
+        try:
+            header = f.read()
+        finally:
+            f.close()
+    except IOError:
+        raise DistutilsSetupError('%s is not a LAME source tree' % src)
+
+    numbers = []
+    for name in ('LAME_MAJOR_VERSION', 'LAME_MINOR_VERSION'):
+        match = re.search(r'#define\s+%s\s+(\d+)' % name, header)
+        if not match:
+            raise DistutilsSetupError('no %s in %s' % (name, src))
+        numbers.append(match.group(1))
+    return '.'.join(numbers)
+
+
+class build_ext_lame(build_ext):
+    """build_ext that first builds LAME from PYLAME_LAME_SRC, if set."""
+
+    def run(self):
+        if lame_src:
+            self.build_lame(os.path.abspath(lame_src))
+        build_ext.run(self)
+
+    def build_lame(self, src):
+        version = lame_source_version(src)
+        if version != lame_pinned_version:
+            raise DistutilsSetupError('LAME %s is required, %s has %s'
+                                      % (lame_pinned_version, src, version))
+
+        build_dir = os.path.abspath(os.path.join(self.build_temp, 'lame'))
+        prefix = os.path.join(build_dir, 'install')
+        library = os.path.join(prefix, 'lib', 'libmp3lame.a')
+
+        if not os.path.exists(library):
+            self.mkpath(build_dir)
+            configure = [os.path.join(src, 'configure'),
+                         '--prefix=' + prefix,
+                         '--enable-static', '--disable-shared', '--with-pic',
+                         '--disable-frontend']
+            # The NASM routines bring the CPU detection LAME uses to pick
+            # its MMX/3DNow!/SSE code paths at run time.
+            if find_executable('nasm'):
+                configure.append('--enable-nasm')
+            else:
+                self.warn('nasm not found, LAME is built without its '
+                          'assembler routines and CPU detection')
+            env = dict(os.environ)
+            env['CFLAGS'] = lame_cflags
+            self.announce('building LAME %s in %s' % (version, build_dir), 2)
+            subprocess.check_call(configure, cwd=build_dir, env=env)
+            subprocess.check_call(['make'], cwd=build_dir)
+            subprocess.check_call(['make', 'install'], cwd=build_dir)
+
+        # xmm_quantize_sub.c is only built when configure finds SSE support.
+        f = open(library, 'rb')
+        try:
+            if b'init_xrpow_core_sse' not in f.read():
+                self.warn('LAME was built without its SSE quantization')
+        finally:
+            f.close()
+
+        for ext in self.extensions:
+            ext.include_dirs = [os.path.join(prefix, 'include')]
+            ext.library_dirs = []
+            ext.libraries = [lib for lib in ext.libraries
+                             if 'mp3lame' != lib] + ['m']
+            ext.extra_objects.append(library)
+            ext.define_macros.append(('PYLAME_VENDORED_LAME', '1'))
+
+
+lame_macros = [('PYLAME_VERSION', pylame_version)]
+if lame_usdt:
+    lame_macros.append(('PYLAME_USDT', '1'))
 
 lame_module = Extension('_lame',
                         ['lamemodule.c'],
-                        define_macros=[('PYLAME_VERSION', pylame_version)],
+                        define_macros=lame_macros,
                         include_dirs=['/usr/local/include'],
                         library_dirs=['/usr/local/lib'],
                         libraries=['mp3lame'],
@@ -15,15 +121,16 @@ lame_module = Extension('_lame',
 
 setup(name='py-lame',
       description='Python interface to the LAME encoder.',
-      version=pylame_version,
+      version=version,
       author='Alexander Leidinger',
       author_email='Alexander@Leidinger.net',
       maintainer='Kyle VanderBeek',
       maintainer_email='kylev@kylev.com',
       url='http://lame.sourceforge.net/',
       license='BSD',
+      cmdclass={'build_ext': build_ext_lame},
       ext_modules=[lame_module],
       py_modules=['lame'],
-      scripts=['slame'],
+      scripts=['slame', 'lamed'],
       data_files=[('share/docs/py-lame', ['README'])],
       )